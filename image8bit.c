@@ -22,8 +22,16 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "instrumentation.h"
 
 // The data structure
@@ -37,6 +45,13 @@
 // For example, in a 100-pixel wide image (img->width == 100),
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
+//
+// That is the default layout (LAYOUT_RASTER).  Images may instead use a
+// tiled layout, where the image is split in TSIZE x TSIZE tiles stored one
+// after another, and pixels within a tile are stored either in raster order
+// (LAYOUT_TILED) or in Morton (Z) order (LAYOUT_MORTON).  Tiled layouts
+// keep 2D neighbourhoods close in memory, which helps column-wise work.
+// Tiles on the right and bottom edges are padded to full size.
 // 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -45,12 +60,35 @@
 // Maximum value you can store in a pixel (maximum maxval accepted)
 const uint8 PixMax = 255;
 
+// Rectangles changed recently, per image (see markChanged)
+#define NCHANGES 8
+
+typedef struct {
+  int x, y, w, h;
+  unsigned long version;  // version of the image after its latest change
+} Change;
+
 // Internal structure for storing 8-bit graymap images
 struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  uint8* pixel; // pixel data (a raster scan, or tiles)
+  int layout;   // a PixelLayout: how pixels are stored in the pixel array
+  int tilesx;   // number of tiles per row (tiled layouts only)
+  void* map;    // if not NULL, pixel points into this mapping (of a
+                // file, or of anonymous memory, see pixelAlloc)
+  size_t mapsize; // size of the mapping
+  unsigned long version;  // incremented whenever pixels change
+  int nchanges;           // rectangles changed recently
+  Change changes[NCHANGES];
+  uint16_t* tileStats;    // min | max<<8 of each tile, or NULL (see ImageStats)
+  unsigned long statsVersion;  // version that tileStats reflect
+  uint8* blank;           // nonzero for each tile never written, or NULL if
+                          // there are none (see ImageCreate)
+  size_t nblank;          // number of blank tiles
+  uint64_t hash;          // content hash, if hashVersion == version + 1
+  unsigned long hashVersion;
 };
 
 
@@ -76,8 +114,8 @@ struct image {
 // Variable to preserve errno temporarily
 static int errsave = 0;
 
-// Error cause
-static char* errCause;
+// Error cause (per thread, as functions may be called from several threads)
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -142,315 +180,2070 @@ static int check(int condition, const char* failmsg) {
 
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of instrumentation counters.
+/// (Instrumentation is calibrated lazily, when first needed.)
 void ImageInit(void) { ///
-  InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
   
+  // Default number of worker threads: IMAGE_THREADS or online cpus
+  char* env = getenv("IMAGE_THREADS");
+  int n = (env != NULL) ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  ImageSetThreads(n);
+
+  // Default pixel layout: IMAGE_LAYOUT or raster
+  env = getenv("IMAGE_LAYOUT");
+  if (env != NULL && strcmp(env, "tiled") == 0) ImageSetLayout(LAYOUT_TILED);
+  if (env != NULL && strcmp(env, "morton") == 0) ImageSetLayout(LAYOUT_MORTON);
+
+  // Pixel kernels: IMAGE_KERNELS or the best the cpu supports
+  env = getenv("IMAGE_KERNELS");
+  if (env == NULL || !ImageSetKernels(env)) ImageSetKernels("auto");
+
+  // Huge pages for large images: IMAGE_HUGEPAGES (off, thp or explicit)
+  env = getenv("IMAGE_HUGEPAGES");
+  if (env != NULL && strcmp(env, "off") == 0) ImageSetHugePages(HUGEPAGES_OFF);
+  if (env != NULL && strcmp(env, "explicit") == 0) ImageSetHugePages(HUGEPAGES_EXPLICIT);
+
+  // Trace events of operations to file IMAGE_TRACE, if set
+  env = getenv("IMAGE_TRACE");
+  if (env != NULL && env[0] != '\0' && !InstrTraceStart(env)) perror(env);
 }
 
-// Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-// Add more macros here...
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+/// Parallel execution
 
+// Some operations split their work into independent chunks (usually bands
+// of rows) and run them on several threads.
+// The instrumentation counters are plain globals and not thread-safe, so
+// workers never touch them: each chunk function returns the number of
+// pixel accesses it made, and the caller adds the total to PIXMEM after
+// all workers are joined.
 
-/// Image management functions
+// Number of worker threads used by parallel operations (always >= 1)
+static int nthreads = 1;
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) { ///
-  assert (width >= 0);
-  assert (height >= 0);
-  assert (0 < maxval && maxval <= PixMax);
-  Image img = (Image)malloc(sizeof(struct image)); //initialize the pointer.
-  img->width = width; 
-  img->height = height;
-  img->maxval = maxval;
-  img->pixel = (uint8*)calloc(width*height, sizeof(uint8)); //using calloc instead of malloc for every value in the memory that is allocated to be set to 0, creating the black image of the size height*width
-  if (img == NULL || img->pixel ==  NULL){ 
-    errCause = "Not enough memory - memory allocation failed";
-    return NULL;
-  }
-  return img; //return img which is a pointer to acceptable values containing the width, height and maxval of this image
+/// Set the number of worker threads used by parallel operations.
+/// Values < 1 are treated as 1 (run everything in the calling thread).
+void ImageSetThreads(int n) { ///
+  nthreads = (n < 1) ? 1 : n;
 }
 
-/// Destroy the image pointed to by (*imgp).
-///   imgp : address of an Image variable.
-/// If (*imgp)==NULL, no operation is performed.
-/// Ensures: (*imgp)==NULL.
-/// Should never fail, and should preserve global errno/errCause.
-void ImageDestroy(Image *imgp) { ///
-  assert (imgp != NULL);
-  Image img = *imgp;   //dereference the pointer;
-  free(img->pixel);    //free the memory in the 1D array;
-  free(img);           //free the rest of the memory;
-  *imgp = NULL;        //delete the pointer;
+/// Get the number of worker threads used by parallel operations.
+int ImageThreads(void) { ///
+  return nthreads;
 }
 
+// Executor of chunks set by the application, or NULL
+static ImageExecutor executor = NULL;
+static void* executorCtx = NULL;
+
+/// Run the chunks of parallel operations with exec(ctx, ...), for instance
+/// on a thread pool of the application, instead of on threads started for
+/// each operation.  NULL restores the default.  The chunks are as many as
+/// the worker threads (see ImageSetThreads).
+void ImageSetExecutor(ImageExecutor exec, void* ctx) { ///
+  executor = exec;
+  executorCtx = ctx;
+}
 
-/// PGM file operations
+// Work function for a chunk [begin, end) of some range.
+// Returns the number of pixel accesses performed.
+typedef unsigned long (*ChunkFn)(void* arg, int begin, int end);
 
-// See also:
-// PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
+// Arguments for one worker thread
+struct chunk {
+  ChunkFn fn;
+  void* arg;
+  int begin, end;
+  unsigned long count;
+};
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+static void* chunkWorker(void* p) {
+  struct chunk* c = (struct chunk*)p;
+  c->count = c->fn(c->arg, c->begin, c->end);
+  return NULL;
+}
+
+// Run chunk i of array arg (task for the executor)
+static void chunkTask(void* arg, int i) {
+  chunkWorker(&((struct chunk*)arg)[i]);
+}
+
+// Run fn over [0, n), split into contiguous chunks of at least minChunk
+// elements, one per worker thread.
+// The chunks are handed to the executor, if any.  Otherwise, the first
+// chunk runs in the calling thread.  If a thread cannot be created, its
+// chunk also runs in the calling thread, so this never fails.
+// Returns the total number of pixel accesses reported by the chunks.
+static unsigned long parallelRun(int n, int minChunk, ChunkFn fn, void* arg) {
+  if (minChunk < 1) minChunk = 1;
+  int t = n / minChunk;
+  if (t > nthreads) t = nthreads;
+  if (t <= 1) return (n > 0) ? fn(arg, 0, n) : 0;
+
+  struct chunk c[t];
+  for (int i = 0; i < t; i++) {
+    c[i] = (struct chunk){ fn, arg, (int)((long)n*i/t), (int)((long)n*(i+1)/t), 0 };
   }
-  return i;
+  unsigned long count = 0;
+  if (executor != NULL && executor(executorCtx, t, chunkTask, c)) {
+    for (int i = 0; i < t; i++) count += c[i].count;
+    return count;
+  }
+  pthread_t tid[t];
+  int started[t];
+  for (int i = 0; i < t; i++) {
+    started[i] = (i > 0) && pthread_create(&tid[i], NULL, chunkWorker, &c[i]) == 0;
+  }
+  for (int i = 0; i < t; i++) {
+    if (!started[i]) chunkWorker(&c[i]);
+  }
+  for (int i = 0; i < t; i++) {
+    if (started[i]) pthread_join(tid[i], NULL);
+    count += c[i].count;
+  }
+  return count;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageLoad(const char* filename) { ///
-  int w, h;
-  int maxval;
-  char c;
-  FILE* f = NULL;
-  Image img = NULL;
+// Macros to simplify accessing instrumentation counters:
+#define PIXMEM InstrCount[0]
+// Add more macros here...
 
-  int success = 
-  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
-  // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
-  skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
-  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
-  // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
-  // Cleanup
-  if (!success) {
-    errsave = errno;
-    ImageDestroy(&img);
-    errno = errsave;
-  }
-  if (f != NULL) fclose(f);
-  return img;
+
+/// Pixel layouts
+
+// Tile size of the tiled layouts is TSIZE = 1<<TBITS
+#define TBITS 6
+#define TSIZE (1 << TBITS)
+#define TMASK (TSIZE - 1)
+
+// Layout of images created from now on
+static PixelLayout defaultLayout = LAYOUT_RASTER;
+
+// Bits of a coordinate within a tile, spread to even bit positions:
+// the Morton index of (x, y) within a tile is morton[x] + 2*morton[y].
+static const uint16_t morton[TSIZE] = {
+     0,    1,    4,    5,   16,   17,   20,   21,
+    64,   65,   68,   69,   80,   81,   84,   85,
+   256,  257,  260,  261,  272,  273,  276,  277,
+   320,  321,  324,  325,  336,  337,  340,  341,
+  1024, 1025, 1028, 1029, 1040, 1041, 1044, 1045,
+  1088, 1089, 1092, 1093, 1104, 1105, 1108, 1109,
+  1280, 1281, 1284, 1285, 1296, 1297, 1300, 1301,
+  1344, 1345, 1348, 1349, 1360, 1361, 1364, 1365,
+};
+
+/// Set the layout of images created or loaded from now on.
+/// Existing images keep their layout.  All functions accept images with
+/// any layout, and PGM files are always stored in raster order.
+void ImageSetLayout(PixelLayout layout) { ///
+  assert (layout == LAYOUT_RASTER || layout == LAYOUT_TILED || layout == LAYOUT_MORTON);
+  defaultLayout = layout;
 }
 
-/// Save image to PGM file.
-/// On success, returns nonzero.
-/// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
-int ImageSave(Image img, const char* filename) { ///
+/// Get the layout of images created or loaded from now on.
+PixelLayout ImageDefaultLayout(void) { ///
+  return defaultLayout;
+}
+
+/// Get the pixel layout of img.
+PixelLayout ImageLayout(Image img) { ///
   assert (img != NULL);
-  int w = img->width;
-  int h = img->height;
-  uint8 maxval = img->maxval;
-  FILE* f = NULL;
+  return (PixelLayout)img->layout;
+}
 
-  int success =
-  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+// Number of bytes in the pixel array of a width x height image.
+static size_t pixelBytes(int layout, int width, int height) {
+  if (layout == LAYOUT_RASTER) return (size_t)width*height;
+  size_t tilesx = (width + TMASK) >> TBITS;
+  size_t tilesy = (height + TMASK) >> TBITS;
+  return (tilesx*tilesy) << (2*TBITS);
+}
 
-  // Cleanup
-  if (f != NULL) fclose(f);
-  return success;
+// Transform (x, y) coords into linear pixel index.
+// This internal function is used in ImageGetPixel / ImageSetPixel. 
+// The returned index must satisfy (0 <= index < size of pixel array)
+// (Indexes are 64-bit: large images have more than 2^31 pixels.)
+static inline size_t G(Image img, int x, int y) {
+  assert( (x >= 0) && (y >= 0) );
+  size_t index;
+  if (img->layout == LAYOUT_RASTER) {
+    index = x + (size_t)y*ImageWidth(img); //for every y, we add another line = width elements  
+  } else {
+    size_t tile = (size_t)(y >> TBITS)*img->tilesx + (x >> TBITS);
+    if (img->layout == LAYOUT_TILED)
+      index = (tile << (2*TBITS)) + ((y & TMASK) << TBITS) + (x & TMASK);
+    else
+      index = (tile << (2*TBITS)) + morton[x & TMASK] + 2*morton[y & TMASK];
+  }
+  assert (index < pixelBytes(img->layout, img->width, img->height));
+  return index;
 }
 
+// Row access helpers
+//
+// Row kernels work on contiguous arrays of pixels.  In a raster image a
+// whole row is contiguous; in tiled layouts only the part of a row inside
+// a tile is (a pair of pixels, in Morton order).  These helpers move row
+// segments span by span, which is a single memcpy for raster images.
+
+// Return a pointer to pixel (x,y) and set *n to the number of pixels
+// from (x,y) rightwards, inside the image, that are contiguous in memory.
+static inline uint8* pixSpan(Image img, int x, int y, int* n) {
+  if (img->layout == LAYOUT_RASTER) *n = img->width - x;
+  else if (img->layout == LAYOUT_TILED) *n = TSIZE - (x & TMASK);
+  else *n = 2 - (x & 1);
+  if (*n > img->width - x) *n = img->width - x;
+  return img->pixel + G(img, x, y);
+}
 
-/// Information queries
+// Return a pointer to the n pixels of row y from x onwards, as a contiguous
+// array: directly into the image if possible, otherwise buf.
+// The pixels are copied into buf only if gather is nonzero.
+static uint8* rowPtr(Image img, int x, int y, int n, uint8* buf, int gather) {
+  int c;
+  uint8* p = pixSpan(img, x, y, &c);
+  if (c >= n) return p;
+  if (gather) {
+    for (int i = 0; i < n; i += c) {
+      p = pixSpan(img, x + i, y, &c);
+      if (c > n - i) c = n - i;
+      memcpy(buf + i, p, c);
+    }
+  }
+  return buf;
+}
 
-/// These functions do not modify the image and never fail.
+// Store n pixels from buf into row y from x onwards.
+// Does nothing if buf was returned by rowPtr as a direct pointer.
+static void rowPut(Image img, int x, int y, int n, const uint8* buf) {
+  int c;
+  for (int i = 0; i < n; i += c) {
+    uint8* p = pixSpan(img, x + i, y, &c);
+    if (p == buf + i) return;  // already in place
+    if (c > n - i) c = n - i;
+    memcpy(p, buf + i, c);
+  }
+}
 
-/// Get image width
-int ImageWidth(Image img) { ///
-  assert (img != NULL);
-  return img->width;
+// Copy n pixels from row sy of src (from sx) into row dy of dst (from dx).
+static void rowCopy(Image dst, int dx, int dy, Image src, int sx, int sy, int n) {
+  while (n > 0) {
+    int cd, cs;
+    uint8* d = pixSpan(dst, dx, dy, &cd);
+    uint8* s = pixSpan(src, sx, sy, &cs);
+    int c = (cd < cs) ? cd : cs;
+    if (c > n) c = n;
+    memcpy(d, s, c);
+    dx += c; sx += c; n -= c;
+  }
 }
 
-/// Get image height
-int ImageHeight(Image img) { ///
-  assert (img != NULL);
-  return img->height;
+
+/// Pixel kernels
+
+// The innermost loops of some operations are kernels that work on
+// contiguous arrays of pixels.  Each kernel has a portable scalar version,
+// which is the reference, and versions for some x86 instruction sets
+// (compiled with target attributes, so a generic build still has them).
+// ImageInit picks the best set of kernels the cpu supports.
+// All versions must give exactly the same results as the scalar one:
+// see ImageKernelSelfTest.
+
+typedef struct {
+  const char* name;
+  // p[i] = |maxval - p[i]|
+  void (*negate)(uint8* p, size_t n, uint8 maxval);
+  // p[i] = (p[i] >= thr) ? maxval : 0
+  void (*threshold)(uint8* p, size_t n, uint8 thr, uint8 maxval);
+  // dst[i] = (int)(src[i]*alpha + dst[i]*(1-alpha) + 0.5), clamped to [0, maxval]
+  void (*blend)(uint8* dst, const uint8* src, int n, double alpha, uint8 maxval);
+  // lower *min and raise *max to the extremes of p[0..n)
+  void (*minmax)(const uint8* p, size_t n, uint8* min, uint8* max);
+  // are a[0..n) and b[0..n) equal?
+  int (*equal)(const uint8* a, const uint8* b, int n);
+  // bit i of bits (LSB first in each word) = (p[i] >= thr), for i < n;
+  // the rest of the last word is cleared
+  void (*pack)(const uint8* p, int n, uint8 thr, uint64_t* bits);
+  // sum[i] += p[i], and sum[i] -= p[i] (column sums of the blur)
+  void (*colAdd)(uint32_t* sum, const uint8* p, int n);
+  void (*colSub)(uint32_t* sum, const uint8* p, int n);
+  // out[x] = (int)(s/(nx*ny) + 0.5), where s is the sum of the nx column
+  // sums colsum[x-dx..x+dx] that lie in [0, n) (the row pass of the blur)
+  void (*boxRow)(uint8* out, const uint32_t* colsum, int n, int dx, double ny);
+} Kernels;
+
+// Scalar kernels (the reference)
+
+static void negateScalar(uint8* p, size_t n, uint8 maxval) {
+  for (size_t i = 0; i < n; i++) p[i] = (uint8)abs(maxval - p[i]);
 }
 
-/// Get image maximum gray level
-int ImageMaxval(Image img) { ///
-  assert (img != NULL);
-  return img->maxval;
+static void thresholdScalar(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  for (size_t i = 0; i < n; i++) p[i] = (p[i] >= thr) ? maxval : 0;
 }
 
-/// Pixel stats
-/// Find the minimum and maximum gray levels in image.
-/// On return,
-/// *min is set to the minimum gray level in the image,
-/// *max is set to the maximum.
-void ImageStats(Image img, uint8* min, uint8* max) { ///
-  assert (img != NULL);
-  for ( int i = 0; i < ImageHeight(img)*ImageWidth(img) ; i++){
-    if ( *min > img->pixel[i]){*min = img->pixel[i];}
-    if ( *max < img->pixel[i]){*max = img->pixel[i];}
-  }
+static inline uint8 blendPixel(uint8 d, uint8 s, double alpha, double beta, uint8 maxval) {
+  int v = s*alpha + d*beta + 0.5;
+  if (v < 0) v = 0;
+  if (v > maxval) v = maxval;
+  return (uint8)v;
 }
 
-/// Check if pixel position (x,y) is inside img.
-int ImageValidPos(Image img, int x, int y) { ///
-  assert (img != NULL);
-  return (0 <= x && x < ImageWidth(img)) && (0 <= y && y < ImageHeight(img));
+static void blendScalar(uint8* dst, const uint8* src, int n, double alpha, uint8 maxval) {
+  double beta = 1 - alpha;
+  for (int i = 0; i < n; i++) dst[i] = blendPixel(dst[i], src[i], alpha, beta, maxval);
 }
 
-/// Check if rectangular area (x,y,w,h) is completely inside img.
-int ImageValidRect(Image img, int x, int y, int w, int h) { ///
-  assert (img != NULL);
-  if (w <= 0 || h <= 0) {return 0;}
-  
-  // making sure width and height values are not negative (which if they were to be, the image cropped could potentially give an inverted 
-   // cropped image) and also check if the position (x,y) is inside img.
-  return ( (ImageValidPos(img, x, y)) && ((x+w)<=ImageWidth(img)) && ((y+h)<=ImageHeight(img)) ); // returns 1 if the rectangle sides, starting from the point (x,y), are inside the image area.
+static void minmaxScalar(const uint8* p, size_t n, uint8* min, uint8* max) {
+  uint8 lo = *min, hi = *max;
+  for (size_t i = 0; i < n; i++) {
+    if (lo > p[i]) lo = p[i];
+    if (hi < p[i]) hi = p[i];
+  }
+  *min = lo;
+  *max = hi;
 }
 
-/// Pixel get & set operations
+static int equalScalar(const uint8* a, const uint8* b, int n) {
+  return memcmp(a, b, n) == 0;
+}
 
-/// These are the primitive operations to access and modify a single pixel
-/// in the image.
-/// These are very simple, but fundamental operations, which may be used to 
-/// implement more complex operations.
+static void packScalar(const uint8* p, int n, uint8 thr, uint64_t* bits) {
+  for (int i = 0; i < n; i += 64) {
+    uint64_t w = 0;
+    int c = (n - i < 64) ? n - i : 64;
+    for (int b = 0; b < c; b++) w |= (uint64_t)(p[i+b] >= thr) << b;
+    bits[i >> 6] = w;
+  }
+}
 
-// Transform (x, y) coords into linear pixel index.
-// This internal function is used in ImageGetPixel / ImageSetPixel. 
-// The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  assert( (x >= 0) && (y >= 0) );
-  int index = x + y*ImageWidth(img); //for every y, we add another line = width elements  
-  assert (0 <= index && index < ImageWidth(img)*ImageHeight(img));
-  return index;
+static void colAddScalar(uint32_t* sum, const uint8* p, int n) {
+  for (int i = 0; i < n; i++) sum[i] += p[i];
 }
 
-/// Get the pixel (level) at position (x,y).
-uint8 ImageGetPixel(Image img, int x, int y) { ///
-  assert (img != NULL);
-  assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
-  return img->pixel[G(img, x, y)];
-} 
+static void colSubScalar(uint32_t* sum, const uint8* p, int n) {
+  for (int i = 0; i < n; i++) sum[i] -= p[i];
+}
 
-/// Set the pixel at position (x,y) to new level.
-void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
-  assert (img != NULL);
-  assert (ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
-  img->pixel[G(img, x, y)] = level;
-} 
+// The row pass for columns [x0, x1) only.
+static void boxRowPart(uint8* out, const uint32_t* colsum, int n, int dx, double ny,
+                       int x0, int x1) {
+  uint64_t sum = 0;
+  for (int x = (x0 - dx > 0) ? x0 - dx : 0; x < x0 + dx && x < n; x++) sum += colsum[x];
+  for (int x = x0; x < x1; x++) {
+    if (x + dx < n) sum += colsum[x + dx];
+    int nx = ((x + dx < n) ? x + dx + 1 : n) - ((x - dx > 0) ? x - dx : 0);
+    out[x] = (uint8)((double)sum / (nx*ny) + 0.5);
+    if (x - dx >= 0) sum -= colsum[x - dx];
+  }
+}
 
+static void boxRowScalar(uint8* out, const uint32_t* colsum, int n, int dx, double ny) {
+  boxRowPart(out, colsum, n, dx, ny, 0, n);
+}
 
-/// Pixel transformations
+static const Kernels scalarKernels = {
+  "scalar", negateScalar, thresholdScalar, blendScalar, minmaxScalar, equalScalar,
+  packScalar, colAddScalar, colSubScalar, boxRowScalar
+};
 
-/// These functions modify the pixel levels in an image, but do not change
-/// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+
+// AVX-512 implies FMA, but fused multiply-adds would round differently
+// from the scalar code: keep them out of these kernels.
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+
+// SSE2 kernels (16 pixels at a time)
+
+__attribute__((target("sse2")))
+static void negateSSE2(uint8* p, size_t n, uint8 maxval) {
+  __m128i m = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+    v = _mm_or_si128(_mm_subs_epu8(m, v), _mm_subs_epu8(v, m));
+    _mm_storeu_si128((__m128i*)(p + i), v);
+  }
+  negateScalar(p + i, n - i, maxval);
+}
 
+__attribute__((target("sse2")))
+static void thresholdSSE2(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  __m128i t = _mm_set1_epi8((char)thr);
+  __m128i m = _mm_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+    __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(v, t), v);  // v >= thr
+    _mm_storeu_si128((__m128i*)(p + i), _mm_and_si128(ge, m));
+  }
+  thresholdScalar(p + i, n - i, thr, maxval);
+}
 
-/// Transform image to negative image.
-/// This transforms dark pixels to light pixels and vice-versa,
-/// resulting in a "photographic negative" effect.
-void ImageNegative(Image img) { ///
-  assert (img != NULL);
-  for (int x = 0; x < ImageWidth(img); x++){ //for every coordinate for x ∈ [0,width]
-    for (int y = 0; y < ImageHeight(img); y++){ // & y ∈ [0,height],
-      ImageSetPixel(img, x, y, abs(ImageMaxval(img)-ImageGetPixel(img, x, y))); // the pixel value ∈ [0,255] will be it's inverse, therefore 255 - absolute (value)
+// Blend in double precision, with the same operations as the scalar
+// kernel, so the results are identical.
+__attribute__((target("sse2")))
+static void blendSSE2(uint8* dst, const uint8* src, int n, double alpha, uint8 maxval) {
+  __m128d a = _mm_set1_pd(alpha);
+  __m128d b = _mm_set1_pd(1 - alpha);
+  __m128d half = _mm_set1_pd(0.5);
+  __m128i zero = _mm_setzero_si128();
+  __m128i m = _mm_set1_epi8((char)maxval);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i s16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(src + i)), zero);
+    __m128i d16 = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(dst + i)), zero);
+    __m128i s32[2] = { _mm_unpacklo_epi16(s16, zero), _mm_unpackhi_epi16(s16, zero) };
+    __m128i d32[2] = { _mm_unpacklo_epi16(d16, zero), _mm_unpackhi_epi16(d16, zero) };
+    __m128i r32[2];
+    for (int k = 0; k < 2; k++) {
+      __m128d slo = _mm_cvtepi32_pd(s32[k]);
+      __m128d shi = _mm_cvtepi32_pd(_mm_srli_si128(s32[k], 8));
+      __m128d dlo = _mm_cvtepi32_pd(d32[k]);
+      __m128d dhi = _mm_cvtepi32_pd(_mm_srli_si128(d32[k], 8));
+      __m128d rlo = _mm_add_pd(_mm_add_pd(_mm_mul_pd(slo, a), _mm_mul_pd(dlo, b)), half);
+      __m128d rhi = _mm_add_pd(_mm_add_pd(_mm_mul_pd(shi, a), _mm_mul_pd(dhi, b)), half);
+      r32[k] = _mm_unpacklo_epi64(_mm_cvttpd_epi32(rlo), _mm_cvttpd_epi32(rhi));
     }
+    __m128i r = _mm_packus_epi16(_mm_packs_epi32(r32[0], r32[1]), zero);  // clamp to [0, 255]
+    _mm_storel_epi64((__m128i*)(dst + i), _mm_min_epu8(r, m));
   }
+  blendScalar(dst + i, src + i, n - i, alpha, maxval);
 }
 
-/// Apply threshold to image.
-/// Transform all pixels with level<thr to black (0) and
-/// all pixels with level>=thr to white (maxval).
-void ImageThreshold(Image img, uint8 thr) { ///
-  assert (img != NULL);
-  for (int x = 0; x < ImageWidth(img); x++){ //for every coordinate for x ∈ [0,width]
-    for (int y = 0; y < ImageHeight(img); y++){ // & y ∈ [0,height],
-      ImageSetPixel(img, x, y, ( (ImageGetPixel(img, x, y)>=thr) * ImageMaxval(img)) );// ImageGetPixel returns the level of each pixel. If said level is bigger or equals
-      //to thr, it returns 1, if lower, returns 0. Then I multiply that result by the maxval: if true then it becomes 255 (maxvalue), if false it stays 0 (0*255 = 0).
+__attribute__((target("sse2")))
+static void minmaxSSE2(const uint8* p, size_t n, uint8* min, uint8* max) {
+  size_t i = 0;
+  if (n >= 16) {
+    __m128i lo = _mm_set1_epi8((char)*min), hi = _mm_set1_epi8((char)*max);
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((__m128i*)(p + i));
+      lo = _mm_min_epu8(lo, v);
+      hi = _mm_max_epu8(hi, v);
     }
+    uint8 l[16], h[16];
+    _mm_storeu_si128((__m128i*)l, lo);
+    _mm_storeu_si128((__m128i*)h, hi);
+    minmaxScalar(l, 16, min, max);
+    minmaxScalar(h, 16, min, max);
   }
+  minmaxScalar(p + i, n - i, min, max);
 }
 
-/// Brighten image by a factor.
-/// Multiply each pixel level by a factor, but saturate at maxval.
-/// This will brighten the image if factor>1.0 and
-/// darken the image if factor<1.0.
-void ImageBrighten(Image img, double factor) { ///
-  assert (img != NULL);
-  assert( factor > 0 );
-  for (int x = 0; x < ImageWidth(img); x++){ //for every coordinate for x ∈ [0,width]
-    for (int y = 0; y < ImageHeight(img); y++){ // & y ∈ [0,height],
-      uint8 new_brightness = (ImageGetPixel(img, x , y)*factor)+0.5; // the new brightness will be = to the value of the pixel * factor rounded up,
-      if (new_brightness > 255){ //if the new brightness > 255, 
-        new_brightness = ImageMaxval(img);// then it becomes = 255
-        }
-      ImageSetPixel(img, x , y, new_brightness); // and finally set the new brightness to the pixel
+__attribute__((target("sse2")))
+static int equalSSE2(const uint8* a, const uint8* b, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((__m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((__m128i*)(b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) return 0;
+  }
+  return equalScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void packSSE2(const uint8* p, int n, uint8 thr, uint64_t* bits) {
+  __m128i t = _mm_set1_epi8((char)thr);
+  int i = 0;
+  for (; i + 64 <= n; i += 64) {
+    uint64_t w = 0;
+    for (int b = 0; b < 64; b += 16) {
+      __m128i v = _mm_loadu_si128((__m128i*)(p + i + b));
+      uint64_t m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v));
+      w |= m << b;
     }
+    bits[i >> 6] = w;
   }
+  if (i < n) packScalar(p + i, n - i, thr, bits + (i >> 6));
 }
 
-/// Geometric transformations
+// Add (or subtract, if sub) 16 pixels to 16 column sums.
+__attribute__((target("sse2")))
+static inline void colSSE2(uint32_t* sum, const uint8* p, int sub) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i v = _mm_loadu_si128((__m128i*)p);
+  __m128i v16[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+  for (int k = 0; k < 4; k++) {
+    __m128i v32 = (k & 1) ? _mm_unpackhi_epi16(v16[k >> 1], zero)
+                          : _mm_unpacklo_epi16(v16[k >> 1], zero);
+    __m128i s = _mm_loadu_si128((__m128i*)(sum + 4*k));
+    s = sub ? _mm_sub_epi32(s, v32) : _mm_add_epi32(s, v32);
+    _mm_storeu_si128((__m128i*)(sum + 4*k), s);
+  }
+}
 
-/// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
-/// 
-/// Success and failure are treated as in ImageCreate:
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
+__attribute__((target("sse2")))
+static void colAddSSE2(uint32_t* sum, const uint8* p, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) colSSE2(sum + i, p + i, 0);
+  colAddScalar(sum + i, p + i, n - i);
+}
 
-// Implementation hint: 
-// Call ImageCreate whenever you need a new image!
+__attribute__((target("sse2")))
+static void colSubSSE2(uint32_t* sum, const uint8* p, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) colSSE2(sum + i, p + i, 1);
+  colSubScalar(sum + i, p + i, n - i);
+}
 
-/// Rotate an image.
-/// Returns a rotated version of the image.
-/// The rotation is 90 degrees anti-clockwise.
-/// Ensures: The original img is not modified.
-/// 
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageRotate(Image img) { ///
+// The window sums of the columns whose window lies inside the row (so
+// nx = 2dx+1) are computed as prefix sums of colsum[x+dx] - colsum[x-dx-1],
+// several at a time, and divided several at a time.  Sums are integers
+// below 2^53, so they are exact in double precision, and the results are
+// those of the scalar kernel.  Column sums must fit in an int32 (they are
+// at most ny*PixMax).
+#define BOXROW_MAXNY ((double)(INT32_MAX / PixMax))
+
+// Sum of the window of column x (which lies inside the row).
+static inline double boxRowWindow(const uint32_t* colsum, int x, int dx) {
+  uint64_t sum = 0;
+  for (int i = x - dx; i <= x + dx; i++) sum += colsum[i];
+  return (double)sum;
+}
+
+__attribute__((target("sse2")))
+static void boxRowSSE2(uint8* out, const uint32_t* colsum, int n, int dx, double ny) {
+  int x0 = dx, x1 = n - dx;  // columns with whole windows
+  if (x1 - x0 < 16 || ny > BOXROW_MAXNY) {
+    boxRowScalar(out, colsum, n, dx, ny);
+    return;
+  }
+  boxRowPart(out, colsum, n, dx, ny, 0, x0 + 1);
+  __m128d d = _mm_set1_pd((2*dx + 1)*ny);
+  __m128d half = _mm_set1_pd(0.5);
+  __m128d zero = _mm_setzero_pd();
+  __m128d base = _mm_set1_pd(boxRowWindow(colsum, x0, dx));
+  int x = x0 + 1;
+  for (; x + 8 <= x1; x += 8) {
+    __m128i r[4];
+    for (int k = 0; k < 4; k++) {
+      const uint32_t* c = colsum + x + 2*k;
+      __m128d a = _mm_sub_pd(_mm_cvtepi32_pd(_mm_loadl_epi64((__m128i*)(c + dx))),
+                             _mm_cvtepi32_pd(_mm_loadl_epi64((__m128i*)(c - dx - 1))));
+      a = _mm_add_pd(a, _mm_unpacklo_pd(zero, a));  // prefix sums
+      __m128d sum = _mm_add_pd(base, a);
+      base = _mm_unpackhi_pd(sum, sum);
+      r[k] = _mm_cvttpd_epi32(_mm_add_pd(_mm_div_pd(sum, d), half));
+    }
+    __m128i r32[2] = { _mm_unpacklo_epi64(r[0], r[1]), _mm_unpacklo_epi64(r[2], r[3]) };
+    __m128i v = _mm_packus_epi16(_mm_packs_epi32(r32[0], r32[1]), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)(out + x), v);
+  }
+  boxRowPart(out, colsum, n, dx, ny, x, n);
+}
+
+static const Kernels sse2Kernels = {
+  "sse2", negateSSE2, thresholdSSE2, blendSSE2, minmaxSSE2, equalSSE2,
+  packSSE2, colAddSSE2, colSubSSE2, boxRowSSE2
+};
+
+// AVX2 kernels (32 pixels at a time)
+
+__attribute__((target("avx2")))
+static void negateAVX2(uint8* p, size_t n, uint8 maxval) {
+  __m256i m = _mm256_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+    v = _mm256_or_si256(_mm256_subs_epu8(m, v), _mm256_subs_epu8(v, m));
+    _mm256_storeu_si256((__m256i*)(p + i), v);
+  }
+  negateSSE2(p + i, n - i, maxval);
+}
+
+__attribute__((target("avx2")))
+static void thresholdAVX2(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  __m256i t = _mm256_set1_epi8((char)thr);
+  __m256i m = _mm256_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+    __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v);
+    _mm256_storeu_si256((__m256i*)(p + i), _mm256_and_si256(ge, m));
+  }
+  thresholdSSE2(p + i, n - i, thr, maxval);
+}
+
+__attribute__((target("avx2")))
+static void blendAVX2(uint8* dst, const uint8* src, int n, double alpha, uint8 maxval) {
+  __m256d a = _mm256_set1_pd(alpha);
+  __m256d b = _mm256_set1_pd(1 - alpha);
+  __m256d half = _mm256_set1_pd(0.5);
+  __m128i m = _mm_set1_epi8((char)maxval);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i s32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(src + i)));
+    __m256i d32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(dst + i)));
+    __m128i r[2];
+    for (int k = 0; k < 2; k++) {
+      __m256d s = _mm256_cvtepi32_pd((k == 0) ? _mm256_castsi256_si128(s32) : _mm256_extracti128_si256(s32, 1));
+      __m256d d = _mm256_cvtepi32_pd((k == 0) ? _mm256_castsi256_si128(d32) : _mm256_extracti128_si256(d32, 1));
+      r[k] = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(s, a), _mm256_mul_pd(d, b)), half));
+    }
+    __m128i v = _mm_packus_epi16(_mm_packs_epi32(r[0], r[1]), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)(dst + i), _mm_min_epu8(v, m));
+  }
+  blendScalar(dst + i, src + i, n - i, alpha, maxval);
+}
+
+__attribute__((target("avx2")))
+static void minmaxAVX2(const uint8* p, size_t n, uint8* min, uint8* max) {
+  size_t i = 0;
+  if (n >= 32) {
+    __m256i lo = _mm256_set1_epi8((char)*min), hi = _mm256_set1_epi8((char)*max);
+    for (; i + 32 <= n; i += 32) {
+      __m256i v = _mm256_loadu_si256((__m256i*)(p + i));
+      lo = _mm256_min_epu8(lo, v);
+      hi = _mm256_max_epu8(hi, v);
+    }
+    uint8 l[32], h[32];
+    _mm256_storeu_si256((__m256i*)l, lo);
+    _mm256_storeu_si256((__m256i*)h, hi);
+    minmaxScalar(l, 32, min, max);
+    minmaxScalar(h, 32, min, max);
+  }
+  minmaxSSE2(p + i, n - i, min, max);
+}
+
+__attribute__((target("avx2")))
+static int equalAVX2(const uint8* a, const uint8* b, int n) {
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256((__m256i*)(a + i));
+    __m256i vb = _mm256_loadu_si256((__m256i*)(b + i));
+    if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xFFFFFFFFu) return 0;
+  }
+  return equalSSE2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void packAVX2(const uint8* p, int n, uint8 thr, uint64_t* bits) {
+  __m256i t = _mm256_set1_epi8((char)thr);
+  int i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m256i lo = _mm256_loadu_si256((__m256i*)(p + i));
+    __m256i hi = _mm256_loadu_si256((__m256i*)(p + i + 32));
+    uint64_t mlo = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(lo, t), lo));
+    uint64_t mhi = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(hi, t), hi));
+    bits[i >> 6] = mlo | (mhi << 32);
+  }
+  if (i < n) packScalar(p + i, n - i, thr, bits + (i >> 6));
+}
+
+__attribute__((target("avx2")))
+static void colAddAVX2(uint32_t* sum, const uint8* p, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(p + i)));
+    __m256i s = _mm256_loadu_si256((__m256i*)(sum + i));
+    _mm256_storeu_si256((__m256i*)(sum + i), _mm256_add_epi32(s, v));
+  }
+  colAddScalar(sum + i, p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void colSubAVX2(uint32_t* sum, const uint8* p, int n) {
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(p + i)));
+    __m256i s = _mm256_loadu_si256((__m256i*)(sum + i));
+    _mm256_storeu_si256((__m256i*)(sum + i), _mm256_sub_epi32(s, v));
+  }
+  colSubScalar(sum + i, p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void boxRowAVX2(uint8* out, const uint32_t* colsum, int n, int dx, double ny) {
+  int x0 = dx, x1 = n - dx;  // columns with whole windows
+  if (x1 - x0 < 16 || ny > BOXROW_MAXNY) {
+    boxRowScalar(out, colsum, n, dx, ny);
+    return;
+  }
+  boxRowPart(out, colsum, n, dx, ny, 0, x0 + 1);
+  __m256d d = _mm256_set1_pd((2*dx + 1)*ny);
+  __m256d half = _mm256_set1_pd(0.5);
+  __m256d zero = _mm256_setzero_pd();
+  __m256d base = _mm256_set1_pd(boxRowWindow(colsum, x0, dx));
+  int x = x0 + 1;
+  for (; x + 8 <= x1; x += 8) {
+    __m128i r[2];
+    for (int k = 0; k < 2; k++) {
+      const uint32_t* c = colsum + x + 4*k;
+      __m256d a = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_loadu_si128((__m128i*)(c + dx))),
+                                _mm256_cvtepi32_pd(_mm_loadu_si128((__m128i*)(c - dx - 1))));
+      // prefix sums: add a shifted up by 1, then by 2 lanes
+      a = _mm256_add_pd(a, _mm256_blend_pd(_mm256_permute4x64_pd(a, 0x90), zero, 0x1));
+      a = _mm256_add_pd(a, _mm256_blend_pd(_mm256_permute4x64_pd(a, 0x40), zero, 0x3));
+      __m256d sum = _mm256_add_pd(base, a);
+      base = _mm256_permute4x64_pd(sum, 0xFF);
+      r[k] = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_div_pd(sum, d), half));
+    }
+    __m128i v = _mm_packus_epi16(_mm_packs_epi32(r[0], r[1]), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)(out + x), v);
+  }
+  boxRowPart(out, colsum, n, dx, ny, x, n);
+}
+
+static const Kernels avx2Kernels = {
+  "avx2", negateAVX2, thresholdAVX2, blendAVX2, minmaxAVX2, equalAVX2,
+  packAVX2, colAddAVX2, colSubAVX2, boxRowAVX2
+};
+
+// AVX-512 kernels (64 pixels at a time; needs AVX512BW for bytes)
+
+__attribute__((target("avx512bw")))
+static void negateAVX512(uint8* p, size_t n, uint8 maxval) {
+  __m512i m = _mm512_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512(p + i);
+    v = _mm512_or_si512(_mm512_subs_epu8(m, v), _mm512_subs_epu8(v, m));
+    _mm512_storeu_si512(p + i, v);
+  }
+  negateAVX2(p + i, n - i, maxval);
+}
+
+__attribute__((target("avx512bw")))
+static void thresholdAVX512(uint8* p, size_t n, uint8 thr, uint8 maxval) {
+  __m512i t = _mm512_set1_epi8((char)thr);
+  __m512i m = _mm512_set1_epi8((char)maxval);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i v = _mm512_loadu_si512(p + i);
+    __mmask64 ge = _mm512_cmpge_epu8_mask(v, t);
+    _mm512_storeu_si512(p + i, _mm512_maskz_mov_epi8(ge, m));
+  }
+  thresholdAVX2(p + i, n - i, thr, maxval);
+}
+
+__attribute__((target("avx512bw")))
+static void blendAVX512(uint8* dst, const uint8* src, int n, double alpha, uint8 maxval) {
+  __m512d a = _mm512_set1_pd(alpha);
+  __m512d b = _mm512_set1_pd(1 - alpha);
+  __m512d half = _mm512_set1_pd(0.5);
+  __m128i m = _mm_set1_epi8((char)maxval);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i s32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(src + i)));
+    __m256i d32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(dst + i)));
+    __m512d s = _mm512_cvtepi32_pd(s32);
+    __m512d d = _mm512_cvtepi32_pd(d32);
+    __m256i r = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(s, a), _mm512_mul_pd(d, b)), half));
+    __m128i v = _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+    v = _mm_packus_epi16(v, _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)(dst + i), _mm_min_epu8(v, m));
+  }
+  blendScalar(dst + i, src + i, n - i, alpha, maxval);
+}
+
+__attribute__((target("avx512bw")))
+static void minmaxAVX512(const uint8* p, size_t n, uint8* min, uint8* max) {
+  size_t i = 0;
+  if (n >= 64) {
+    __m512i lo = _mm512_set1_epi8((char)*min), hi = _mm512_set1_epi8((char)*max);
+    for (; i + 64 <= n; i += 64) {
+      __m512i v = _mm512_loadu_si512(p + i);
+      lo = _mm512_min_epu8(lo, v);
+      hi = _mm512_max_epu8(hi, v);
+    }
+    uint8 l[64], h[64];
+    _mm512_storeu_si512(l, lo);
+    _mm512_storeu_si512(h, hi);
+    minmaxScalar(l, 64, min, max);
+    minmaxScalar(h, 64, min, max);
+  }
+  minmaxAVX2(p + i, n - i, min, max);
+}
+
+__attribute__((target("avx512bw")))
+static int equalAVX512(const uint8* a, const uint8* b, int n) {
+  int i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i va = _mm512_loadu_si512(a + i);
+    __m512i vb = _mm512_loadu_si512(b + i);
+    if (_mm512_cmpneq_epi8_mask(va, vb) != 0) return 0;
+  }
+  return equalAVX2(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static void packAVX512(const uint8* p, int n, uint8 thr, uint64_t* bits) {
+  __m512i t = _mm512_set1_epi8((char)thr);
+  int i = 0;
+  for (; i + 64 <= n; i += 64) {
+    bits[i >> 6] = _mm512_cmpge_epu8_mask(_mm512_loadu_si512(p + i), t);
+  }
+  if (i < n) packScalar(p + i, n - i, thr, bits + (i >> 6));
+}
+
+__attribute__((target("avx512bw")))
+static void colAddAVX512(uint32_t* sum, const uint8* p, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i v = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i*)(p + i)));
+    _mm512_storeu_si512(sum + i, _mm512_add_epi32(_mm512_loadu_si512(sum + i), v));
+  }
+  colAddAVX2(sum + i, p + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static void colSubAVX512(uint32_t* sum, const uint8* p, int n) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i v = _mm512_cvtepu8_epi32(_mm_loadu_si128((__m128i*)(p + i)));
+    _mm512_storeu_si512(sum + i, _mm512_sub_epi32(_mm512_loadu_si512(sum + i), v));
+  }
+  colSubAVX2(sum + i, p + i, n - i);
+}
+
+__attribute__((target("avx512bw")))
+static void boxRowAVX512(uint8* out, const uint32_t* colsum, int n, int dx, double ny) {
+  int x0 = dx, x1 = n - dx;  // columns with whole windows
+  if (x1 - x0 < 16 || ny > BOXROW_MAXNY) {
+    boxRowScalar(out, colsum, n, dx, ny);
+    return;
+  }
+  boxRowPart(out, colsum, n, dx, ny, 0, x0 + 1);
+  __m512d d = _mm512_set1_pd((2*dx + 1)*ny);
+  __m512d half = _mm512_set1_pd(0.5);
+  __m512i up1 = _mm512_set_epi64(6, 5, 4, 3, 2, 1, 0, 0);  // lanes shifted up
+  __m512i up2 = _mm512_set_epi64(5, 4, 3, 2, 1, 0, 0, 0);
+  __m512i up4 = _mm512_set_epi64(3, 2, 1, 0, 0, 0, 0, 0);
+  __m512i last = _mm512_set1_epi64(7);
+  __m512d base = _mm512_set1_pd(boxRowWindow(colsum, x0, dx));
+  int x = x0 + 1;
+  for (; x + 8 <= x1; x += 8) {
+    const uint32_t* c = colsum + x;
+    __m512d a = _mm512_sub_pd(_mm512_cvtepi32_pd(_mm256_loadu_si256((__m256i*)(c + dx))),
+                              _mm512_cvtepi32_pd(_mm256_loadu_si256((__m256i*)(c - dx - 1))));
+    a = _mm512_add_pd(a, _mm512_maskz_permutexvar_pd(0xFE, up1, a));  // prefix sums
+    a = _mm512_add_pd(a, _mm512_maskz_permutexvar_pd(0xFC, up2, a));
+    a = _mm512_add_pd(a, _mm512_maskz_permutexvar_pd(0xF0, up4, a));
+    __m512d sum = _mm512_add_pd(base, a);
+    base = _mm512_permutexvar_pd(last, sum);
+    __m256i r = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_div_pd(sum, d), half));
+    __m128i v = _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+    v = _mm_packus_epi16(v, _mm_setzero_si128());
+    _mm_storel_epi64((__m128i*)(out + x), v);
+  }
+  boxRowPart(out, colsum, n, dx, ny, x, n);
+}
+
+static const Kernels avx512Kernels = {
+  "avx512", negateAVX512, thresholdAVX512, blendAVX512, minmaxAVX512, equalAVX512,
+  packAVX512, colAddAVX512, colSubAVX512, boxRowAVX512
+};
+#pragma GCC pop_options
+#endif
+
+// All kernel sets, from worst to best
+static const Kernels* const allKernels[] = {
+  &scalarKernels,
+#ifdef HAVE_X86_KERNELS
+  &sse2Kernels, &avx2Kernels, &avx512Kernels,
+#endif
+};
+#define NKERNELS (int)(sizeof(allKernels)/sizeof(allKernels[0]))
+
+// Kernels in use
+static const Kernels* kernels = &scalarKernels;
+
+// Does the cpu support kernel set k?
+static int kernelsSupported(const Kernels* k) {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (k == &sse2Kernels) return __builtin_cpu_supports("sse2");
+  if (k == &avx2Kernels) return __builtin_cpu_supports("avx2");
+  if (k == &avx512Kernels) return __builtin_cpu_supports("avx512bw");
+#endif
+  return k == &scalarKernels;
+}
+
+/// Select the pixel kernels named name (scalar, sse2, avx2 or avx512),
+/// or the best ones the cpu supports, if name is "auto".
+/// Returns 0 (and keeps the current kernels) if name is unknown or not
+/// supported by this cpu.
+int ImageSetKernels(const char* name) { ///
+  assert (name != NULL);
+  for (int i = NKERNELS - 1; i >= 0; i--) {
+    int wanted = strcmp(name, "auto") == 0 || strcmp(name, allKernels[i]->name) == 0;
+    if (wanted && kernelsSupported(allKernels[i])) {
+      kernels = allKernels[i];
+      return 1;
+    }
+  }
+  errCause = "Unknown or unsupported kernels";
+  return 0;
+}
+
+/// Get the name of the pixel kernels in use.
+const char* ImageKernels(void) { ///
+  return kernels->name;
+}
+
+// Message buffer for self-test failures
+static _Thread_local char selfTestMsg[128];
+
+// Check kernel set k against the scalar kernels with random data.
+// Returns 0 and sets errCause on the first difference.
+static int selfTestKernels(const Kernels* k, int trials) {
+  enum { MAXN = 300, PAD = 64 };
+  uint8 a[MAXN + PAD], b[MAXN + PAD], c[MAXN + PAD], d[MAXN + PAD];
+  const char* failed = NULL;
+  for (int t = 0; t < trials && failed == NULL; t++) {
+    int n = rand() % (MAXN + 1);
+    int off = rand() % PAD;  // vary alignment
+    uint8 maxval = (t % 4 == 0) ? PixMax : (uint8)(1 + rand() % PixMax);
+    uint8 thr = (uint8)rand();
+    double alphas[] = { 0.0, 1.0, 0.5, rand() / (double)RAND_MAX, 2.0*rand()/RAND_MAX - 0.5 };
+    double alpha = alphas[t % 5];
+    for (int i = 0; i < MAXN + PAD; i++) {
+      a[i] = (uint8)rand();
+      b[i] = (uint8)rand();
+    }
+    if (t % 3 == 0) memcpy(b + off, a + off, n);  // equal, or almost
+    if (t % 6 == 0 && n > 0) b[off + rand() % n] ^= 1;
+
+    memcpy(c, a, sizeof(c)); memcpy(d, a, sizeof(d));
+    scalarKernels.negate(c + off, n, maxval);
+    k->negate(d + off, n, maxval);
+    if (memcmp(c, d, sizeof(c)) != 0) { failed = "negate"; break; }
+
+    memcpy(c, a, sizeof(c)); memcpy(d, a, sizeof(d));
+    scalarKernels.threshold(c + off, n, thr, maxval);
+    k->threshold(d + off, n, thr, maxval);
+    if (memcmp(c, d, sizeof(c)) != 0) { failed = "threshold"; break; }
+
+    memcpy(c, a, sizeof(c)); memcpy(d, a, sizeof(d));
+    scalarKernels.blend(c + off, b + off, n, alpha, maxval);
+    k->blend(d + off, b + off, n, alpha, maxval);
+    if (memcmp(c, d, sizeof(c)) != 0) { failed = "blend"; break; }
+
+    uint8 min1 = maxval, max1 = 0, min2 = maxval, max2 = 0;
+    scalarKernels.minmax(a + off, n, &min1, &max1);
+    k->minmax(a + off, n, &min2, &max2);
+    if (min1 != min2 || max1 != max2) { failed = "minmax"; break; }
+
+    if (!scalarKernels.equal(a + off, b + off, n) != !k->equal(a + off, b + off, n)) {
+      failed = "equal"; break;
+    }
+
+    uint64_t w1[(MAXN + 63)/64 + 1], w2[(MAXN + 63)/64 + 1];
+    memset(w1, 0xAA, sizeof(w1)); memset(w2, 0xAA, sizeof(w2));
+    scalarKernels.pack(a + off, n, thr, w1);
+    k->pack(a + off, n, thr, w2);
+    if (memcmp(w1, w2, sizeof(w1)) != 0) { failed = "pack"; break; }
+
+    // Column sums of up to ny rows, so they stay >= any pixel subtracted
+    int ny = 1 + rand() % 64;
+    uint32_t s1[MAXN + PAD], s2[MAXN + PAD];
+    for (int i = 0; i < MAXN + PAD; i++) s1[i] = s2[i] = PixMax + rand() % ((ny - 1)*PixMax + 1);
+    if (t % 2 == 0) {
+      scalarKernels.colAdd(s1 + off, a + off, n);
+      k->colAdd(s2 + off, a + off, n);
+    } else {
+      scalarKernels.colSub(s1 + off, a + off, n);
+      k->colSub(s2 + off, a + off, n);
+    }
+    if (memcmp(s1, s2, sizeof(s1)) != 0) { failed = "column sum"; break; }
+
+    for (int i = 0; i < MAXN + PAD; i++) s1[i] = rand() % (ny*PixMax + 1);
+    int dx = (t % 7 == 0) ? rand() % (MAXN + 1) : rand() % 16;
+    memcpy(c, a, sizeof(c)); memcpy(d, a, sizeof(d));
+    scalarKernels.boxRow(c + off, s1 + off, n, dx, ny);
+    k->boxRow(d + off, s1 + off, n, dx, ny);
+    if (memcmp(c, d, sizeof(c)) != 0) { failed = "box row"; break; }
+  }
+  if (failed != NULL) {
+    snprintf(selfTestMsg, sizeof(selfTestMsg), "Kernel %s of %s differs from scalar",
+             failed, k->name);
+    errCause = selfTestMsg;
+    return 0;
+  }
+  return 1;
+}
+
+/// Check every set of pixel kernels supported by the cpu against the
+/// scalar reference kernels, on trials random inputs each.
+/// Returns 1 if all agree.  Otherwise, returns 0 and errCause describes
+/// the first difference.
+int ImageKernelSelfTest(int trials) { ///
+  for (int i = 1; i < NKERNELS; i++) {
+    if (kernelsSupported(allKernels[i]) && !selfTestKernels(allKernels[i], trials)) return 0;
+  }
+  return 1;
+}
+
+
+/// Pixel memory
+
+// Large pixel arrays are mapped anonymous memory, aligned to huge pages,
+// and backed by huge pages if the system allows.  With 4 KiB pages, a
+// 50000x50000 image needs over 600000 TLB entries, and any traversal that
+// is not row by row (rotate, tiles, columns, warps) misses the TLB on
+// almost every access; 2 MiB pages need 512 times fewer entries.
+// Their pages are first touched (and so placed, on NUMA systems) by the
+// worker threads, in contiguous bands, like the bands of parallel ops.
+
+#define HUGE_PAGE ((size_t)2 << 20)  // usual huge page size (x86-64, arm64)
+#define HUGE_MIN ((size_t)4 << 20)   // smallest pixel array to map
+
+// How pixel arrays are allocated
+static HugePages hugePages = HUGEPAGES_TRANSPARENT;
+
+/// Set how the pixel arrays of large images created from now on are
+/// allocated.
+void ImageSetHugePages(HugePages mode) { ///
+  assert (mode == HUGEPAGES_OFF || mode == HUGEPAGES_TRANSPARENT || mode == HUGEPAGES_EXPLICIT);
+  hugePages = mode;
+}
+
+/// Get how the pixel arrays of large images are allocated.
+HugePages ImageHugePages(void) { ///
+  return hugePages;
+}
+
+// Write to each 4 KiB page of huge pages [begin, end) of arg.
+static unsigned long touchPages(void* arg, int begin, int end) {
+  volatile uint8* p = (volatile uint8*)arg;
+  for (size_t i = (size_t)begin*HUGE_PAGE; i < (size_t)end*HUGE_PAGE; i += 4096) p[i] = 0;
+  return 0;
+}
+
+// Allocate a zeroed pixel array of n bytes for img: set img->pixel, and
+// img->map and img->mapsize if the array is a mapping.
+// If lazy, the array is not touched: its pages get memory only when first
+// written (with ordinary pages, so that is only the pages written).
+// Returns 0 on failure (not enough memory).
+static int pixelAlloc(Image img, size_t n, int lazy) {
+  img->map = NULL;
+  img->mapsize = 0;
+  if (!lazy && hugePages != HUGEPAGES_OFF && n >= HUGE_MIN) {
+    size_t size = (n + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);  // whole huge pages
+    size_t mapsize = size;
+    void* map = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugePages == HUGEPAGES_EXPLICIT) {  // fails if none are reserved
+      map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (map == MAP_FAILED) {  // one page more, to align the array
+      mapsize = size + HUGE_PAGE;
+      map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (map != MAP_FAILED) {
+      uint8* p = (uint8*)(((uintptr_t)map + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+#ifdef MADV_HUGEPAGE
+      madvise(p, size, MADV_HUGEPAGE);  // (only a hint)
+#endif
+      parallelRun((int)(size / HUGE_PAGE), 1, touchPages, p);
+      img->map = map;
+      img->mapsize = mapsize;
+      img->pixel = p;
+      return 1;
+    }
+  }
+  img->pixel = (uint8*)calloc(n, sizeof(uint8));  // (large ones are mapped lazily)
+  return img->pixel != NULL;
+}
+
+// Free the pixel array of img.
+static void pixelFree(Image img) {
+  if (img->map != NULL) {
+    munmap(img->map, img->mapsize);  //pixels belong to a mapping;
+  } else {
+    free(img->pixel);  //free the memory in the 1D array;
+  }
+}
+
+
+// Change tracking (see ImageChanges)
+//
+// Each image logs up to NCHANGES rectangles, with the version after the
+// latest change in each.  A new rectangle inside or next to the latest one
+// just extends it (as when pixels are set one by one); otherwise it drops
+// those it contains, and when the log is full, it is merged with the one
+// whose bounding box grows least.  All of these only make the log cover
+// more pixels, never fewer, so derived results may recompute a bit more
+// than needed, but never miss a change.
+
+// Bounding box of rectangles a and b
+static Change changeUnion(const Change* a, const Change* b) {
+  int x0 = (a->x < b->x) ? a->x : b->x;
+  int y0 = (a->y < b->y) ? a->y : b->y;
+  int x1 = (a->x + a->w > b->x + b->w) ? a->x + a->w : b->x + b->w;
+  int y1 = (a->y + a->h > b->y + b->h) ? a->y + a->h : b->y + b->h;
+  unsigned long v = (a->version > b->version) ? a->version : b->version;
+  return (Change){ x0, y0, x1 - x0, y1 - y0, v };
+}
+
+// Blank tiles
+//
+// The pixel array of an image made by ImageCreate is not touched, so it
+// gets memory only where it is written, and the image remembers which
+// tiles (TSIZE x TSIZE, in any layout) were never written.  Those are
+// all 0 and may have no memory at all: ImageStats skips them.  Like the
+// change log, this is updated by markChanged.
+
+// Record that the tiles of img overlapping rectangle (x,y,w,h) were written.
+static void clearBlank(Image img, int x, int y, int w, int h) {
+  int tw = (img->width + TMASK) >> TBITS;
+  for (int j = y >> TBITS; j <= (y + h - 1) >> TBITS; j++) {
+    for (int i = x >> TBITS; i <= (x + w - 1) >> TBITS; i++) {
+      uint8* b = &img->blank[(size_t)j*tw + i];
+      img->nblank -= *b;
+      *b = 0;
+    }
+  }
+  if (img->nblank == 0) {  // nothing left to remember
+    free(img->blank);
+    img->blank = NULL;
+  }
+}
+
+// Record that pixels of img in rectangle (x,y,w,h) changed.
+static void markChanged(Image img, int x, int y, int w, int h) {
+  if (w <= 0 || h <= 0) return;
+  if (img->blank != NULL) clearBlank(img, x, y, w, h);
+  unsigned long v = ++img->version;
+  Change c = { x, y, w, h, v };
+  if (img->nchanges > 0) {  // fast paths, for pixel by pixel changes
+    Change* last = &img->changes[img->nchanges - 1];
+    Change u = changeUnion(last, &c);
+    // inside the latest one, or next to it (so their union is no larger)
+    if ((long)u.w*u.h <= (long)last->w*last->h + (long)w*h) {
+      *last = u;
+      return;
+    }
+  }
+  int n = 0;
+  for (int i = 0; i < img->nchanges; i++) {  // drop those inside c
+    Change* d = &img->changes[i];
+    if (!(x <= d->x && y <= d->y && d->x + d->w <= x + w && d->y + d->h <= y + h))
+      img->changes[n++] = *d;
+  }
+  if (n == NCHANGES) {  // merge c into the one growing least
+    int best = 0;
+    long bestGrowth = 0;
+    for (int i = 0; i < n; i++) {
+      Change u = changeUnion(&img->changes[i], &c);
+      long growth = (long)u.w*u.h - (long)img->changes[i].w*img->changes[i].h;
+      if (i == 0 || growth < bestGrowth) { best = i; bestGrowth = growth; }
+    }
+    c = changeUnion(&img->changes[best], &c);
+    img->changes[best] = img->changes[--n];
+  }
+  img->changes[n++] = c;
+  img->nchanges = n;
+}
+
+// Record that all pixels of img changed.
+static void markAllChanged(Image img) {
+  markChanged(img, 0, 0, img->width, img->height);
+}
+
+
+/// Image management functions
+
+// Create a new black image, with a lazy pixel array and all tiles blank,
+// or with a pixel array ready to be written in full (for the results of
+// operations, and images read from files).
+static Image imageNew(int width, int height, uint8 maxval, int lazy) {
+  Image img = (Image)malloc(sizeof(struct image)); //initialize the pointer.
+  if (img == NULL) {
+    errCause = "Not enough memory - memory allocation failed";
+    return NULL;
+  }
+  img->width = width; 
+  img->height = height;
+  img->maxval = maxval;
+  img->layout = defaultLayout;
+  img->tilesx = (width + TMASK) >> TBITS;
+  img->version = 0;
+  img->nchanges = 0;
+  img->tileStats = NULL;
+  img->blank = NULL;
+  img->nblank = 0;
+  img->hashVersion = 0;
+  //a zeroed pixel array, creating the black image of the size height*width (see pixelAlloc)
+  if (!pixelAlloc(img, pixelBytes(img->layout, width, height), lazy)) {
+    free(img);
+    errCause = "Not enough memory - memory allocation failed";
+    return NULL;
+  }
+  size_t tiles = (size_t)img->tilesx*((height + TMASK) >> TBITS);
+  if (lazy && tiles > 0 && (img->blank = (uint8*)malloc(tiles)) != NULL) {
+    memset(img->blank, 1, tiles);  // (without it, blank tiles are just scanned)
+    img->nblank = tiles;
+  }
+  return img; //return img which is a pointer to acceptable values containing the width, height and maxval of this image
+}
+
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// The pixels get memory only where they are written (so a large canvas
+/// with a few images pasted in costs little more than those images), and
+/// areas never written are known to be black without reading them.
+/// See also ImageMaterialize.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  InstrScope(__func__);
+  assert (width >= 0);
+  assert (height >= 0);
+  assert (0 < maxval && maxval <= PixMax);
+  return imageNew(width, height, maxval, 1);
+}
+
+/// Give all pixels of img memory now, as for the results of operations
+/// (huge pages, if enabled, first touched by the worker threads), instead
+/// of page by page as they are written.  Worth it before writing a large
+/// image in full, or traversing it column by column.
+/// The pixels are not changed.  A mapped image (ImageMap,
+/// ImageAttachShared) gets its own copy of the pixels.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set, and img
+/// is unchanged.
+int ImageMaterialize(Image img) { ///
+  InstrScope(__func__);
   assert (img != NULL);
-  Image new_img = ImageCreate(ImageHeight(img), ImageWidth(img), ImageMaxval(img)); //create an image with the height = old width and width = old height size
-  for (int x = 0; x < ImageWidth(img); x++){ //for every coordinate for x ∈ [0,width]
-    for (int y = 0; y < ImageHeight(img); y++){ // & y ∈ [0,height],
-      int width = ImageHeight(img)-y-1;
-      int height = x;
-      ImageSetPixel(new_img, x, y, ImageGetPixel(img, width, height));// The first line of pixels (with y = 0) will become the 
-      // last column of pixels (with x = img->height) taking values ∈ [0,height], then the second line of pixels (y = 1) will 
-      // become the second last column of pixels (x = old image height -1 ), etc... until the last line of pixels (with y = width) becomes
-      // the first column of pixels (x = 0). We can also look at this from a mathematical prespective
-      // and apply a change of variables of: ( x =-y ) & ( y = x )  
+  struct image tmp;
+  size_t n = pixelBytes(img->layout, img->width, img->height);
+  if (!check( pixelAlloc(&tmp, n, 0), "Not enough memory" )) return 0;
+  memcpy(tmp.pixel, img->pixel, n);
+  pixelFree(img);
+  img->pixel = tmp.pixel;
+  img->map = tmp.map;
+  img->mapsize = tmp.mapsize;
+  PIXMEM += 2ul*img->width*img->height;
+  return 1;
+}
+
+/// Destroy the image pointed to by (*imgp).
+///   imgp : address of an Image variable.
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+/// Should never fail, and should preserve global errno/errCause.
+void ImageDestroy(Image *imgp) { ///
+  assert (imgp != NULL);
+  Image img = *imgp;   //dereference the pointer;
+  if (img == NULL) return;
+  pixelFree(img);
+  free(img->tileStats);
+  free(img->blank);
+  free(img);           //free the rest of the memory;
+  *imgp = NULL;        //delete the pointer;
+}
+
+
+/// PGM file operations
+
+// See also:
+// PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
+
+// Match and skip 0 or more comment lines in file f.
+// Comments start with a # and continue until the end-of-line, inclusive.
+// Returns the number of comments skipped.
+static int skipComments(FILE* f) {
+  char c;
+  int i = 0;
+  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
+    i++;
+  }
+  return i;
+}
+
+// Parse a raw PGM header from file f.
+// On success, sets (*w, *h, *maxval), leaves f at the first pixel and
+// returns nonzero.  On failure, returns 0 and sets errCause.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c;
+  return
+  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", w) == 1 && *w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", h) == 1 && *h >= 0 , "Invalid height" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", maxval) == 1 && 0 < *maxval && *maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" );
+}
+
+// Read the pixels of img from f, which holds them in raster order.
+// Returns nonzero on success, or 0 on failure and sets errCause.
+static int readPixels(Image img, FILE* f) {
+  int w = img->width;
+  int h = img->height;
+  if (img->layout == LAYOUT_RASTER) {
+    size_t n = (size_t)w*h;
+    return check( fread(img->pixel, sizeof(uint8), n, f) == n , "Reading pixels" );
+  }
+  uint8* row = (uint8*)malloc(w + 1);
+  int success = check( row != NULL , "Not enough memory" );
+  for (int y = 0; success && y < h; y++) {
+    success = check( fread(row, sizeof(uint8), w, f) == w , "Reading pixels" );
+    rowPut(img, 0, y, w, row);
+  }
+  free(row);
+  return success;
+}
+
+/// Load a raw PGM file.
+/// Only 8 bit PGM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoad(const char* filename) { ///
+  InstrScope(__func__);
+  int w, h;
+  int maxval;
+  FILE* f = NULL;
+  Image img = NULL;
+
+  int success = 
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PGM header
+  readHeader(f, &w, &h, &maxval) &&
+  // Allocate image
+  (img = imageNew(w, h, (uint8)maxval, 0)) != NULL &&
+  // Read pixels
+  readPixels(img, f);
+  if (success) PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+/// Map a raw PGM file into memory.
+/// Like ImageLoad, but the pixels are not read: they stay in the file and
+/// are paged in by the operating system only when accessed, and may be
+/// dropped again under memory pressure.
+/// Changes to the returned image are private: the file is never modified.
+/// The returned image always has LAYOUT_RASTER.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMap(const char* filename) { ///
+  InstrScope(__func__);
+  int w, h;
+  int maxval;
+  FILE* f = NULL;
+  Image img = NULL;
+  struct stat st;
+  long offset = 0;
+  void* map = MAP_FAILED;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  readHeader(f, &w, &h, &maxval) &&
+  check( (offset = ftell(f)) >= 0 && fstat(fileno(f), &st) == 0, "Stat failed" ) &&
+  check( st.st_size >= offset + (off_t)w*h , "Reading pixels" ) &&
+  check( (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0)) != MAP_FAILED, "Mapping failed" ) &&
+  (img = ImageCreate(0, 0, (uint8)maxval)) != NULL;
+
+  if (success) {
+    free(img->pixel);
+    img->width = w;
+    img->height = h;
+    img->layout = LAYOUT_RASTER;  // the layout of the file
+    img->map = map;
+    img->mapsize = st.st_size;
+    img->pixel = (uint8*)map + offset;
+  } else {
+    errsave = errno;
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+// Write the pixels of img to f, in raster order.
+// Returns nonzero on success, or 0 on failure and sets errCause.
+static int writePixels(Image img, FILE* f) {
+  int w = img->width;
+  int h = img->height;
+  if (img->layout == LAYOUT_RASTER) {
+    size_t n = (size_t)w*h;
+    return check( fwrite(img->pixel, sizeof(uint8), n, f) == n, "Writing pixels failed" );
+  }
+  uint8* buf = (uint8*)malloc(w + 1);
+  int success = check( buf != NULL , "Not enough memory" );
+  for (int y = 0; success && y < h; y++) {
+    const uint8* row = rowPtr(img, 0, y, w, buf, 1);
+    success = check( fwrite(row, sizeof(uint8), w, f) == w, "Writing pixels failed" );
+  }
+  free(buf);
+  return success;
+}
+
+/// Save image to PGM file.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int ImageSave(Image img, const char* filename) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  int w = img->width;
+  int h = img->height;
+  uint8 maxval = img->maxval;
+  FILE* f = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
+  writePixels(img, f);
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+/// Read the next raw PGM image from a stream of concatenated images.
+/// If (*imgp) is an image of the same size and layout, its pixel memory
+/// is reused; otherwise it is destroyed and a new image is created.
+/// On success, returns 1 and the image read is in (*imgp).
+/// At the end of the stream (no more images), returns 0.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+/// In both cases, (*imgp) is destroyed.
+int ImageRead(FILE* f, Image* imgp) { ///
+  InstrScope(__func__);
+  assert (f != NULL);
+  assert (imgp != NULL);
+  int w, h;
+  int maxval;
+  int c;
+  while ((c = getc(f)) != EOF && isspace(c)) {}  // between images
+  if (c == EOF) {
+    ImageDestroy(imgp);
+    return check( !ferror(f), "Reading stream failed" ) ? 0 : -1;
+  }
+  ungetc(c, f);
+
+  int success = readHeader(f, &w, &h, &maxval);
+  Image img = *imgp;
+  if (success && (img == NULL || img->layout != defaultLayout ||
+                  img->width != w || img->height != h)) {
+    ImageDestroy(imgp);
+    img = *imgp = imageNew(w, h, (uint8)maxval, 0);
+    success = img != NULL;
+  }
+  success = success && readPixels(img, f);
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(imgp);
+    errno = errsave;
+    return -1;
+  }
+  img->maxval = (uint8)maxval;
+  markAllChanged(img);
+  PIXMEM += (unsigned long)w*h;  // count pixel memory accesses
+  return 1;
+}
+
+/// Write image to a stream, as a raw PGM image.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  assert (f != NULL);
+  int success =
+  check( fprintf(f, "P5\n%d %d\n%u\n", img->width, img->height, img->maxval) > 0, "Writing header failed" ) &&
+  writePixels(img, f);
+  PIXMEM += (unsigned long)img->width*img->height;  // count pixel memory accesses
+  return success;
+}
+
+
+/// Shared images
+
+// A segment is a SharedHeader, padded to SHARED_HEADER bytes (so the
+// pixels are page aligned), followed by the pixel array.  The generation
+// is stored last, once the pixels are in place: while it is 0, the
+// segment is not ready.
+
+#define SHARED_HEADER 4096
+
+typedef struct {
+  char magic[8];
+  int32_t width, height, maxval, layout;
+  uint64_t generation;
+} SharedHeader;
+
+static const char sharedMagic[8] = "IMGSHM1\n";
+
+// Make the segment name of shared image name in buf (256 bytes).
+// Returns 0 (and sets errCause) if name is not valid.
+static int sharedName(const char* name, char* buf) {
+  return
+  check( name[0] != '\0' && strchr(name, '/') == NULL && strlen(name) < 250,
+         "Invalid shared image name" ) &&
+  snprintf(buf, 256, "/%s", name) > 0;
+}
+
+// Read the header of the segment open in fd into *hd.
+// Returns 0 (and sets errCause) if it is not a shared image.
+static int sharedHeader(int fd, SharedHeader* hd) {
+  return check( pread(fd, hd, sizeof(*hd), 0) == sizeof(*hd) &&
+                memcmp(hd->magic, sharedMagic, sizeof(sharedMagic)) == 0, "Invalid shared image" );
+}
+
+/// Export a copy of img as the shared image name.
+/// On success, returns the generation of the new segment (1 for the first
+/// export to name, and one more each time after).
+/// On failure, returns 0 and errno/errCause are set accordingly.
+unsigned long ImageExportShared(Image img, const char* name) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  assert (name != NULL);
+  char sname[256];
+  if (!sharedName(name, sname)) return 0;
+  unsigned long gen = 1;
+  int fd = shm_open(sname, O_RDONLY, 0);
+  if (fd >= 0) {  // replaced: attached images keep the old segment
+    SharedHeader hd;
+    if (sharedHeader(fd, &hd)) gen = hd.generation + 1;
+    close(fd);
+    shm_unlink(sname);
+  }
+  size_t n = pixelBytes(img->layout, img->width, img->height);
+  size_t size = SHARED_HEADER + n;
+  void* map = MAP_FAILED;
+  int success =
+  check( (fd = shm_open(sname, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0, "Creating shared image failed" ) &&
+  // (reserve the memory now: a full /dev/shm would be a SIGBUS later)
+  check( (errno = posix_fallocate(fd, 0, size)) == 0, "Not enough shared memory" ) &&
+  check( (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) != MAP_FAILED, "Mapping failed" );
+  if (success) {
+    SharedHeader* hd = (SharedHeader*)map;
+    memcpy(hd->magic, sharedMagic, sizeof(sharedMagic));
+    hd->width = img->width;
+    hd->height = img->height;
+    hd->maxval = img->maxval;
+    hd->layout = img->layout;
+    memcpy((uint8*)map + SHARED_HEADER, img->pixel, n);
+    __atomic_store_n(&hd->generation, (uint64_t)gen, __ATOMIC_RELEASE);
+    PIXMEM += 2ul*img->width*img->height;
+  } else if (fd >= 0) {
+    errsave = errno;
+    shm_unlink(sname);
+    errno = errsave;
+  }
+  errsave = errno;
+  if (map != MAP_FAILED) munmap(map, size);
+  if (fd >= 0) close(fd);
+  errno = errsave;
+  return success ? gen : 0;
+}
+
+/// Attach the shared image name.
+/// The pixels are not copied: they are mapped from the segment, and paged
+/// in only when accessed.  Changes to the returned image are private (as
+/// with ImageMap): the segment is never modified.
+/// If generation is not NULL, *generation is set to that of the segment.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAttachShared(const char* name, unsigned long* generation) { ///
+  InstrScope(__func__);
+  assert (name != NULL);
+  char sname[256];
+  int fd = -1;
+  struct stat st;
+  void* map = MAP_FAILED;
+  const SharedHeader* hd = NULL;
+  Image img = NULL;
+
+  int success =
+  sharedName(name, sname) &&
+  check( (fd = shm_open(sname, O_RDONLY, 0)) >= 0, "Open failed" ) &&
+  check( fstat(fd, &st) == 0, "Stat failed" ) &&
+  check( st.st_size >= SHARED_HEADER, "Invalid shared image" ) &&
+  check( (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) != MAP_FAILED, "Mapping failed" ) &&
+  check( memcmp((hd = (const SharedHeader*)map)->magic, sharedMagic, sizeof(sharedMagic)) == 0,
+         "Invalid shared image" ) &&
+  check( __atomic_load_n(&hd->generation, __ATOMIC_ACQUIRE) != 0, "Shared image not ready" ) &&
+  check( hd->width >= 0 && hd->height >= 0 && 0 < hd->maxval && hd->maxval <= (int)PixMax &&
+         (hd->layout == LAYOUT_RASTER || hd->layout == LAYOUT_TILED || hd->layout == LAYOUT_MORTON) &&
+         (size_t)st.st_size >= SHARED_HEADER + pixelBytes(hd->layout, hd->width, hd->height),
+         "Invalid shared image" ) &&
+  (img = ImageCreate(0, 0, (uint8)hd->maxval)) != NULL;
+
+  if (success) {
+    free(img->pixel);
+    img->width = hd->width;
+    img->height = hd->height;
+    img->layout = hd->layout;  // the layout of the exported image
+    img->tilesx = (img->width + TMASK) >> TBITS;
+    img->map = map;
+    img->mapsize = st.st_size;
+    img->pixel = (uint8*)map + SHARED_HEADER;
+    if (generation != NULL) *generation = hd->generation;
+  } else {
+    errsave = errno;
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    errno = errsave;
+  }
+  if (fd >= 0) close(fd);
+  return img;
+}
+
+/// Get the generation of the shared image name, without attaching it
+/// (to check for a newer export).
+/// On failure (no such image, or not ready), returns 0 and errno/errCause
+/// are set accordingly.
+unsigned long ImageSharedGeneration(const char* name) { ///
+  assert (name != NULL);
+  char sname[256];
+  int fd = -1;
+  SharedHeader hd;
+  int success =
+  sharedName(name, sname) &&
+  check( (fd = shm_open(sname, O_RDONLY, 0)) >= 0, "Open failed" ) &&
+  sharedHeader(fd, &hd) &&
+  check( hd.generation != 0, "Shared image not ready" );
+  if (fd >= 0) close(fd);
+  return success ? hd.generation : 0;
+}
+
+/// Remove the shared image name.
+/// Images attached to it stay valid until destroyed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageRemoveShared(const char* name) { ///
+  assert (name != NULL);
+  char sname[256];
+  return
+  sharedName(name, sname) &&
+  check( shm_unlink(sname) == 0, "Removing shared image failed" );
+}
+
+
+/// Information queries
+
+/// These functions do not modify the image and never fail.
+
+/// Get image width
+int ImageWidth(Image img) { ///
+  assert (img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(Image img) { ///
+  assert (img != NULL);
+  return img->height;
+}
+
+/// Get image maximum gray level
+int ImageMaxval(Image img) { ///
+  assert (img != NULL);
+  return img->maxval;
+}
+
+// Min and max of the tile with corner (tx,ty), scanned row by row
+// (unless it is blank).
+static uint16_t tileMinMax(Image img, int tx, int ty) {
+  if (img->blank != NULL && img->blank[(size_t)(ty >> TBITS)*img->tilesx + (tx >> TBITS)]) return 0;
+  int w = (img->width - tx < TSIZE) ? img->width - tx : TSIZE;
+  int h = (img->height - ty < TSIZE) ? img->height - ty : TSIZE;
+  uint8 buf[TSIZE];
+  uint8 min = PixMax, max = 0;
+  for (int y = ty; y < ty + h; y++) {
+    kernels->minmax(rowPtr(img, tx, y, w, buf, 1), w, &min, &max);
+  }
+  return (uint16_t)(min | max << 8);
+}
+
+// Guards the tile caches: stats are read from many threads at once.
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Pixel stats
+/// Find the minimum and maximum gray levels in image.
+/// On return,
+/// *min is set to the minimum gray level in the image,
+/// *max is set to the maximum.
+/// The extremes of each tile of the image are cached, so after a change
+/// only the tiles it touched are scanned again (see ImageChanges), and
+/// tiles never written are not scanned at all (see ImageCreate).
+void ImageStats(Image img, uint8* min, uint8* max) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  *min = PixMax;
+  *max = 0;
+  int tw = (img->width + TSIZE - 1) >> TBITS;
+  int th = (img->height + TSIZE - 1) >> TBITS;
+  pthread_mutex_lock(&statsLock);
+  if (img->tileStats == NULL) {  // first call: scan every tile
+    img->tileStats = (uint16_t*)malloc((size_t)tw*th*sizeof(uint16_t) + 1);
+    if (img->tileStats == NULL) {  // no cache: just scan the image
+      pthread_mutex_unlock(&statsLock);
+      for (int y = 0; y < img->height; y++) {
+        int n = 0;
+        for (int x = 0; x < img->width; x += n) {
+          kernels->minmax(pixSpan(img, x, y, &n), n, min, max);
+        }
+      }
+      return;
+    }
+    for (int j = 0; j < th; j++)
+      for (int i = 0; i < tw; i++)
+        img->tileStats[j*tw + i] = tileMinMax(img, i << TBITS, j << TBITS);
+    img->statsVersion = img->version;
+  }
+  if (img->statsVersion != img->version) {  // scan the tiles that changed
+    ImageRect r[NCHANGES];
+    int nr = ImageChanges(img, img->statsVersion, r, NCHANGES);
+    for (int k = 0; k < nr; k++) {
+      for (int j = r[k].y >> TBITS; j <= (r[k].y + r[k].h - 1) >> TBITS; j++)
+        for (int i = r[k].x >> TBITS; i <= (r[k].x + r[k].w - 1) >> TBITS; i++)
+          img->tileStats[j*tw + i] = tileMinMax(img, i << TBITS, j << TBITS);
+    }
+    img->statsVersion = img->version;
+  }
+  for (int t = 0; t < tw*th; t++) {
+    uint8 lo = img->tileStats[t] & 0xff, hi = img->tileStats[t] >> 8;
+    if (lo < *min) *min = lo;
+    if (hi > *max) *max = hi;
+  }
+  pthread_mutex_unlock(&statsLock);
+}
+
+// Hash n bytes at p into the 4 lanes of h (8 bytes each at a time, so a
+// row hashes at about the speed of a copy).
+static void hashBytes(uint64_t h[4], const uint8* p, size_t n) {
+  const uint64_t m = 0x9E3779B97F4A7C15ull;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (int l = 0; l < 4; l++) {
+      uint64_t w;
+      memcpy(&w, p + i + 8*l, 8);
+      h[l] = (h[l] ^ w) * m;
+      h[l] ^= h[l] >> 29;
+    }
+  }
+  for (; i < n; i += 8) {  // tail, zero padded
+    uint64_t w = 0;
+    memcpy(&w, p + i, (n - i < 8) ? n - i : 8);
+    h[0] = (h[0] ^ w) * m;
+    h[0] ^= h[0] >> 29;
+  }
+  h[1] = (h[1] ^ n) * m;
+}
+
+/// Content hash
+/// Get a 64-bit hash of the size, maxval and pixels of img, the same in
+/// any layout.  Images with the same hash are almost surely equal.
+/// The hash is kept until the image changes.
+uint64_t ImageHash(Image img) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  pthread_mutex_lock(&statsLock);
+  int known = img->hashVersion == img->version + 1;
+  uint64_t hash = img->hash;
+  pthread_mutex_unlock(&statsLock);
+  if (known) return hash;
+
+  uint64_t h[4] = { (uint64_t)img->width, (uint64_t)img->height, img->maxval, 0x5851F42D4C957F2Dull };
+  uint8 buf[4096];  // rows are hashed in pieces of this size
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0; x < img->width; x += sizeof(buf)) {
+      int n = (img->width - x < (int)sizeof(buf)) ? img->width - x : (int)sizeof(buf);
+      hashBytes(h, rowPtr(img, x, y, n, buf, 1), n);
     }
   }
+  PIXMEM += (unsigned long)img->width*img->height;
+  hash = h[0] ^ (h[1] * 0xC2B2AE3D27D4EB4Full) ^ (h[2] >> 17) ^ (h[3] * 0x165667B19E3779F9ull);
+  hash ^= hash >> 31;
+
+  pthread_mutex_lock(&statsLock);
+  img->hash = hash;
+  img->hashVersion = img->version + 1;
+  pthread_mutex_unlock(&statsLock);
+  return hash;
+}
+
+/// Check if pixel position (x,y) is inside img.
+int ImageValidPos(Image img, int x, int y) { ///
+  assert (img != NULL);
+  return (0 <= x && x < ImageWidth(img)) && (0 <= y && y < ImageHeight(img));
+}
+
+/// Check if rectangular area (x,y,w,h) is completely inside img.
+int ImageValidRect(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  if (w <= 0 || h <= 0) {return 0;}
+  
+  // making sure width and height values are not negative (which if they were to be, the image cropped could potentially give an inverted 
+   // cropped image) and also check if the position (x,y) is inside img.
+  return ( (ImageValidPos(img, x, y)) && (w<=ImageWidth(img)-x) && (h<=ImageHeight(img)-y) ); // returns 1 if the rectangle sides, starting from the point (x,y), are inside the image area.
+}
+
+/// Pixel get & set operations
+
+/// These are the primitive operations to access and modify a single pixel
+/// in the image.
+/// These are very simple, but fundamental operations, which may be used to 
+/// implement more complex operations.
+
+/// Get the pixel (level) at position (x,y).
+uint8 ImageGetPixel(Image img, int x, int y) { ///
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  PIXMEM += 1;  // count one pixel access (read)
+  return img->pixel[G(img, x, y)];
+} 
+
+/// Set the pixel at position (x,y) to new level.
+/// Like every function that changes pixels, it records the change (see
+/// Change tracking), so calls on the same image must not run at the same
+/// time, even for different pixels: serialize all writes to one image.
+void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
+  assert (img != NULL);
+  assert (ImageValidPos(img, x, y));
+  PIXMEM += 1;  // count one pixel access (store)
+  img->pixel[G(img, x, y)] = level;
+  markChanged(img, x, y, 1, 1);
+} 
+
+
+/// Raw pixel access
+
+/// Get the pixel array of img (in the order of its layout).
+uint8* ImagePixels(Image img) { ///
+  assert (img != NULL);
+  return img->pixel;
+}
+
+/// Get the size of the pixel array of img, in bytes.
+size_t ImagePixelBytes(Image img) { ///
+  assert (img != NULL);
+  return pixelBytes(img->layout, img->width, img->height);
+}
+
+
+/// Change tracking
+
+/// Get the version of img (0 when created or loaded).
+unsigned long ImageVersion(Image img) { ///
+  assert (img != NULL);
+  return img->version;
+}
+
+/// Get rectangles covering every pixel of img changed after it had
+/// version since (and maybe other pixels too), into rects[0..max-1], with
+/// the last ones merged if there are more.
+/// Requires: max >= 1, since <= ImageVersion(img).
+/// Returns the number of rectangles (0 if nothing changed).
+int ImageChanges(Image img, unsigned long since, ImageRect* rects, int max) { ///
+  assert (img != NULL);
+  assert (rects != NULL);
+  assert (max >= 1);
+  assert (since <= img->version);
+  int n = 0;
+  Change merged = { 0, 0, 0, 0, 0 };
+  for (int i = 0; i < img->nchanges; i++) {
+    const Change* c = &img->changes[i];
+    if (c->version <= since) continue;
+    merged = (n < max) ? *c : changeUnion(&merged, c);
+    if (n < max) n++;
+    rects[n-1] = (ImageRect){ merged.x, merged.y, merged.w, merged.h };
+  }
+  return n;
+}
+
+/// Record that the pixels of img in rectangle (x,y,w,h) were changed.
+/// Requires: the rectangle must be inside img.
+void ImageMarkChanged(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  markChanged(img, x, y, w, h);
+}
+
+
+/// Pixel transformations
+
+/// These functions modify the pixel levels in an image, but do not change
+/// pixel positions or image geometry in any way.
+/// All of these functions modify the image in-place: no allocation involved.
+/// They never fail.
+
+
+/// Transform image to negative image.
+/// This transforms dark pixels to light pixels and vice-versa,
+/// resulting in a "photographic negative" effect.
+void ImageNegative(Image img) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  // Point operations work on the whole pixel array (with any padding)
+  kernels->negate(img->pixel, pixelBytes(img->layout, img->width, img->height), img->maxval);
+  markAllChanged(img);
+  PIXMEM += 2ul*img->width*img->height;  // one read and one store per pixel
+}
+
+/// Apply threshold to image.
+/// Transform all pixels with level<thr to black (0) and
+/// all pixels with level>=thr to white (maxval).
+void ImageThreshold(Image img, uint8 thr) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  kernels->threshold(img->pixel, pixelBytes(img->layout, img->width, img->height), thr, img->maxval);
+  markAllChanged(img);
+  PIXMEM += 2ul*img->width*img->height;
+}
+
+/// Brighten image by a factor.
+/// Multiply each pixel level by a factor, but saturate at maxval.
+/// This will brighten the image if factor>1.0 and
+/// darken the image if factor<1.0.
+void ImageBrighten(Image img, double factor) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  assert( factor > 0 );
+  uint8 lut[256];  // new level of each level
+  for (int v = 0; v < 256; v++) {
+    double b = v*factor + 0.5;  // rounded
+    lut[v] = (b >= img->maxval) ? img->maxval : (uint8)b;
+  }
+  uint8* p = img->pixel;
+  size_t n = pixelBytes(img->layout, img->width, img->height);
+  for (size_t i = 0; i < n; i++) p[i] = lut[p[i]];
+  markAllChanged(img);
+  PIXMEM += 2ul*img->width*img->height;
+}
+
+/// Geometric transformations
+
+/// These functions apply geometric transformations to an image,
+/// returning a new image as a result.
+/// 
+/// Success and failure are treated as in ImageCreate:
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+// Implementation hint: 
+// Call ImageCreate whenever you need a new image!
+
+// Byte reversal helpers
+//
+// Mirroring reverses rows of bytes.  With SSE2, 16 bytes are reversed at a
+// time: swap the bytes of each 16-bit word, then reverse the words.
+// Otherwise 8 bytes are reversed at a time with a 64-bit byte swap.
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+#define RVBLOCK 16
+typedef __m128i rvblock;
+
+static inline rvblock rvLoad(const uint8* p) { return _mm_loadu_si128((const __m128i*)p); }
+static inline void rvStore(uint8* p, rvblock v) { _mm_storeu_si128((__m128i*)p, v); }
+static inline rvblock rvReverse(rvblock v) {
+  v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+#else
+#define RVBLOCK 8
+typedef uint64_t rvblock;
+
+static inline rvblock rvLoad(const uint8* p) { rvblock v; memcpy(&v, p, 8); return v; }
+static inline void rvStore(uint8* p, rvblock v) { memcpy(p, &v, 8); }
+static inline rvblock rvReverse(rvblock v) { return __builtin_bswap64(v); }
+#endif
+
+// Copy n bytes from src to dst in reverse order (dst[i] = src[n-1-i]).
+// dst and src must not overlap.
+static void reverseCopy(uint8* dst, const uint8* src, int n) {
+  int i = 0;
+  for (; i + RVBLOCK <= n; i += RVBLOCK) {
+    rvStore(dst + n - i - RVBLOCK, rvReverse(rvLoad(src + i)));
+  }
+  for (; i < n; i++) dst[n-1-i] = src[i];
+}
+
+// Exchange a[i] with b[n-1-i], for i in [0, n).
+// If a == b, this reverses a in-place; otherwise a and b must not overlap.
+static void reverseSwap(uint8* a, uint8* b, int n) {
+  int i = 0;
+  int j = n;  // b[j-RVBLOCK .. j) pairs with a[i .. i+RVBLOCK)
+  int lim = (a == b) ? n/2 : n;  // in-place: stop at the middle
+  for (; i + RVBLOCK <= lim; i += RVBLOCK, j -= RVBLOCK) {
+    rvblock va = rvLoad(a + i);
+    rvblock vb = rvLoad(b + j - RVBLOCK);
+    rvStore(a + i, rvReverse(vb));
+    rvStore(b + j - RVBLOCK, rvReverse(va));
+  }
+  for (; i < lim; i++, j--) {
+    uint8 t = a[i];
+    a[i] = b[j-1];
+    b[j-1] = t;
+  }
+}
+
+// Exchange n bytes between a and b (which must not overlap).
+static void swapBytes(uint8* a, uint8* b, int n) {
+  uint8 tmp[1024];
+  while (n > 0) {
+    int c = (n < (int)sizeof(tmp)) ? n : (int)sizeof(tmp);
+    memcpy(tmp, a, c);
+    memcpy(a, b, c);
+    memcpy(b, tmp, c);
+    a += c; b += c; n -= c;
+  }
+}
+
+/// Rotate an image.
+/// Returns a rotated version of the image.
+/// The rotation is 90 degrees anti-clockwise.
+/// Ensures: The original img is not modified.
+/// 
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate(Image img) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  Image new_img = imageNew(ImageHeight(img), ImageWidth(img), ImageMaxval(img), 0); //create an image with the height = old width and width = old height size
   if (new_img == NULL){
     errCause = "Not enough memory";
     return NULL;
   }
+  for (int by = 0; by < ImageHeight(new_img); by += TSIZE){ // go through TSIZE x TSIZE blocks, so that the columns read from img
+   for (int bx = 0; bx < ImageWidth(new_img); bx += TSIZE){ // stay in cache (and in a single tile, in tiled layouts)
+    for (int y = by; y < by+TSIZE && y < ImageHeight(new_img); y++){ //for every coordinate y ∈ [0,new height = old width]
+     for (int x = bx; x < bx+TSIZE && x < ImageWidth(new_img); x++){ // & x ∈ [0,new width = old height],
+      ImageSetPixel(new_img, x, y, ImageGetPixel(img, ImageWidth(img)-y-1, x));// The first line of pixels (with y = 0) will become the 
+      // first column of pixels (x = 0) read from bottom to top, then the second line of pixels (y = 1) will 
+      // become the second column of pixels, etc... until the last line of pixels becomes
+      // the last column of pixels. We can also look at this from a mathematical prespective
+      // and apply a change of variables of: ( x =-y ) & ( y = x )  
+     }
+    }
+   }
+  }
   return new_img;
 }
 
@@ -462,21 +2255,127 @@ Image ImageRotate(Image img) { ///
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) { ///
+  InstrScope(__func__);
   assert (img != NULL);
-  Image new_img =  ImageCreate(ImageWidth(img), ImageHeight(img), ImageMaxval(img)); //create an image with exactly the same size and maxvalues
-  for (int x = 0; x < ImageWidth(img); x++){ // for every coordinate for x ∈ [0,width]
-    for (int y = 0; y < ImageHeight(img); y++){ // & y ∈ [0,height],
-        int width = ImageWidth(img)-x-1; //the new width will start from the other end of the image, therefore, width-1 (for the first iteration)
-        ImageSetPixel(new_img, x ,y,ImageGetPixel(img, width, y)); //set pixel for the value in the other end. 
-    }
-  }
+  Image new_img =  imageNew(ImageWidth(img), ImageHeight(img), ImageMaxval(img), 0); //create an image with exactly the same size and maxvalues
   if (new_img == NULL){
     errCause = "Not enough memory";
     return NULL;
   }
+  int w = ImageWidth(img);
+  uint8* buf = NULL;
+  if (img->layout != LAYOUT_RASTER || new_img->layout != LAYOUT_RASTER){ // rows are not contiguous: need row buffers
+    buf = (uint8*)malloc(2*w + 1);
+    if (buf == NULL){
+      ImageDestroy(&new_img);
+      errCause = "Not enough memory";
+      return NULL;
+    }
+  }
+  for (int y = 0; y < ImageHeight(img); y++){ // copy each row, reversed
+    if (buf == NULL){
+      reverseCopy(new_img->pixel + G(new_img, 0, y), img->pixel + G(img, 0, y), w);
+    } else {
+      reverseCopy(buf + w, rowPtr(img, 0, y, w, buf, 1), w);
+      rowPut(new_img, 0, y, w, buf + w);
+    }
+  }
+  free(buf);
+  PIXMEM += 2ul*w*ImageHeight(img);  // one read and one store per pixel
   return new_img;
 }
 
+/// In-place geometric transformations
+
+/// These functions transform img itself: no allocation involved.
+/// They never fail.  Use them instead of the copying versions when the
+/// original image is no longer needed.
+
+/// Mirror an image in-place = flip left-right.
+void ImageMirrorInPlace(Image img) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  int w = ImageWidth(img);
+  for (int y = 0; y < ImageHeight(img); y++){
+    if (img->layout == LAYOUT_RASTER){
+      uint8* row = img->pixel + G(img, 0, y);
+      reverseSwap(row, row, w);
+    } else {
+      for (int x = 0; x < w/2; x++){
+        uint8* a = img->pixel + G(img, x, y);
+        uint8* b = img->pixel + G(img, w-1-x, y);
+        uint8 t = *a; *a = *b; *b = t;
+      }
+    }
+  }
+  markAllChanged(img);
+  PIXMEM += 2ul*w*ImageHeight(img);
+}
+
+/// Flip an image in-place = flip top-bottom.
+void ImageFlipInPlace(Image img) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  for (int y = 0; y < h/2; y++){ // swap row y with its opposite row, span by span
+    int n;
+    for (int x = 0; x < w; x += n){
+      uint8* a = pixSpan(img, x, y, &n);
+      swapBytes(a, img->pixel + G(img, x, h-1-y), n);
+    }
+  }
+  markAllChanged(img);
+  PIXMEM += 2ul*w*(h - h%2);
+}
+
+/// Rotate an image in-place by 180 degrees.
+void ImageRotate180InPlace(Image img) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  for (int y = 0; y < (h+1)/2; y++){ // swap row y, reversed, with its opposite row
+    if (img->layout == LAYOUT_RASTER){
+      reverseSwap(img->pixel + G(img, 0, y), img->pixel + G(img, 0, h-1-y), w);
+    } else {
+      for (int x = 0; x < ((y == h-1-y) ? w/2 : w); x++){
+        uint8* a = img->pixel + G(img, x, y);
+        uint8* b = img->pixel + G(img, w-1-x, h-1-y);
+        uint8 t = *a; *a = *b; *b = t;
+      }
+    }
+  }
+  markAllChanged(img);
+  PIXMEM += 2ul*w*h;
+}
+
+/// Rotate a square image in-place by 90 degrees anti-clockwise.
+/// Requires: img must be square (width == height).
+void ImageRotateInPlace(Image img) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  assert (ImageWidth(img) == ImageHeight(img));
+  int n = ImageWidth(img);
+  // A rotation is a transposition followed by a top-bottom flip.
+  // Transpose in B x B blocks, so both blocks of each pair stay in cache.
+  const int B = TSIZE/2;
+  uint8* p = img->pixel;
+  for (int by = 0; by < n; by += B){
+    for (int bx = by; bx < n; bx += B){
+      for (int y = by; y < by + B && y < n; y++){
+        for (int x = (bx == by) ? y + 1 : bx; x < bx + B && x < n; x++){
+          uint8 t = p[G(img, x, y)];
+          p[G(img, x, y)] = p[G(img, y, x)];
+          p[G(img, y, x)] = t;
+        }
+      }
+    }
+  }
+  PIXMEM += 2ul*n*(n-1);  // off-diagonal pixels: one read and one store
+  ImageFlipInPlace(img);  // (which records the change)
+}
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -490,25 +2389,523 @@ Image ImageMirror(Image img) { ///
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) { ///
+  InstrScope(__func__);
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h));
-  Image new_img = ImageCreate(w, h, ImageMaxval(img));
-  for (int i = 0; i < w; i++){
-    for (int j = 0; j < h; j++){
-      int width = x+i;         
-      int height = y+j;                               //starting at coords x,y
-      uint8 level = ImageGetPixel(img, width, height);//get the pixels of the main image
-      ImageSetPixel(new_img, i, j, level);            //and paste them in the new image
+  Image new_img = imageNew(w, h, ImageMaxval(img), 0);
+  if (new_img == NULL){
+    errCause = "Not enough memory";
+    return NULL;
+  }
+  for (int j = 0; j < h; j++){ //copy a whole row at a time, starting at coords x,y
+    rowCopy(new_img, 0, j, img, x, y+j, w);
+  }
+  PIXMEM += 2ul*w*h;  // one read and one store per pixel
+  return new_img;
+}
+
+
+// Resampling
+//
+// ImageResize is separable: each output pixel is a weighted sum of a few
+// source pixels in its row (horizontal pass) followed by a weighted sum of
+// a few horizontally filtered rows (vertical pass).
+// For each output column (and row), a filter table holds the first source
+// index and a fixed number of tap weights, so the inner loops have no
+// bounds checks or floating point.
+// Weights are in fixed point with RWBITS fraction bits and each set of
+// taps sums exactly to 1<<RWBITS.  The horizontal pass keeps 8 fraction
+// bits in uint16 intermediate rows, the vertical pass accumulates in
+// uint32.  Both are plain loops over contiguous arrays that the compiler
+// can vectorize.
+
+#define RWBITS 12
+#define RWONE (1 << RWBITS)
+
+// Filter table for one dimension: output d reads source pixels
+// start[d], ..., start[d]+taps-1, with weights weight[d*taps + t].
+struct filter {
+  int taps;
+  int* start;
+  int32_t* weight;
+};
+
+static void filterFree(struct filter* f) {
+  free(f->start);
+  free(f->weight);
+}
+
+// Add weight wt of source pixel i to the contributions of one output pixel.
+// Contributions are kept in (idx, wt) arrays of at most maxc entries.
+static int filterAdd(int* idx, double* wt, int nc, int i, double w) {
+  if (w <= 0.0) return nc;
+  if (nc > 0 && idx[nc-1] == i) { wt[nc-1] += w; return nc; }
+  idx[nc] = i; wt[nc] = w;
+  return nc + 1;
+}
+
+// Build the filter table mapping a source size s to destination size dn.
+// Returns 0 if memory allocation fails.
+static int filterBuild(struct filter* f, int s, int dn, ResizeMethod method) {
+  double scale = (double)s / dn;  // source pixels per destination pixel
+  int maxc = (method == RESIZE_AREA) ? (int)scale + 2 : 2;
+  int* idx = (int*)malloc(dn*maxc*sizeof(int));
+  double* wt = (double*)malloc(dn*maxc*sizeof(double));
+  int* nc = (int*)malloc(dn*sizeof(int));
+  f->start = (int*)malloc(dn*sizeof(int));
+  f->weight = NULL;
+  int ok = idx != NULL && wt != NULL && nc != NULL && f->start != NULL;
+
+  // Find the contributions of each destination pixel d
+  f->taps = 1;
+  for (int d = 0; ok && d < dn; d++) {
+    int* di = idx + d*maxc;
+    double* dw = wt + d*maxc;
+    int c = 0;
+    if (method == RESIZE_NEAREST) {
+      int i = (int)((d + 0.5)*scale);
+      c = filterAdd(di, dw, c, (i < s) ? i : s-1, 1.0);
+    } else if (method == RESIZE_BILINEAR) {
+      double sx = (d + 0.5)*scale - 0.5;
+      if (sx < 0.0) sx = 0.0;
+      int i = (int)sx;
+      if (i >= s-1) { i = s-1; sx = i; }
+      c = filterAdd(di, dw, c, i, 1.0 - (sx - i));
+      c = filterAdd(di, dw, c, i+1, sx - i);
+    } else {  // RESIZE_AREA: source interval [a, b) covered by d
+      double a = d*scale;
+      double b = (d + 1)*scale;
+      for (int i = (int)a; i < b && i < s; i++) {
+        double lo = (i > a) ? i : a;
+        double hi = (i + 1 < b) ? i + 1 : b;
+        c = filterAdd(di, dw, c, i, (hi - lo) / scale);
+      }
     }
+    nc[d] = c;
+    int span = di[c-1] - di[0] + 1;
+    if (span > f->taps) f->taps = span;
   }
-  if (new_img == NULL){
+
+  // Convert to fixed point, with a common number of taps
+  if (ok) {
+    f->weight = (int32_t*)calloc(dn*f->taps, sizeof(int32_t));
+    ok = f->weight != NULL;
+  }
+  for (int d = 0; ok && d < dn; d++) {
+    int* di = idx + d*maxc;
+    double* dw = wt + d*maxc;
+    int st = (di[0] + f->taps <= s) ? di[0] : s - f->taps;
+    int32_t* w = f->weight + d*f->taps;
+    int32_t sum = 0;
+    int big = 0;  // tap with largest weight gets the rounding remainder
+    for (int c = 0; c < nc[d]; c++) {
+      int t = di[c] - st;
+      w[t] = (int32_t)(dw[c]*RWONE + 0.5);
+      sum += w[t];
+      if (w[t] > w[big]) big = t;
+    }
+    w[big] += RWONE - sum;
+    f->start[d] = st;
+  }
+  free(idx);
+  free(wt);
+  free(nc);
+  if (!ok) filterFree(f);
+  return ok;
+}
+
+// Shared arguments for the ImageResize workers
+struct resize {
+  Image src, dst;
+  struct filter fx, fy;
+  int failed;  // set if some worker could not allocate its buffers
+};
+
+// Horizontal pass: filter source row y into tmp (8 fraction bits).
+// sbuf is scratch space for a source row.
+static void resizeRow(const struct resize* a, int y, uint16_t* tmp, uint8* sbuf) {
+  const uint8* row = rowPtr(a->src, 0, y, a->src->width, sbuf, 1);
+  int taps = a->fx.taps;
+  for (int x = 0; x < a->dst->width; x++) {
+    const uint8* p = row + a->fx.start[x];
+    const int32_t* w = a->fx.weight + x*taps;
+    uint32_t acc = 0;
+    for (int t = 0; t < taps; t++) acc += (uint32_t)w[t]*p[t];
+    tmp[x] = (uint16_t)((acc + (1 << (RWBITS-9))) >> (RWBITS-8));
+  }
+}
+
+// Compute output rows [begin, end) of a resize.
+// Horizontally filtered source rows are kept in a ring of fy.taps rows,
+// so rows shared by consecutive output rows are filtered only once.
+static unsigned long resizeRows(void* arg, int begin, int end) {
+  struct resize* a = (struct resize*)arg;
+  int dw = a->dst->width;
+  int taps = a->fy.taps;
+  uint16_t* ring = (uint16_t*)malloc((size_t)taps*dw*sizeof(uint16_t));
+  int* tag = (int*)malloc(taps*sizeof(int));
+  uint32_t* acc = (uint32_t*)malloc(dw*sizeof(uint32_t));
+  uint8* sbuf = (uint8*)malloc(a->src->width + dw);  // source and output rows
+  if (ring == NULL || tag == NULL || acc == NULL || sbuf == NULL) {
+    __atomic_store_n(&a->failed, 1, __ATOMIC_RELAXED);
+    free(ring); free(tag); free(acc); free(sbuf);
+    return 0;
+  }
+  for (int t = 0; t < taps; t++) tag[t] = -1;
+
+  unsigned long count = 0;
+  for (int y = begin; y < end; y++) {
+    int sy = a->fy.start[y];
+    const int32_t* w = a->fy.weight + y*taps;
+    for (int x = 0; x < dw; x++) acc[x] = 1u << (RWBITS+8-1);  // rounding
+    for (int t = 0; t < taps; t++) {
+      uint16_t* tmp = ring + (size_t)((sy + t) % taps)*dw;
+      if (tag[(sy + t) % taps] != sy + t) {
+        resizeRow(a, sy + t, tmp, sbuf);
+        tag[(sy + t) % taps] = sy + t;
+        count += (unsigned long)dw*a->fx.taps;
+      }
+      uint32_t wt = (uint32_t)w[t];
+      if (wt == 0) continue;
+      for (int x = 0; x < dw; x++) acc[x] += wt*tmp[x];
+    }
+    uint8* out = rowPtr(a->dst, 0, y, dw, sbuf + a->src->width, 0);
+    for (int x = 0; x < dw; x++) out[x] = (uint8)(acc[x] >> (RWBITS+8));
+    rowPut(a->dst, 0, y, dw, out);
+    count += dw;
+  }
+  free(ring);
+  free(tag);
+  free(acc);
+  free(sbuf);
+  return count;
+}
+
+// Nearest neighbour: a gather from a column index table.
+// Rows that map to the same source row as the previous one are copied.
+static unsigned long resizeNearestRows(void* arg, int begin, int end) {
+  struct resize* a = (struct resize*)arg;
+  int dw = a->dst->width;
+  uint8* sbuf = (uint8*)malloc(a->src->width + dw);  // source and output rows
+  if (sbuf == NULL) {
+    __atomic_store_n(&a->failed, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  uint8* prev = NULL;
+  unsigned long count = 0;
+  for (int y = begin; y < end; y++) {
+    uint8* out = rowPtr(a->dst, 0, y, dw, sbuf + a->src->width, 0);
+    if (prev != NULL && a->fy.start[y] == a->fy.start[y-1]) {
+      if (out != prev) memcpy(out, prev, dw);
+    } else {
+      const uint8* row = rowPtr(a->src, 0, a->fy.start[y], a->src->width, sbuf, 1);
+      for (int x = 0; x < dw; x++) out[x] = row[a->fx.start[x]];
+    }
+    rowPut(a->dst, 0, y, dw, out);
+    prev = out;
+    count += 2ul*dw;
+  }
+  free(sbuf);
+  return count;
+}
+
+// Area resize by integer factors (w = src width / fx, h = src height / fy):
+// each output pixel is the rounded mean of an fx by fy block.
+static unsigned long resizeBoxRows(void* arg, int begin, int end) {
+  struct resize* a = (struct resize*)arg;
+  int dw = a->dst->width;
+  int bx = a->src->width / dw;
+  int by = a->src->height / a->dst->height;
+  uint32_t n = (uint32_t)bx*by;
+  uint32_t* acc = (uint32_t*)malloc(dw*sizeof(uint32_t));
+  uint8* sbuf = (uint8*)malloc(a->src->width + dw);  // source and output rows
+  if (acc == NULL || sbuf == NULL) {
+    __atomic_store_n(&a->failed, 1, __ATOMIC_RELAXED);
+    free(acc); free(sbuf);
+    return 0;
+  }
+  for (int y = begin; y < end; y++) {
+    for (int x = 0; x < dw; x++) acc[x] = n/2;  // rounding
+    for (int j = 0; j < by; j++) {
+      const uint8* row = rowPtr(a->src, 0, y*by + j, a->src->width, sbuf, 1);
+      for (int x = 0; x < dw; x++) {
+        const uint8* p = row + x*bx;
+        uint32_t sum = 0;
+        for (int i = 0; i < bx; i++) sum += p[i];
+        acc[x] += sum;
+      }
+    }
+    uint8* out = rowPtr(a->dst, 0, y, dw, sbuf + a->src->width, 0);
+    for (int x = 0; x < dw; x++) out[x] = (uint8)(acc[x] / n);
+    rowPut(a->dst, 0, y, dw, out);
+  }
+  free(acc);
+  free(sbuf);
+  return (unsigned long)(end - begin)*dw*(n + 1);
+}
+
+/// Resize an image.
+/// Returns a version of img scaled to width w and height h, resampled
+/// with the given method.
+/// Requires: w > 0, h > 0, and img must not be empty.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ResizeMethod method) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  assert (w > 0 && h > 0);
+  assert (img->width > 0 && img->height > 0);
+  assert (method == RESIZE_NEAREST || method == RESIZE_BILINEAR || method == RESIZE_AREA);
+  Image new_img = imageNew(w, h, ImageMaxval(img), 0);
+  if (new_img == NULL) return NULL;
+
+  struct resize a = { img, new_img };
+  ChunkFn fn;
+  if (w == img->width && h == img->height) {  // nothing to resample
+    for (int y = 0; y < h; y++) rowCopy(new_img, 0, y, img, 0, y, w);
+    PIXMEM += 2ul*w*h;
+    return new_img;
+  } else if (method == RESIZE_AREA && img->width % w == 0 && img->height % h == 0) {
+    fn = resizeBoxRows;  // integer ratio fast path: no tables needed
+  } else {
+    if (!filterBuild(&a.fx, img->width, w, method)) {
+      ImageDestroy(&new_img);
+      errCause = "Not enough memory";
+      return NULL;
+    }
+    if (!filterBuild(&a.fy, img->height, h, method)) {
+      filterFree(&a.fx);
+      ImageDestroy(&new_img);
+      errCause = "Not enough memory";
+      return NULL;
+    }
+    fn = (method == RESIZE_NEAREST) ? resizeNearestRows : resizeRows;
+  }
+
+  PIXMEM += parallelRun(h, 16, fn, &a);
+  if (fn != resizeBoxRows) {
+    filterFree(&a.fx);
+    filterFree(&a.fy);
+  }
+  if (a.failed) {
+    ImageDestroy(&new_img);
     errCause = "Not enough memory";
     return NULL;
   }
   return new_img;
 }
 
-
+
+// Affine warping
+//
+// ImageWarpAffine maps each output pixel back to its source position with
+// the inverse matrix.  Along an output row, the source position advances by
+// a constant step, so it is kept in 64-bit fixed point (WFBITS fraction
+// bits) and incremented, instead of multiplied, per pixel.
+// For each row, the span of pixels whose source falls inside the image is
+// found beforehand, so the inner loops need no bounds checks.  Bilinear
+// sampling has an inner span where all 4 neighbours exist and a thin border
+// where they are clamped.
+// The output is processed in WTILE x WTILE tiles, so that the source pixels
+// read for a tile (along some diagonal) stay in cache.
+
+#define WFBITS 32
+#define WFONE ((int64_t)1 << WFBITS)
+#define WTILE 64
+
+// Shared arguments for the ImageWarpAffine workers
+struct warp {
+  Image src, dst;
+  double inv[6];  // output -> source map
+  ResizeMethod method;
+};
+
+// Intersect [*t0, *t1) with the set of t where lo <= f0 + t*df < hi.
+// That set is an interval: it is estimated in floating point and then
+// adjusted using the exact fixed point values.
+static void spanClip(int64_t f0, int64_t df, int64_t lo, int64_t hi, int* t0, int* t1) {
+  double a, b;
+  if (df == 0) {
+    if (f0 < lo || f0 >= hi) *t1 = *t0;
+    return;
+  } else if (df > 0) {
+    a = ((double)lo - f0) / df;
+    b = ((double)hi - f0) / df;
+  } else {
+    a = ((double)hi - f0) / df;
+    b = ((double)lo - f0) / df;
+  }
+  int tlo = (a - 1 > *t0) ? (int)fmin(a - 1, *t1) : *t0;
+  int thi = (b + 2 < *t1) ? (int)fmax(b + 2, *t0) : *t1;
+  #define INSPAN(t) (lo <= f0 + (int64_t)(t)*df && f0 + (int64_t)(t)*df < hi)
+  while (tlo < thi && !INSPAN(tlo)) tlo++;
+  while (thi > tlo && !INSPAN(thi - 1)) thi--;
+  #undef INSPAN
+  *t0 = tlo;
+  *t1 = (thi > tlo) ? thi : tlo;
+}
+
+// Bilinear sample at fixed point position (sx, sy), clamped to the image.
+static inline uint8 warpSampleClamped(Image src, int64_t sx, int64_t sy) {
+  int64_t mx = (int64_t)(src->width - 1) << WFBITS;
+  int64_t my = (int64_t)(src->height - 1) << WFBITS;
+  sx = (sx < 0) ? 0 : (sx > mx) ? mx : sx;
+  sy = (sy < 0) ? 0 : (sy > my) ? my : sy;
+  int x0 = (int)(sx >> WFBITS);
+  int y0 = (int)(sy >> WFBITS);
+  int x1 = (x0 + 1 < src->width) ? x0 + 1 : x0;
+  int y1 = (y0 + 1 < src->height) ? y0 + 1 : y0;
+  uint32_t fx = (uint32_t)(sx >> (WFBITS-8)) & 255;
+  uint32_t fy = (uint32_t)(sy >> (WFBITS-8)) & 255;
+  const uint8* p = src->pixel;
+  uint32_t top = p[G(src, x0, y0)]*(256 - fx) + p[G(src, x1, y0)]*fx;
+  uint32_t bot = p[G(src, x0, y1)]*(256 - fx) + p[G(src, x1, y1)]*fx;
+  return (uint8)((top*(256 - fy) + bot*fy + (1 << 15)) >> 16);
+}
+
+// Compute output rows [begin, end) of a warp, tile by tile.
+static unsigned long warpRows(void* arg, int begin, int end) {
+  struct warp* a = (struct warp*)arg;
+  Image src = a->src;
+  Image dst = a->dst;
+  int64_t dsx = (int64_t)llround(a->inv[0]*WFONE);
+  int64_t dsy = (int64_t)llround(a->inv[3]*WFONE);
+  int64_t half = WFONE / 2;
+  int64_t sw = (int64_t)src->width << WFBITS;
+  int64_t sh = (int64_t)src->height << WFBITS;
+  int bilinear = (a->method == RESIZE_BILINEAR);
+  int raster = (src->layout == LAYOUT_RASTER);
+  uint8 seg[WTILE];  // output row segment, if not contiguous in dst
+  unsigned long count = 0;
+
+  for (int ty = begin; ty < end; ty += WTILE) {
+    int nrows = (end - ty < WTILE) ? end - ty : WTILE;
+    int64_t sx0[WTILE], sy0[WTILE];  // source position of pixel 0 of each row
+    int out0[WTILE], out1[WTILE];    // span with source inside the image
+    int in0[WTILE], in1[WTILE];      // span with all 4 neighbours inside
+    for (int r = 0; r < nrows; r++) {
+      int y = ty + r;
+      sx0[r] = (int64_t)llround((a->inv[1]*y + a->inv[2])*WFONE);
+      sy0[r] = (int64_t)llround((a->inv[4]*y + a->inv[5])*WFONE);
+      out0[r] = 0; out1[r] = dst->width;
+      spanClip(sx0[r], dsx, -half, sw - half, &out0[r], &out1[r]);
+      spanClip(sy0[r], dsy, -half, sh - half, &out0[r], &out1[r]);
+      in0[r] = out0[r]; in1[r] = out1[r];
+      if (bilinear) {
+        spanClip(sx0[r], dsx, 0, sw - WFONE, &in0[r], &in1[r]);
+        spanClip(sy0[r], dsy, 0, sh - WFONE, &in0[r], &in1[r]);
+      }
+      // Pixels outside the source stay black (as created)
+    }
+
+    for (int tx = 0; tx < dst->width; tx += WTILE) {
+      int txe = (tx + WTILE < dst->width) ? tx + WTILE : dst->width;
+      for (int r = 0; r < nrows; r++) {
+        int x0 = (out0[r] > tx) ? out0[r] : tx;
+        int x1 = (out1[r] < txe) ? out1[r] : txe;
+        if (x0 >= x1) continue;
+        uint8* out = rowPtr(dst, x0, ty + r, x1 - x0, seg, 0);  // out[0] is pixel x0
+        int64_t sx = sx0[r] + x0*dsx;
+        int64_t sy = sy0[r] + x0*dsy;
+        if (!bilinear) {
+          for (int x = x0; x < x1; x++, sx += dsx, sy += dsy) {
+            out[x - x0] = src->pixel[G(src, (int)((sx + half) >> WFBITS), (int)((sy + half) >> WFBITS))];
+          }
+          rowPut(dst, x0, ty + r, x1 - x0, out);
+          count += 2ul*(x1 - x0);
+          continue;
+        }
+        int i0 = (in0[r] > x0) ? in0[r] : x0;
+        int i1 = (in1[r] < x1) ? in1[r] : x1;
+        if (i0 >= i1) i0 = i1 = x1;
+        int x = x0;
+        for (; x < i0; x++, sx += dsx, sy += dsy) out[x - x0] = warpSampleClamped(src, sx, sy);
+        for (; x < i1; x++, sx += dsx, sy += dsy) {
+          int xs = (int)(sx >> WFBITS);
+          int ys = (int)(sy >> WFBITS);
+          const uint8* p = src->pixel;
+          size_t i00 = G(src, xs, ys);
+          size_t i01 = raster ? i00 + 1 : G(src, xs + 1, ys);
+          size_t i10 = raster ? i00 + src->width : G(src, xs, ys + 1);
+          size_t i11 = raster ? i10 + 1 : G(src, xs + 1, ys + 1);
+          uint32_t fx = (uint32_t)(sx >> (WFBITS-8)) & 255;
+          uint32_t fy = (uint32_t)(sy >> (WFBITS-8)) & 255;
+          uint32_t top = p[i00]*(256 - fx) + p[i01]*fx;
+          uint32_t bot = p[i10]*(256 - fx) + p[i11]*fx;
+          out[x - x0] = (uint8)((top*(256 - fy) + bot*fy + (1 << 15)) >> 16);
+        }
+        for (; x < x1; x++, sx += dsx, sy += dsy) out[x - x0] = warpSampleClamped(src, sx, sy);
+        rowPut(dst, x0, ty + r, x1 - x0, out);
+        count += 5ul*(x1 - x0);
+      }
+    }
+  }
+  return count;
+}
+
+/// Apply an affine transformation to an image.
+/// Pixel (x, y) of img is moved to position
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5])
+/// of a new image with width w and height h.
+/// Pixels of the new image that do not come from inside img are black (0).
+/// method selects the sampling: RESIZE_NEAREST or RESIZE_BILINEAR.
+/// Requires: w >= 0, h >= 0, and matrix m must be invertible.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, int w, int h, const double m[6], ResizeMethod method) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  assert (w >= 0 && h >= 0);
+  assert (method == RESIZE_NEAREST || method == RESIZE_BILINEAR);
+  double det = m[0]*m[4] - m[1]*m[3];
+  assert (det != 0.0);
+  Image new_img = imageNew(w, h, ImageMaxval(img), 0);
+  if (new_img == NULL) return NULL;
+  if (img->width == 0 || img->height == 0) return new_img;  // all black
+
+  // Invert m: source = A^-1 * (output - t)
+  struct warp a = { img, new_img };
+  a.inv[0] =  m[4] / det;
+  a.inv[1] = -m[1] / det;
+  a.inv[3] = -m[3] / det;
+  a.inv[4] =  m[0] / det;
+  a.inv[2] = -(a.inv[0]*m[2] + a.inv[1]*m[5]);
+  a.inv[5] = -(a.inv[3]*m[2] + a.inv[4]*m[5]);
+  a.method = method;
+  PIXMEM += parallelRun(h, WTILE, warpRows, &a);
+  return new_img;
+}
+
+/// Rotate an image by an arbitrary angle.
+/// Returns a version of the image rotated by degrees anti-clockwise around
+/// its center, with the same size.  Corners that come from outside img are
+/// black.  method is as in ImageWarpAffine.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, ResizeMethod method) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  double c = cos(degrees*M_PI/180.0);
+  double s = sin(degrees*M_PI/180.0);
+  double cx = (ImageWidth(img) - 1) / 2.0;
+  double cy = (ImageHeight(img) - 1) / 2.0;
+  // y grows downwards, so an anti-clockwise rotation on screen is:
+  //   x' = cx + (x-cx)*c + (y-cy)*s
+  //   y' = cy - (x-cx)*s + (y-cy)*c
+  double m[6] = { c, s, cx - cx*c - cy*s,
+                 -s, c, cy + cx*s - cy*c };
+  return ImageWarpAffine(img, ImageWidth(img), ImageHeight(img), m, method);
+}
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -516,16 +2913,67 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) { ///
+  InstrScope(__func__);
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, ImageWidth(img2), ImageHeight(img2))); //validate the space of img2 inside of img1, if there's not enough space, this will abort
-  for (int i = 0; i < ImageWidth(img2); i++){
-    for (int j = 0; j < ImageHeight(img2); j++){
-      int width = i+x;              
-      int height = j+y;       //starting at coords x,y
-      ImageSetPixel(img1, width, height, ImageGetPixel(img2, i, j)); //get the img2 (small image) pixel starting from (0,0) and paste them into (the bigger image) img1
-      //starting at coords x,y.  
+  int w = ImageWidth(img2);
+  for (int j = 0; j < ImageHeight(img2); j++){ //copy a whole row of img2 at a time, starting at coords x,y
+    rowCopy(img1, x, y+j, img2, 0, j, w);
+  }
+  markChanged(img1, x, y, w, ImageHeight(img2));
+  PIXMEM += 2ul*w*ImageHeight(img2);  // one read and one store per pixel
+}
+
+// Shared arguments for the ImagePasteMany workers
+struct pasteMany {
+  Image img1;
+  const ImagePlacement* placements;
+  int n;
+};
+
+// Paste the part of every placement that falls in rows [begin, end) of img1.
+// Placements are visited in order, so overlaps are resolved exactly as in
+// a sequence of ImagePaste calls.
+static unsigned long pasteManyRows(void* arg, int begin, int end) {
+  struct pasteMany* a = (struct pasteMany*)arg;
+  unsigned long count = 0;
+  for (int k = 0; k < a->n; k++) {
+    const ImagePlacement* p = &a->placements[k];
+    int w = p->img->width;
+    int y0 = (p->y > begin) ? p->y : begin;
+    int y1 = (p->y + p->img->height < end) ? p->y + p->img->height : end;
+    for (int y = y0; y < y1; y++) {
+      rowCopy(a->img1, p->x, y, p->img, 0, y - p->y, w);
     }
+    if (y1 > y0) count += 2ul*w*(y1 - y0);
+  }
+  return count;
+}
+
+/// Paste many images into a larger image.
+/// Paste each placements[k].img into position (placements[k].x,
+/// placements[k].y) of img1, for k = 0, 1, ..., n-1.
+/// The result is the same as calling ImagePaste for each placement in
+/// order: where placements overlap, later ones prevail.
+/// The work is split in bands of rows of img1 and run on several threads.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: every placed image must fit inside img1 at its position.
+void ImagePasteMany(Image img1, const ImagePlacement* placements, int n) { ///
+  InstrScope(__func__);
+  assert (img1 != NULL);
+  assert (n >= 0);
+  assert (n == 0 || placements != NULL);
+  for (int k = 0; k < n; k++) {
+    assert (placements[k].img != NULL);
+    assert (ImageValidRect(img1, placements[k].x, placements[k].y,
+                           ImageWidth(placements[k].img), ImageHeight(placements[k].img)));
+  }
+  struct pasteMany a = { img1, placements, n };
+  PIXMEM += parallelRun(ImageHeight(img1), 64, pasteManyRows, &a);
+  for (int k = 0; k < n; k++) {
+    markChanged(img1, placements[k].x, placements[k].y,
+                placements[k].img->width, placements[k].img->height);
   }
 }
 
@@ -536,37 +2984,53 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
+  InstrScope(__func__);
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  for (int i = 0; i < ImageWidth(img2); i++){
-    for (int j = 0; j < ImageHeight(img2); j++){
-      int width = i+x; // the new value for the pixel will be a mix of image 1 and image 2, and the portions will be decided by the alpha value which represents the percentage of img2 pixel to be added into img1 pixel
-      int height = j+y; // it will have alpha*img2'pixel (which is the smaller image) and (the rest of the percentage of alpha)*img1'pixel. since c will
-      int new_value = ImageGetPixel(img2, i, j)*alpha + ImageGetPixel(img1, width, height)*(1-alpha) + 0.5; // floor when changing to back to int, we add 0.5,
-      if (new_value < 0) { // this way if the result decimal case is >= 0.5, it will get rounded up by 1.
-        new_value = 0;}
-      else if (new_value > ImageMaxval(img1) ){
-        new_value = ImageMaxval(img1);}
-      ImageSetPixel(img1, width, height, new_value); //finally set pixel to the new value;
+  // the new value for each pixel is a mix of img1 and img2: alpha*img2 + (1-alpha)*img1,
+  // rounded and clamped to [0, maxval] (see the blend kernel)
+  int w = img2->width;
+  uint8* buf1 = malloc(w + 1);
+  uint8* buf2 = malloc(w + 1);
+  if (buf1 == NULL || buf2 == NULL) {  // no memory for row buffers: go pixel by pixel
+    double beta = 1 - alpha;
+    for (int j = 0; j < img2->height; j++)
+      for (int i = 0; i < w; i++)
+        ImageSetPixel(img1, x+i, y+j, blendPixel(ImageGetPixel(img1, x+i, y+j),
+                      ImageGetPixel(img2, i, j), alpha, beta, img1->maxval));
+  } else {
+    for (int j = 0; j < img2->height; j++) {
+      uint8* dst = rowPtr(img1, x, y+j, w, buf1, 1);
+      const uint8* src = rowPtr(img2, 0, j, w, buf2, 1);
+      kernels->blend(dst, src, w, alpha, img1->maxval);
+      rowPut(img1, x, y+j, w, dst);
     }
+    PIXMEM += 3ul*w*img2->height;  // two reads and one store per pixel
   }
+  markChanged(img1, x, y, w, img2->height);
+  free(buf1);
+  free(buf2);
 }
 
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
-int ImageMatchSubImage(Image img1, int x, int y, Image img2) { //look for img2 inside img1 (img1 is bigger than img2)
+int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
-  assert (ImageValidPos(img1, x, y));             
-  for (int i = 0; i < ImageWidth(img2); i++){     
-    for (int j = 0; j < ImageHeight(img2); j++){  //given a certain x,y and img1, we're gonna compare img2 (the smaller image) with the sub-image of img1 starting
-      int width = i+x;                            //at position x,y. the first pixel with unmatching values, makes the function return false for a similar sub-image
-      int height = j+y;                           //while we start looking at pixels in img2 at (0,0), img1 starts at (x,y), then (x+1,j)... until (x+img2->width-1,y+img2->height-1)
-      if (ImageGetPixel(img2, i, j) != ImageGetPixel(img1, width, height)){
-        return 0;
-      }
+  assert (ImageValidPos(img1, x, y));
+  assert (ImageValidRect(img1, x, y, img2->width, img2->height));
+  // compare img2 with the subimage of img1 at (x,y), row by row
+  int w = img2->width;
+  uint8 buf1[TSIZE], buf2[TSIZE];  // rows are compared in tile-sized pieces
+  for (int j = 0; j < img2->height; j++) {
+    for (int i = 0; i < w; i += TSIZE) {
+      int n = (w - i < TSIZE) ? w - i : TSIZE;
+      const uint8* p1 = rowPtr(img1, x+i, y+j, n, buf1, 1);
+      const uint8* p2 = rowPtr(img2, i, j, n, buf2, 1);
+      PIXMEM += 2ul*n;
+      if (!kernels->equal(p1, p2, n)) return 0;
     }
   }
   return 1;
@@ -577,10 +3041,11 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { //look for img2 i
 /// If a match is found, returns 1 and matching position is set in vars (*px, *py).
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
+  InstrScope(__func__);
   assert (img1 != NULL);
   assert (img2 != NULL);
-  for (int i = 0; i < ImageWidth(img1)-ImageWidth(img2); i++){
-    for (int j = 0; j < ImageHeight(img1)-ImageHeight(img2); j++){
+  for (int i = 0; i <= ImageWidth(img1)-ImageWidth(img2); i++){
+    for (int j = 0; j <= ImageHeight(img1)-ImageHeight(img2); j++){
       if (ImageGetPixel(img1, i, j) == ImageGetPixel(img2, 0, 0)){ //look for the value of the first pixel in img2 in img1. the first time this is true
         if (ImageMatchSubImage(img1, i, j, img2)){ //run the function to check if the image starting at position i,j matches. if true
           *px = i;  //change the pointer x coord value to i
@@ -594,38 +3059,1027 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
 }
 
 
+/// Search index
+
+// An index holds a hash of each k x k block of the haystack image on a
+// grid of step k, sorted by hash.  A template (at least 2k-1 pixels wide
+// and high) placed anywhere in the haystack covers exactly one grid block
+// at its offset (dx, dy) in [0,k)x[0,k) given by its position.  So
+// hashing the template blocks at all k*k offsets and looking them up
+// gives every possible match position, each checked with
+// ImageMatchSubImage.  Queries cost O(k^4 + candidates) instead of a scan
+// of the whole haystack.
+
+typedef struct {
+  uint64_t hash;
+  int32_t x, y;  // block position in the haystack
+} IndexEntry;
+
+struct imageindex {
+  Image img;    // the haystack
+  int k;        // block size and grid step
+  size_t n;     // number of entries
+  IndexEntry* entries;  // sorted by hash, then x, then y
+  unsigned long version;  // version of img that the entries reflect
+};
+
+// Hash of the k x k block of img at (x, y) (FNV-1a).
+// buf must have room for k pixels.
+static uint64_t blockHash(Image img, int x, int y, int k, uint8* buf) {
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (int j = 0; j < k; j++) {
+    const uint8* p = rowPtr(img, x, y + j, k, buf, 1);
+    for (int i = 0; i < k; i++) h = (h ^ p[i]) * 0x100000001B3ull;
+  }
+  return h;
+}
+
+static int compareEntries(const void* p1, const void* p2) {
+  const IndexEntry* a = (const IndexEntry*)p1;
+  const IndexEntry* b = (const IndexEntry*)p2;
+  if (a->hash != b->hash) return (a->hash < b->hash) ? -1 : 1;
+  if (a->x != b->x) return (a->x < b->x) ? -1 : 1;
+  return (a->y > b->y) - (a->y < b->y);
+}
+
+typedef struct {
+  ImageIndex idx;
+  int gw;  // grid blocks per row
+} IndexArgs;
+
+// Hash the grid blocks of block rows [gy0, gy1).
+static unsigned long indexRows(void* arg, int gy0, int gy1) {
+  IndexArgs* a = (IndexArgs*)arg;
+  int k = a->idx->k;
+  uint8 buf[k];
+  for (int gy = gy0; gy < gy1; gy++) {
+    for (int gx = 0; gx < a->gw; gx++) {
+      IndexEntry* e = &a->idx->entries[(size_t)gy*a->gw + gx];
+      e->x = gx*k;
+      e->y = gy*k;
+      e->hash = blockHash(a->idx->img, e->x, e->y, k, buf);
+    }
+  }
+  return (unsigned long)(gy1 - gy0)*a->gw*k*k;
+}
+
+/// Build a search index over img, with k x k blocks.
+/// The index refers to img, which must not be destroyed while the index
+/// is used.
+/// Requires: k >= 1.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexCreate(Image img, int k) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  assert (k >= 1);
+  ImageIndex idx = (ImageIndex)malloc(sizeof(struct imageindex));
+  if (!check(idx != NULL, "Not enough memory")) return NULL;
+  IndexArgs a = { idx, img->width / k };
+  int gh = img->height / k;
+  idx->img = img;
+  idx->k = k;
+  idx->version = img->version;
+  idx->n = (size_t)a.gw*gh;
+  idx->entries = (IndexEntry*)malloc(idx->n*sizeof(IndexEntry) + 1);
+  if (!check(idx->entries != NULL, "Not enough memory")) {
+    free(idx);
+    return NULL;
+  }
+  PIXMEM += parallelRun(gh, 16, indexRows, &a);
+  qsort(idx->entries, idx->n, sizeof(IndexEntry), compareEntries);
+  return idx;
+}
+
+/// Destroy the index pointed to by (*idxp) (but not its image).
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+void ImageIndexDestroy(ImageIndex* idxp) { ///
+  assert (idxp != NULL);
+  if (*idxp == NULL) return;
+  free((*idxp)->entries);
+  free(*idxp);
+  *idxp = NULL;
+}
+
+// Updates may come from several threads locating in the same index.
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+
+/// Bring an index up to date with the changes of its image, if any.
+/// (ImageIndexLocate and ImageIndexSave do it first.)
+/// The blocks that overlap the changes are hashed again and merged with
+/// the others (or, if they are many, the whole index is rebuilt).
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0 and errno/errCause are set.
+int ImageIndexUpdate(ImageIndex idx) { ///
+  InstrScope(__func__);
+  assert (idx != NULL);
+  Image img = idx->img;
+  pthread_mutex_lock(&indexLock);
+  if (idx->version == img->version) {
+    pthread_mutex_unlock(&indexLock);
+    return 1;
+  }
+  int k = idx->k;
+  int gw = img->width / k, gh = img->height / k;
+  ImageRect r[NCHANGES];
+  int nr = ImageChanges(img, idx->version, r, NCHANGES);
+  uint8* stale = (uint8*)calloc((size_t)gw*gh + 1, 1);  // blocks to hash again
+  size_t ns = 0;
+  for (int c = 0; c < nr && stale != NULL; c++) {
+    int gx1 = (r[c].x + r[c].w - 1)/k, gy1 = (r[c].y + r[c].h - 1)/k;
+    if (gx1 >= gw) gx1 = gw - 1;
+    if (gy1 >= gh) gy1 = gh - 1;
+    for (int gy = r[c].y/k; gy <= gy1; gy++) {
+      for (int gx = r[c].x/k; gx <= gx1; gx++) {
+        ns += !stale[(size_t)gy*gw + gx];
+        stale[(size_t)gy*gw + gx] = 1;
+      }
+    }
+  }
+  IndexEntry* fresh = NULL;
+  int success = check( stale != NULL, "Not enough memory" );
+  if (success && ns > idx->n/4) {  // cheaper to start over
+    IndexArgs a = { idx, gw };
+    PIXMEM += parallelRun(gh, 16, indexRows, &a);
+    qsort(idx->entries, idx->n, sizeof(IndexEntry), compareEntries);
+  } else if (success &&
+             check( (fresh = (IndexEntry*)malloc(ns*sizeof(IndexEntry) + 1)) != NULL,
+                    "Not enough memory" )) {
+    uint8 buf[k];
+    size_t j = 0;
+    for (int gy = 0; gy < gh; gy++) {
+      for (int gx = 0; gx < gw; gx++) {
+        if (!stale[(size_t)gy*gw + gx]) continue;
+        fresh[j].x = gx*k;
+        fresh[j].y = gy*k;
+        fresh[j].hash = blockHash(img, gx*k, gy*k, k, buf);
+        j++;
+      }
+    }
+    PIXMEM += (unsigned long)ns*k*k;
+    qsort(fresh, ns, sizeof(IndexEntry), compareEntries);
+    // Drop the stale entries, then merge in the fresh ones from the end
+    size_t m = 0;
+    for (size_t i = 0; i < idx->n; i++) {
+      const IndexEntry* e = &idx->entries[i];
+      if (!stale[(size_t)(e->y/k)*gw + e->x/k]) idx->entries[m++] = *e;
+    }
+    size_t out = idx->n;
+    while (j > 0) {
+      if (m > 0 && compareEntries(&idx->entries[m-1], &fresh[j-1]) > 0) {
+        idx->entries[--out] = idx->entries[--m];
+      } else {
+        idx->entries[--out] = fresh[--j];
+      }
+    }
+  } else {
+    success = 0;
+  }
+  if (success) idx->version = img->version;
+  pthread_mutex_unlock(&indexLock);
+  free(fresh);
+  free(stale);
+  return success;
+}
+
+// Position of a candidate match
+typedef struct {
+  int x, y;
+} IndexCandidate;
+
+static int compareCandidates(const void* p1, const void* p2) {
+  const IndexCandidate* a = (const IndexCandidate*)p1;
+  const IndexCandidate* b = (const IndexCandidate*)p2;
+  if (a->x != b->x) return (a->x < b->x) ? -1 : 1;
+  return (a->y > b->y) - (a->y < b->y);
+}
+
+/// Locate a subimage inside the image of an index.
+/// Gives the same result as ImageLocateSubImage(image of idx, px, py, img2)
+/// (the first match, scanning columns left to right).
+/// Templates smaller than 2k-1 in width or height are searched with
+/// ImageLocateSubImage.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+/// On failure (out of memory), returns -1 and errno/errCause are set.
+int ImageIndexLocate(ImageIndex idx, int* px, int* py, Image img2) { ///
+  InstrScope(__func__);
+  assert (idx != NULL);
+  assert (img2 != NULL);
+  if (!ImageIndexUpdate(idx)) return -1;
+  Image img1 = idx->img;
+  int k = idx->k;
+  int w2 = img2->width, h2 = img2->height;
+  if (w2 < 2*k - 1 || h2 < 2*k - 1) return ImageLocateSubImage(img1, px, py, img2);
+  if (w2 > img1->width || h2 > img1->height) return 0;
+
+  // Gather candidate positions from the blocks at every offset
+  size_t ncand = 0, capcand = 64;
+  IndexCandidate* cand = (IndexCandidate*)malloc(capcand*sizeof(IndexCandidate));
+  if (!check(cand != NULL, "Not enough memory")) return -1;
+  uint8 buf[k];
+  for (int dy = 0; dy < k; dy++) {
+    for (int dx = 0; dx < k; dx++) {
+      IndexEntry key = { blockHash(img2, dx, dy, k, buf), INT32_MIN, INT32_MIN };
+      // first entry >= key
+      size_t lo = 0, hi = idx->n;
+      while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (compareEntries(&idx->entries[mid], &key) < 0) lo = mid + 1; else hi = mid;
+      }
+      for (size_t e = lo; e < idx->n && idx->entries[e].hash == key.hash; e++) {
+        int x = idx->entries[e].x - dx, y = idx->entries[e].y - dy;
+        if (x < 0 || y < 0 || x + w2 > img1->width || y + h2 > img1->height) continue;
+        if (ncand == capcand) {
+          IndexCandidate* c = (IndexCandidate*)realloc(cand, 2*capcand*sizeof(IndexCandidate));
+          if (!check(c != NULL, "Not enough memory")) { free(cand); return -1; }
+          cand = c;
+          capcand *= 2;
+        }
+        cand[ncand++] = (IndexCandidate){ x, y };
+      }
+    }
+  }
+  PIXMEM += (unsigned long)k*k*k*k;  // template blocks hashed
+
+  // Check candidates in scan order
+  qsort(cand, ncand, sizeof(IndexCandidate), compareCandidates);
+  int found = 0;
+  for (size_t c = 0; c < ncand && !found; c++) {
+    if (ImageMatchSubImage(img1, cand[c].x, cand[c].y, img2)) {
+      *px = cand[c].x;
+      *py = cand[c].y;
+      found = 1;
+    }
+  }
+  free(cand);
+  return found;
+}
+
+// Index files start with this, then k, width, height and 0 (int32), the
+// content hash of the image (see ImageHash) and the number of entries
+// (uint64), and the entries, in native byte order.
+static const char indexMagic[8] = "IMGIDX2\n";
+
+/// Save an index to a file.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageIndexSave(ImageIndex idx, const char* filename) { ///
+  InstrScope(__func__);
+  assert (idx != NULL);
+  int32_t head[4] = { idx->k, idx->img->width, idx->img->height, 0 };
+  uint64_t hash = ImageHash(idx->img), n = idx->n;
+  FILE* f = NULL;
+  int success =
+  ImageIndexUpdate(idx) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fwrite(indexMagic, sizeof(indexMagic), 1, f) == 1 &&
+         fwrite(head, sizeof(head), 1, f) == 1 &&
+         fwrite(&hash, sizeof(hash), 1, f) == 1 &&
+         fwrite(&n, sizeof(n), 1, f) == 1 &&
+         fwrite(idx->entries, sizeof(IndexEntry), idx->n, f) == idx->n, "Writing index failed" );
+  if (f != NULL && fclose(f) != 0) success = check(0, "Writing index failed");
+  return success;
+}
+
+/// Load an index of img, with k x k blocks, from a file saved by
+/// ImageIndexSave.  Fails if the file was saved from an index with other
+/// blocks, or of an image with other pixels (so it should be built again).
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexLoad(const char* filename, Image img, int k) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  assert (k >= 1);
+  char magic[sizeof(indexMagic)];
+  int32_t head[4];
+  uint64_t hash = 0, n = 0;
+  FILE* f = NULL;
+  ImageIndex idx = NULL;
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  check( fread(magic, sizeof(magic), 1, f) == 1 &&
+         memcmp(magic, indexMagic, sizeof(magic)) == 0, "Invalid index file" ) &&
+  check( fread(head, sizeof(head), 1, f) == 1 && fread(&hash, sizeof(hash), 1, f) == 1 &&
+         fread(&n, sizeof(n), 1, f) == 1 && head[0] >= 1, "Invalid index file" ) &&
+  check( head[0] == k, "Index has other blocks" ) &&
+  check( head[1] == img->width && head[2] == img->height && hash == ImageHash(img) &&
+         n == (uint64_t)(head[1]/head[0])*(head[2]/head[0]), "Index is for another image" ) &&
+  check( (idx = (ImageIndex)calloc(1, sizeof(struct imageindex))) != NULL, "Not enough memory" ) &&
+  check( (idx->entries = (IndexEntry*)malloc(n*sizeof(IndexEntry) + 1)) != NULL, "Not enough memory" ) &&
+  check( fread(idx->entries, sizeof(IndexEntry), n, f) == n, "Reading index failed" );
+  if (success) {
+    idx->img = img;
+    idx->k = head[0];
+    idx->n = n;
+    idx->version = img->version;
+  } else if (idx != NULL) {
+    errsave = errno;
+    free(idx->entries);
+    free(idx);
+    idx = NULL;
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return idx;
+}
+
+
 /// Filtering
 
+// The blur runs a vertical window over column sums: colsum[x] is the sum
+// of column x over the rows of the window, and each output pixel is the
+// sum of 2dx+1 column sums, kept as a horizontal running sum.  So each
+// pixel costs O(1), whatever the window size.
+// Output row y is written back as soon as it is computed.  The original
+// rows still needed later (to be subtracted from colsum, up to dy rows
+// after being overwritten) are kept in a ring of dy+1 rows.
+// Several bands of rows may be blurred in parallel.  Each band then needs
+// the original dy rows above and below it, which neighbour bands
+// overwrite: those halos are copied before the bands start.
+
+typedef struct {
+  Image img;
+  int dx, dy;
+  int nb;          // number of bands
+  uint8* halo;     // for each band, dy rows above it and dy rows below it
+  uint8* scratch;  // for each band, scratchBytes
+  size_t scratchBytes;
+} BlurArgs;
+
+// First row of band b
+static inline int blurBandStart(const BlurArgs* a, int b) {
+  return (int)((long)a->img->height*b/a->nb);
+}
+
+// Scratch bytes needed to blur a band of an image w wide
+static size_t blurScratchBytes(int w, int dy) {
+  return (size_t)(dy + 3)*w + (size_t)w*sizeof(uint32_t);
+}
+
+// Original pixels of row r, for the band [r0, r1) with halos above and
+// below.  Rows of the band must not have been overwritten yet.
+static inline const uint8* blurSource(Image img, int r, int r0, int r1, int dy,
+                                      const uint8* above, const uint8* below, uint8* buf) {
+  int w = img->width;
+  if (r < r0) return above + (size_t)(r - r0 + dy)*w;
+  if (r >= r1) return below + (size_t)(r - r1)*w;
+  return rowPtr(img, 0, r, w, buf, 1);
+}
+
+// Copy row y of img to dst.
+static void blurCopyRow(Image img, int y, uint8* dst) {
+  const uint8* p = rowPtr(img, 0, y, img->width, dst, 1);
+  if (p != dst) memcpy(dst, p, img->width);
+}
+
+// Blur bands [b0, b1).
+static unsigned long blurBands(void* arg, int b0, int b1) {
+  BlurArgs* a = (BlurArgs*)arg;
+  Image img = a->img;
+  int w = img->width, h = img->height;
+  int dx = a->dx, dy = a->dy;
+  unsigned long count = 0;
+  for (int b = b0; b < b1; b++) {
+    int r0 = blurBandStart(a, b), r1 = blurBandStart(a, b + 1);
+    const uint8* above = a->halo + (size_t)b*2*dy*w;  // rows r0-dy .. r0-1
+    const uint8* below = above + (size_t)dy*w;         // rows r1 .. r1+dy-1
+    uint8* ring = a->scratch + (size_t)b*a->scratchBytes;  // original rows
+    uint8* out = ring + (size_t)(dy + 1)*w;
+    uint8* buf = out + w;
+    uint32_t* colsum = (uint32_t*)(buf + w);
+
+    memset(colsum, 0, w*sizeof(uint32_t));
+    int top = (r0 - dy > 0) ? r0 - dy : 0;
+    int bottom = (r0 + dy + 1 < h) ? r0 + dy + 1 : h;
+    for (int r = top; r < bottom; r++) {
+      kernels->colAdd(colsum, blurSource(img, r, r0, r1, dy, above, below, buf), w);
+    }
+    for (int y = r0; y < r1; y++) {
+      // Keep the original row, then compute and store the output row
+      memcpy(ring + (size_t)(y % (dy + 1))*w, rowPtr(img, 0, y, w, buf, 1), w);
+      kernels->boxRow(out, colsum, w, dx, (double)(bottom - top));
+      rowPut(img, 0, y, w, out);
+      // Slide the window down
+      if (bottom < h && y + 1 < r1) {
+        kernels->colAdd(colsum, blurSource(img, bottom, r0, r1, dy, above, below, buf), w);
+        bottom++;
+      }
+      if (y - dy >= top && y + 1 < r1) {
+        const uint8* p = (top >= r0) ? ring + (size_t)(top % (dy + 1))*w
+                                     : blurSource(img, top, r0, r1, dy, above, below, buf);
+        kernels->colSub(colsum, p, w);
+        top++;
+      }
+    }
+    count += 3ul*w*(r1 - r0);  // two reads and one store per pixel
+  }
+  return count;
+}
+
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
+/// [x-dx, x+dx]x[y-dy, y+dy] (that lie inside the image).
+/// The image is changed in-place, with O(width*dy) extra memory, and
+/// O(1) time per pixel, whatever the window size.
+/// If there is not enough memory, the image is left unchanged and
+/// errCause is set.
 void ImageBlur(Image img, int dx, int dy) { ///
+  InstrScope(__func__);
   assert (img != NULL);
-  Image new_image = ImageCreate(ImageWidth(img), ImageHeight(img), ImageMaxval(img)); //we have to create a new temporary image to give the mean values, otherwise it
-  if (new_image == NULL){errCause = "Not enough memory";} //won't be possible to correctly calculate them while we change them.
-  for (int y = 0; y < ImageHeight(img); y++){
-    for (int x = 0; x < ImageWidth(img); x++){
-      int pixel_mean_sum = 0;                //this is where the rectangle would start. it will get negative coords until x = dx & y = dy,  
-      int pixel_element_count = 0;           //so that we give the mean value always to the pixel centered in the middle.
-      for (int i = -dy; i <= dy; i++){        //again, even tho these cords will be negative sometimes, we just need to ignore those invalid coords.
-        for (int j = -dx; j <= dx; j++){      
-          if (!(ImageValidPos(img, j+x, i+y))){continue;} //if the pixel isn't valid, just skip it. those pixels on the border of the image will have the mean
-          //of less element count than those in the center on purpose
-          pixel_mean_sum+=ImageGetPixel(img, j+x, i+y);   //sum all the pixel values inside the filter area
-          pixel_element_count+=1; //sum the number of pixels inside the filter area
-        }
+  assert (dx >= 0 && dy >= 0);
+  int w = img->width, h = img->height;
+  if (w == 0 || h == 0) return;
+  // Larger windows give the same result
+  if (dx > w) dx = w;
+  if (dy > h) dy = h;
+
+  // Bands of at least 64 rows, and not much smaller than their halos
+  int minRows = (4*dy > 64) ? 4*dy : 64;
+  int nb = h / minRows;
+  if (nb > nthreads) nb = nthreads;
+  if (nb < 1) nb = 1;
+  BlurArgs a = { img, dx, dy, nb, NULL, NULL, blurScratchBytes(w, dy) };
+  a.halo = (nb > 1) ? (uint8*)malloc((size_t)nb*2*dy*w + 1) : NULL;
+  if (a.halo == NULL) a.nb = 1;  // (one band needs no halos)
+  a.scratch = (uint8*)malloc((size_t)a.nb*a.scratchBytes + 1);
+  if (!check(a.scratch != NULL, "Not enough memory")) {
+    free(a.halo);
+    return;
+  }
+
+  // Copy the halos of each band (rows outside the image are not used)
+  for (int b = 1; b < a.nb; b++) {
+    int r0 = blurBandStart(&a, b);
+    uint8* below = a.halo + (size_t)(b - 1)*2*dy*w + (size_t)dy*w;  // of band b-1
+    uint8* above = a.halo + (size_t)b*2*dy*w;
+    for (int i = 0; i < dy; i++) {
+      if (r0 - dy + i >= 0) blurCopyRow(img, r0 - dy + i, above + (size_t)i*w);
+      if (r0 + i < h) blurCopyRow(img, r0 + i, below + (size_t)i*w);
+    }
+  }
+
+  PIXMEM += parallelRun(a.nb, 1, blurBands, &a);
+  markAllChanged(img);
+  free(a.halo);
+  free(a.scratch);
+}
+
+/// Bring a blurred copy up to date: blurred must be a copy of img blurred
+/// with ImageBlur(blurred, dx, dy) when img had version since.  Only the
+/// pixels within (dx, dy) of the pixels changed since then are computed
+/// again.
+/// On success, returns the version of img that blurred now reflects (for
+/// the next call).
+/// On failure (out of memory), returns since and errno/errCause are set
+/// (blurred may then be partly updated).
+unsigned long ImageBlurUpdate(Image blurred, Image img, int dx, int dy, unsigned long since) { ///
+  InstrScope(__func__);
+  assert (blurred != NULL && img != NULL);
+  assert (blurred->width == img->width && blurred->height == img->height);
+  assert (dx >= 0 && dy >= 0);
+  int w = img->width, h = img->height;
+  ImageRect r[NCHANGES];
+  int nr = ImageChanges(img, since, r, NCHANGES);
+  for (int c = 0; c < nr; c++) {
+    // Output pixels affected: the change grown by the window
+    int ox0 = (r[c].x - dx > 0) ? r[c].x - dx : 0;
+    int oy0 = (r[c].y - dy > 0) ? r[c].y - dy : 0;
+    int ox1 = (r[c].x + r[c].w + dx < w) ? r[c].x + r[c].w + dx : w;
+    int oy1 = (r[c].y + r[c].h + dy < h) ? r[c].y + r[c].h + dy : h;
+    // Source pixels they need: grown by the window again
+    int sx0 = (ox0 - dx > 0) ? ox0 - dx : 0;
+    int sy0 = (oy0 - dy > 0) ? oy0 - dy : 0;
+    int sx1 = (ox1 + dx < w) ? ox1 + dx : w;
+    int sy1 = (oy1 + dy < h) ? oy1 + dy : h;
+    Image part = ImageCrop(img, sx0, sy0, sx1 - sx0, sy1 - sy0);
+    if (part == NULL) return since;
+    unsigned long v = part->version;
+    ImageBlur(part, dx, dy);
+    if (part->version == v) {  // (ImageBlur failed)
+      ImageDestroy(&part);
+      return since;
+    }
+    for (int y = oy0; y < oy1; y++) {
+      rowCopy(blurred, ox0, y, part, ox0 - sx0, y - sy0, ox1 - ox0);
+    }
+    markChanged(blurred, ox0, oy0, ox1 - ox0, oy1 - oy0);
+    PIXMEM += 2ul*(ox1 - ox0)*(oy1 - oy0);
+    ImageDestroy(&part);
+  }
+  return img->version;
+}
+
+
+
+/// Binary images
+
+// A binary image stores one bit per pixel, in rows of 64-bit words.
+// Bit x of a row is bit (x % 64) of word (x / 64) of that row.
+// Bits past the width in the last word of each row are always 0, so
+// whole words can be counted, combined and compared.
+struct bitimage {
+  int width;
+  int height;
+  int stride;      // words per row
+  uint64_t* bits;  // height*stride words
+};
+
+// Pointer to row y of b
+static inline uint64_t* bitRow(BitImage b, int y) {
+  return b->bits + (size_t)y*b->stride;
+}
+
+// Mask of the bits of the last word of a row that are inside the image
+static inline uint64_t lastWordMask(BitImage b) {
+  int r = b->width & 63;
+  return (r == 0) ? ~(uint64_t)0 : ((uint64_t)1 << r) - 1;
+}
+
+// Get 64 bits of a row of stride words, from bit s onwards.
+// Bits past the end of the row are 0.
+static inline uint64_t bitsAt(const uint64_t* row, int stride, int s) {
+  int k = s >> 6, o = s & 63;
+  uint64_t v = (k < stride) ? row[k] >> o : 0;
+  if (o != 0 && k + 1 < stride) v |= row[k+1] << (64 - o);
+  return v;
+}
+
+/// Create a new binary image with all pixels clear.
+/// Requires: width and height must be non-negative.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  BitImage b = (BitImage)malloc(sizeof(struct bitimage));
+  if (!check(b != NULL, "Not enough memory")) return NULL;
+  b->width = width;
+  b->height = height;
+  b->stride = (width + 63) >> 6;
+  b->bits = (uint64_t*)calloc((size_t)b->stride*height + 1, sizeof(uint64_t));
+  if (!check(b->bits != NULL, "Not enough memory")) {
+    free(b);
+    return NULL;
+  }
+  return b;
+}
+
+/// Destroy the binary image pointed to by (*bp).
+/// If (*bp)==NULL, no operation is performed.
+/// Ensures: (*bp)==NULL.
+void BitImageDestroy(BitImage* bp) { ///
+  assert (bp != NULL);
+  if (*bp == NULL) return;
+  free((*bp)->bits);
+  free(*bp);
+  *bp = NULL;
+}
+
+/// Binary image properties
+int BitImageWidth(BitImage b) { ///
+  assert (b != NULL);
+  return b->width;
+}
+
+int BitImageHeight(BitImage b) { ///
+  assert (b != NULL);
+  return b->height;
+}
+
+/// Get the bit of pixel (x, y).
+int BitImageGet(BitImage b, int x, int y) { ///
+  assert (b != NULL);
+  assert (0 <= x && x < b->width && 0 <= y && y < b->height);
+  return (bitRow(b, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+/// Set (bit != 0) or clear the bit of pixel (x, y).
+void BitImageSet(BitImage b, int x, int y, int bit) { ///
+  assert (b != NULL);
+  assert (0 <= x && x < b->width && 0 <= y && y < b->height);
+  uint64_t m = (uint64_t)1 << (x & 63);
+  if (bit) bitRow(b, y)[x >> 6] |= m; else bitRow(b, y)[x >> 6] &= ~m;
+}
+
+/// Threshold an image into a new binary image.
+/// Pixels with level>=thr are set, all others are clear
+/// (like ImageThreshold, but one bit per pixel).
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage ImageThresholdBits(Image img, uint8 thr) { ///
+  InstrScope(__func__);
+  assert (img != NULL);
+  int w = img->width;
+  BitImage b = BitImageCreate(w, img->height);
+  uint8* buf = malloc(w + 1);
+  if (b == NULL || !check(buf != NULL, "Not enough memory")) {
+    BitImageDestroy(&b);
+    free(buf);
+    return NULL;
+  }
+  for (int y = 0; y < img->height; y++) {
+    kernels->pack(rowPtr(img, 0, y, w, buf, 1), w, thr, bitRow(b, y));
+  }
+  PIXMEM += (unsigned long)w*img->height;  // one read per pixel
+  free(buf);
+  return b;
+}
+
+/// Convert a binary image into a new image, with set pixels at maxval
+/// and clear pixels at 0.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitImageToImage(BitImage b, uint8 maxval) { ///
+  InstrScope(__func__);
+  assert (b != NULL);
+  Image img = imageNew(b->width, b->height, maxval, 0);
+  uint8* buf = malloc(b->width + 1);
+  if (img == NULL || !check(buf != NULL, "Not enough memory")) {
+    ImageDestroy(&img);
+    free(buf);
+    return NULL;
+  }
+  for (int y = 0; y < b->height; y++) {
+    const uint64_t* row = bitRow(b, y);
+    uint8* p = rowPtr(img, 0, y, b->width, buf, 0);
+    for (int x = 0; x < b->width; x++) {
+      p[x] = ((row[x >> 6] >> (x & 63)) & 1) ? maxval : 0;
+    }
+    rowPut(img, 0, y, b->width, p);
+  }
+  PIXMEM += (unsigned long)b->width*b->height;  // one store per pixel
+  free(buf);
+  return img;
+}
+
+/// Count the set pixels of a binary image.
+unsigned long BitImageCount(BitImage b) { ///
+  InstrScope(__func__);
+  assert (b != NULL);
+  unsigned long count = 0;
+  size_t n = (size_t)b->stride*b->height;
+  for (size_t i = 0; i < n; i++) count += (unsigned long)__builtin_popcountll(b->bits[i]);
+  return count;
+}
+
+/// Combine binary image src into dst, at position (x, y):
+/// each pixel of dst in that rectangle becomes (dst op src).
+/// With BIT_COPY, src is simply pasted.
+/// Requires: src must fit inside dst at position (x, y).
+void BitImageCombine(BitImage dst, int x, int y, BitImage src, BitOp op) { ///
+  InstrScope(__func__);
+  assert (dst != NULL);
+  assert (src != NULL);
+  assert (0 <= x && x + src->width <= dst->width);
+  assert (0 <= y && y + src->height <= dst->height);
+  if (src->width == 0) return;
+  int k0 = x >> 6, k1 = (x + src->width - 1) >> 6;  // dst words touched
+  for (int j = 0; j < src->height; j++) {
+    uint64_t* d = bitRow(dst, y + j);
+    const uint64_t* s = bitRow(src, j);
+    for (int k = k0; k <= k1; k++) {
+      int base = 64*k - x;  // src bit that goes to the first bit of word k
+      uint64_t v = (base >= 0) ? bitsAt(s, src->stride, base) : bitsAt(s, src->stride, 0) << -base;
+      // bits of word k inside [x, x+src->width)
+      int lo = (base < 0) ? -base : 0;
+      int hi = src->width - base;
+      uint64_t mask = ~(uint64_t)0 << lo;
+      if (hi < 64) mask &= ((uint64_t)1 << hi) - 1;
+      switch (op) {
+      case BIT_COPY: d[k] = (d[k] & ~mask) | (v & mask); break;
+      case BIT_AND: d[k] &= v | ~mask; break;
+      case BIT_OR: d[k] |= v & mask; break;
+      case BIT_XOR: d[k] ^= v & mask; break;
+      }
+    }
+  }
+}
+
+/// Compare a binary image to a subimage of a larger binary image.
+/// Returns 1 (true) if b2 matches the subimage of b1 at pos (x, y).
+/// Returns 0, otherwise.
+/// Requires: b2 must fit inside b1 at position (x, y).
+int BitImageMatchSubImage(BitImage b1, int x, int y, BitImage b2) { ///
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  assert (0 <= x && x + b2->width <= b1->width);
+  assert (0 <= y && y + b2->height <= b1->height);
+  uint64_t last = lastWordMask(b2);
+  for (int j = 0; j < b2->height; j++) {
+    const uint64_t* r1 = bitRow(b1, y + j);
+    const uint64_t* r2 = bitRow(b2, j);
+    for (int k = 0; k < b2->stride; k++) {
+      uint64_t diff = bitsAt(r1, b1->stride, x + 64*k) ^ r2[k];
+      if (k == b2->stride - 1) diff &= last;
+      if (diff != 0) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Locate a binary subimage inside another binary image.
+/// Searches for b2 inside b1, scanning columns left to right (like
+/// ImageLocateSubImage).
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocateSubImage(BitImage b1, int* px, int* py, BitImage b2) { ///
+  InstrScope(__func__);
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  for (int x = 0; x + b2->width <= b1->width; x++) {
+    for (int y = 0; y + b2->height <= b1->height; y++) {
+      if (BitImageMatchSubImage(b1, x, y, b2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// PBM (P4) files store rows of bytes, most significant bit first, with 1
+// meaning black.  Set pixels are white, so bits are inverted.
+
+// Reverse the order of the bits of byte v
+static inline uint8 reverseBits(uint8 v) {
+  v = (uint8)((v >> 4) | (v << 4));
+  v = (uint8)(((v & 0xCC) >> 2) | ((v & 0x33) << 2));
+  return (uint8)(((v & 0xAA) >> 1) | ((v & 0x55) << 1));
+}
+
+/// Load a raw PBM (P4) file.
+/// Black pixels are clear and white pixels are set.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageLoad(const char* filename) { ///
+  InstrScope(__func__);
+  int w, h;
+  char c;
+  FILE* f = NULL;
+  BitImage b = NULL;
+  uint8* buf = NULL;
+
+  int success =
+  check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  // Parse PBM header
+  check( fscanf(f, "P%c ", &c) == 1 && c == '4' , "Invalid file format" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
+  skipComments(f) >= 0 &&
+  check( fscanf(f, "%d", &h) == 1 && h >= 0 , "Invalid height" ) &&
+  check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
+  // Allocate image and a row buffer
+  (b = BitImageCreate(w, h)) != NULL &&
+  check( (buf = malloc(b->stride*8 + 1)) != NULL, "Not enough memory" );
+  // Read rows
+  int nbytes = (w + 7) / 8;
+  for (int y = 0; success && y < h; y++) {
+    success = check( fread(buf, 1, nbytes, f) == (size_t)nbytes, "Reading pixels" );
+    memset(buf + nbytes, 0, b->stride*8 - nbytes);
+    uint64_t* row = bitRow(b, y);
+    for (int k = 0; k < b->stride; k++) {
+      uint64_t v = 0;
+      for (int i = 0; i < 8; i++) v |= (uint64_t)reverseBits((uint8)~buf[8*k + i]) << (8*i);
+      row[k] = v;
+    }
+    if (b->stride > 0) row[b->stride - 1] &= lastWordMask(b);
+  }
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    BitImageDestroy(&b);
+    errno = errsave;
+  }
+  free(buf);
+  if (f != NULL) fclose(f);
+  return b;
+}
+
+/// Save binary image to PBM (P4) file.
+/// Set pixels are saved white, and clear pixels black.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitImageSave(BitImage b, const char* filename) { ///
+  InstrScope(__func__);
+  assert (b != NULL);
+  FILE* f = NULL;
+  uint8* buf = NULL;
+  int nbytes = (b->width + 7) / 8;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P4\n%d %d\n", b->width, b->height) > 0, "Writing header failed" ) &&
+  check( (buf = malloc(b->stride*8 + 1)) != NULL, "Not enough memory" );
+  for (int y = 0; success && y < b->height; y++) {
+    const uint64_t* row = bitRow(b, y);
+    for (int i = 0; i < nbytes; i++) {
+      buf[i] = (uint8)~reverseBits((uint8)(row[i >> 3] >> (8*(i & 7))));
+    }
+    if (b->width & 7) buf[nbytes - 1] &= (uint8)(0xFF << (8 - (b->width & 7)));  // padding bits 0
+    success = check( fwrite(buf, 1, nbytes, f) == (size_t)nbytes, "Writing pixels failed" );
+  }
+
+  // Cleanup
+  free(buf);
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+
+/// Connected components
+
+// Components are found from runs of set pixels in each row.
+//  1. Count the runs of each row (in parallel bands of rows).
+//  2. Extract the runs, and join each run to the overlapping runs of the
+//     row above, with union-find (in parallel: each band only joins runs
+//     inside it).
+//  3. Join the runs across band boundaries.
+//  4. Number the components and gather their statistics.
+// Union-find always links the larger root to the smaller, so parent[r]
+// <= r and the root of a component is its first run in raster order.
+// The result does not depend on the number of threads.
+
+typedef struct {
+  int x0, x1;  // first and last pixel of the run
+} Run;
+
+typedef struct {
+  BitImage b;
+  int conn;           // 4 or 8
+  size_t* rowStart;   // runs of row y are [rowStart[y], rowStart[y+1])
+  Run* runs;
+  int* parent;
+  uint8* bandStart;   // is row y the first of a band?
+} LabelArgs;
+
+// Number of runs of set bits in row y
+static size_t rowRunCount(BitImage b, int y) {
+  const uint64_t* row = bitRow(b, y);
+  size_t n = 0;
+  uint64_t carry = 0;  // last bit of the previous word
+  for (int k = 0; k < b->stride; k++) {
+    uint64_t v = row[k];
+    n += (size_t)__builtin_popcountll(v & ~((v << 1) | carry));  // run starts
+    carry = v >> 63;
+  }
+  return n;
+}
+
+// Store the runs of row y in runs (which must have room for them).
+static void rowRuns(BitImage b, int y, Run* runs) {
+  const uint64_t* row = bitRow(b, y);
+  int open = -1;  // start of a run not yet closed
+  for (int k = 0; k < b->stride; k++) {
+    uint64_t v = row[k];
+    int pos = 0;
+    while (pos < 64) {
+      if (open < 0) {  // look for a set bit
+        uint64_t m = v >> pos;
+        if (m == 0) break;
+        pos += __builtin_ctzll(m);
+        open = 64*k + pos;
+        if (pos == 63) break;  // (avoid the shift by 64)
+        pos++;
       }
-      double blur_pixel = ((double)(pixel_mean_sum) / pixel_element_count)+0.5; //do the math
-      blur_pixel = (int)blur_pixel;
-      ImageSetPixel(new_image, x, y, blur_pixel); //give the blurred effect to the pixel in the temporary image
+      uint64_t m = ~v >> pos;  // look for a clear bit
+      if (m == 0) break;  // the run goes on in the next word
+      pos += __builtin_ctzll(m);
+      *runs++ = (Run){ open, 64*k + pos - 1 };
+      open = -1;
     }
   }
-  for (int y=0; y<ImageHeight(img); y++){
-    for (int x=0; x<ImageWidth(img); x++){
-      ImageSetPixel(img, x , y, ImageGetPixel(new_image, x, y)); //FINALLY, give the values from the temporary image to img
+  if (open >= 0) *runs = (Run){ open, b->width - 1 };
+}
+
+static int findRoot(int* parent, int r) {
+  while (parent[r] != r) {
+    parent[r] = parent[parent[r]];  // path halving
+    r = parent[r];
+  }
+  return r;
+}
+
+static void unite(int* parent, int a, int b) {
+  a = findRoot(parent, a);
+  b = findRoot(parent, b);
+  if (a < b) parent[b] = a; else if (b < a) parent[a] = b;
+}
+
+// Join the runs of row y to the overlapping runs of row y-1.
+static void joinRows(LabelArgs* a, int y) {
+  size_t i = a->rowStart[y-1], iend = a->rowStart[y];
+  size_t j = a->rowStart[y], jend = a->rowStart[y+1];
+  int d = (a->conn == 8) ? 1 : 0;  // diagonal neighbours touch, with 8-connectivity
+  while (i < iend && j < jend) {
+    Run* p = &a->runs[i];
+    Run* q = &a->runs[j];
+    if (p->x0 <= q->x1 + d && q->x0 <= p->x1 + d) unite(a->parent, (int)i, (int)j);
+    // advance the run that ends first
+    if (p->x1 < q->x1) i++; else j++;
+  }
+}
+
+static unsigned long labelCountRows(void* arg, int y0, int y1) {
+  LabelArgs* a = (LabelArgs*)arg;
+  for (int y = y0; y < y1; y++) a->rowStart[y+1] = rowRunCount(a->b, y);
+  return 0;
+}
+
+static unsigned long labelBand(void* arg, int y0, int y1) {
+  LabelArgs* a = (LabelArgs*)arg;
+  a->bandStart[y0] = 1;
+  for (int y = y0; y < y1; y++) {
+    rowRuns(a->b, y, a->runs + a->rowStart[y]);
+    for (size_t r = a->rowStart[y]; r < a->rowStart[y+1]; r++) a->parent[r] = (int)r;
+    if (y > y0) joinRows(a, y);
+  }
+  return 0;
+}
+
+// Steps 1 to 3: find the runs and join them.  Returns 0 on failure.
+static int labelRuns(LabelArgs* a) {
+  int h = a->b->height;
+  // 1. Count runs, and find where the runs of each row start
+  parallelRun(h, 64, labelCountRows, a);
+  for (int y = 0; y < h; y++) a->rowStart[y+1] += a->rowStart[y];
+  size_t nruns = a->rowStart[h];
+  int success =
+  check( nruns < (size_t)INT32_MAX, "Too many runs" ) &&
+  check( (a->runs = (Run*)malloc(nruns*sizeof(Run) + 1)) != NULL, "Not enough memory" ) &&
+  check( (a->parent = (int*)malloc(nruns*sizeof(int) + 1)) != NULL, "Not enough memory" );
+  if (!success) return 0;
+  // 2. Extract and join runs, in bands
+  parallelRun(h, 64, labelBand, a);
+  // 3. Join across band boundaries
+  for (int y = 1; y < h; y++) {
+    if (a->bandStart[y]) joinRows(a, y);
+  }
+  return 1;
+}
+
+// Step 4: number the components and gather their statistics.
+// Returns the number of components, or -1 on failure.
+static int labelStats(LabelArgs* a, ImageComponent** comps) {
+  size_t nruns = a->rowStart[a->b->height];
+  // Roots get parent[r] = -(id+1), in order.  A non-root's parent is an
+  // earlier run, already resolved to its root's -(id+1).
+  int ncomp = 0;
+  for (size_t r = 0; r < nruns; r++) {
+    int p = a->parent[r];
+    a->parent[r] = (p == (int)r) ? -(++ncomp) : a->parent[p];
+  }
+  *comps = (ImageComponent*)malloc((size_t)ncomp*sizeof(ImageComponent) + 1);
+  if (!check(*comps != NULL, "Not enough memory")) return -1;
+  // Bounding boxes are gathered as (x0, y0, x1, y1) in (x, y, w, h)
+  for (int c = 0; c < ncomp; c++) (*comps)[c] = (ImageComponent){ 0, INT_MAX, INT_MAX, -1, -1 };
+  for (int y = 0; y < a->b->height; y++) {
+    for (size_t r = a->rowStart[y]; r < a->rowStart[y+1]; r++) {
+      ImageComponent* c = &(*comps)[-a->parent[r] - 1];
+      Run* run = &a->runs[r];
+      c->area += (unsigned long)(run->x1 - run->x0 + 1);
+      if (run->x0 < c->x) c->x = run->x0;
+      if (y < c->y) c->y = y;
+      if (run->x1 > c->w) c->w = run->x1;
+      if (y > c->h) c->h = y;
     }
   }
-  ImageDestroy(&new_image); //and delete this temporary image
+  for (int c = 0; c < ncomp; c++) {
+    (*comps)[c].w -= (*comps)[c].x - 1;
+    (*comps)[c].h -= (*comps)[c].y - 1;
+  }
+  return ncomp;
 }
 
+/// Label the connected components of the set pixels of a binary image.
+///   conn : connectivity, 4 (edge neighbours) or 8 (also diagonals).
+/// On success, returns the number of components n, and sets *comps to a
+/// new array of n component statistics, in raster order of their first
+/// pixel.  (The caller is responsible for freeing it!)
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLabel(BitImage b, int conn, ImageComponent** comps) { ///
+  InstrScope(__func__);
+  assert (b != NULL);
+  assert (conn == 4 || conn == 8);
+  assert (comps != NULL);
+  LabelArgs a = { b, conn, NULL, NULL, NULL, NULL };
+  int ncomp = -1;
+  *comps = NULL;
+
+  int success =
+  check( (a.rowStart = (size_t*)calloc((size_t)b->height + 1, sizeof(size_t))) != NULL &&
+         (a.bandStart = (uint8*)calloc((size_t)b->height + 1, 1)) != NULL, "Not enough memory" ) &&
+  labelRuns(&a);
+  if (success) ncomp = labelStats(&a, comps);
+
+  // Cleanup
+  free(a.rowStart);
+  free(a.bandStart);
+  free(a.runs);
+  free(a.parent);
+  return ncomp;
+}
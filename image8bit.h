@@ -13,6 +13,11 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -33,24 +38,138 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Each thread has its own error cause.
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of instrumentation counters.
+/// (Instrumentation is calibrated lazily, when first needed.)
+/// Image operations are timed as instrumentation regions named after
+/// them, when regions are enabled (see InstrEnableRegions).
+/// If the IMAGE_TRACE environment variable is set, a trace of all
+/// operations is written to the file it names (see InstrTraceStart).
+/// Also sets the number of worker threads from the IMAGE_THREADS
+/// environment variable (default: number of online cpus), and selects
+/// the pixel kernels named by IMAGE_KERNELS (default: auto).
 void ImageInit(void) ;
 
+/// Pixel layouts
+
+/// How the pixels of an image are arranged in memory.
+/// This affects performance only: all functions accept any layout.
+typedef enum {
+  LAYOUT_RASTER,  // row after row (the default)
+  LAYOUT_TILED,   // 64x64 tiles, each stored row after row
+  LAYOUT_MORTON,  // 64x64 tiles, each stored in Morton (Z) order
+} PixelLayout;
+
+/// Set the layout of images created or loaded from now on.
+/// Existing images keep their layout.  All functions accept images with
+/// any layout, and PGM files are always stored in raster order.
+/// ImageInit sets it from the IMAGE_LAYOUT environment variable
+/// (raster, tiled or morton).
+void ImageSetLayout(PixelLayout layout) ;
+
+/// Get the layout of images created or loaded from now on.
+PixelLayout ImageDefaultLayout(void) ;
+
+/// Get the pixel layout of img.
+PixelLayout ImageLayout(Image img) ;
+
+/// Parallel execution
+
+/// Set the number of worker threads used by parallel operations.
+/// Values < 1 are treated as 1 (run everything in the calling thread).
+void ImageSetThreads(int n) ;
+
+/// Get the number of worker threads used by parallel operations.
+int ImageThreads(void) ;
+
+/// Function that runs task(arg, i) for every i in [0, n), on any threads
+/// and in any order, and returns nonzero when all are done.  It may instead
+/// return 0 at once, without running any, if it cannot run them now.
+typedef int (*ImageExecutor)(void* ctx, int n, void (*task)(void* arg, int i), void* arg);
+
+/// Run the chunks of parallel operations with exec(ctx, ...), for instance
+/// on a thread pool of the application, instead of on threads started for
+/// each operation.  NULL restores the default.  The chunks are as many as
+/// the worker threads (see ImageSetThreads).
+void ImageSetExecutor(ImageExecutor exec, void* ctx) ;
+
+/// Pixel memory
+
+/// Pixel arrays of large images (4 MiB or more) may be backed by huge
+/// pages, so that traversing them by columns, tiles or at random misses
+/// the TLB much less often.  Their pages are first touched by the worker
+/// threads (see ImageSetThreads), band by band.
+/// That is done for images made by operations or read from files, which
+/// are written in full at once.  Images made by ImageCreate get memory
+/// page by page as they are written, unless materialized (see
+/// ImageMaterialize).
+typedef enum {
+  HUGEPAGES_OFF,          // ordinary allocation
+  HUGEPAGES_TRANSPARENT,  // transparent huge pages, if enabled (the default)
+  HUGEPAGES_EXPLICIT,     // reserved huge pages (vm.nr_hugepages), if any,
+                          // else transparent ones
+} HugePages;
+
+/// Set how the pixel arrays of large images created from now on are
+/// allocated.
+/// ImageInit sets it from the IMAGE_HUGEPAGES environment variable
+/// (off, thp or explicit).
+void ImageSetHugePages(HugePages mode) ;
+
+/// Get how the pixel arrays of large images are allocated.
+HugePages ImageHugePages(void) ;
+
+/// Pixel kernels
+
+/// The inner loops of point operations, blend, stats, blur and subimage
+/// matching have versions for several instruction sets, all giving the
+/// same results.  The one to use is chosen at run time.
+
+/// Select the pixel kernels named name (scalar, sse2, avx2 or avx512),
+/// or the best ones the cpu supports, if name is "auto".
+/// Returns 0 (and keeps the current kernels) if name is unknown or not
+/// supported by this cpu.
+int ImageSetKernels(const char* name) ;
+
+/// Get the name of the pixel kernels in use.
+const char* ImageKernels(void) ;
+
+/// Check every set of pixel kernels supported by the cpu against the
+/// scalar reference kernels, on trials random inputs each.
+/// Returns 1 if all agree.  Otherwise, returns 0 and ImageErrMsg()
+/// describes the first difference.
+int ImageKernelSelfTest(int trials) ;
+
 /// Image management functions
 
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
 /// Requires: width and height must be non-negative, maxval > 0.
+/// The pixels get memory only where they are written (so a large canvas
+/// with a few images pasted in costs little more than those images), and
+/// areas never written are known to be black without reading them.
+/// See also ImageMaterialize.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Give all pixels of img memory now, as for the results of operations
+/// (huge pages, if enabled, first touched by the worker threads), instead
+/// of page by page as they are written.  Worth it before writing a large
+/// image in full, or traversing it column by column.
+/// The pixels are not changed.  A mapped image (ImageMap,
+/// ImageAttachShared) gets its own copy of the pixels.
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0, errno/errCause are set, and img
+/// is unchanged.
+int ImageMaterialize(Image img) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -67,12 +186,77 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Map a raw PGM file into memory.
+/// Like ImageLoad, but the pixels are not read: they stay in the file and
+/// are paged in by the operating system only when accessed, and may be
+/// dropped again under memory pressure.
+/// Changes to the returned image are private: the file is never modified.
+/// The returned image always has LAYOUT_RASTER.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageMap(const char* filename) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Read the next raw PGM image from a stream of concatenated images
+/// (such as a pipe or FIFO).
+/// If (*imgp) is an image of the same size and layout, its pixel memory
+/// is reused; otherwise it is destroyed and a new image is created.
+/// On success, returns 1 and the image read is in (*imgp).
+/// At the end of the stream (no more images), returns 0.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+/// In both cases, (*imgp) is destroyed.
+int ImageRead(FILE* f, Image* imgp) ;
+
+/// Write image to a stream, as a raw PGM image.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) ;
+
+/// Shared images
+
+/// Images can be handed to other processes through named POSIX shared
+/// memory segments (in /dev/shm, on Linux), with no files and no copy on
+/// the receiving side.  A segment holds a small header (size, maxval,
+/// layout and generation) and the pixel array, in the layout of the
+/// exported image.  Exporting to the same name again replaces the segment
+/// with one of the next generation; processes that attached the old one
+/// keep it until they destroy their image.
+/// Names are like file names, without '/' (up to 249 characters).
+
+/// Export a copy of img as the shared image name.
+/// On success, returns the generation of the new segment (1 for the first
+/// export to name, and one more each time after).
+/// On failure, returns 0 and errno/errCause are set accordingly.
+unsigned long ImageExportShared(Image img, const char* name) ;
+
+/// Attach the shared image name.
+/// The pixels are not copied: they are mapped from the segment, and paged
+/// in only when accessed.  Changes to the returned image are private (as
+/// with ImageMap): the segment is never modified.
+/// If generation is not NULL, *generation is set to that of the segment.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAttachShared(const char* name, unsigned long* generation) ;
+
+/// Get the generation of the shared image name, without attaching it
+/// (to check for a newer export).
+/// On failure (no such image, or not ready), returns 0 and errno/errCause
+/// are set accordingly.
+unsigned long ImageSharedGeneration(const char* name) ;
+
+/// Remove the shared image name.
+/// Images attached to it stay valid until destroyed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageRemoveShared(const char* name) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -91,8 +275,17 @@ int ImageMaxval(Image img) ;
 /// On return,
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
+/// The extremes of each tile of the image are cached, so after a change
+/// only the tiles it touched are scanned again (see ImageChanges), and
+/// tiles never written are not scanned at all (see ImageCreate).
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Content hash
+/// Get a 64-bit hash of the size, maxval and pixels of img, the same in
+/// any layout.  Images with the same hash are almost surely equal.
+/// The hash is kept until the image changes.
+uint64_t ImageHash(Image img) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -110,8 +303,53 @@ int ImageValidRect(Image img, int x, int y, int w, int h) ;
 uint8 ImageGetPixel(Image img, int x, int y) ;
 
 /// Set the pixel at position (x,y) to new level.
+/// Like every function that changes pixels, it records the change (see
+/// Change tracking), so calls on the same image must not run at the same
+/// time, even for different pixels: serialize all writes to one image.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Raw pixel access
+
+/// The pixel array of img, in the order given by ImageLayout(img), and
+/// its size in bytes (which includes any padding of tiled layouts).
+/// Point operations, which treat every pixel alike, may work on the array
+/// as a whole (see image8bit.hpp); anything else should use the
+/// functions above.  The pointer is valid until img is destroyed.
+uint8* ImagePixels(Image img) ;
+size_t ImagePixelBytes(Image img) ;
+
+/// Change tracking
+
+/// Each image has a version, incremented whenever its pixels change, and
+/// remembers the rectangles changed recently (a few, merged as needed).
+/// Results derived from an image (stats, search indexes, blurred copies)
+/// keep the version they reflect, and are brought up to date by computing
+/// again only what the changed rectangles affect.  Every function that
+/// changes pixels records it, except writes through ImagePixels: call
+/// ImageMarkChanged after those.
+/// Recording updates the version and the changed rectangles without
+/// locking, so writes to one image, by any function, must be serialized
+/// by the caller; different images may be written concurrently.
+
+/// A rectangle of pixels
+typedef struct {
+  int x, y, w, h;
+} ImageRect;
+
+/// Get the version of img (0 when created).
+unsigned long ImageVersion(Image img) ;
+
+/// Get rectangles covering every pixel of img changed after it had
+/// version since (and maybe other pixels too), into rects[0..max-1], with
+/// the last ones merged if there are more.
+/// Requires: max >= 1, since <= ImageVersion(img).
+/// Returns the number of rectangles (0 if nothing changed).
+int ImageChanges(Image img, unsigned long since, ImageRect* rects, int max) ;
+
+/// Record that the pixels of img in rectangle (x,y,w,h) were changed.
+/// Requires: the rectangle must be inside img.
+void ImageMarkChanged(Image img, int x, int y, int w, int h) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
@@ -164,6 +402,25 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// In-place geometric transformations
+
+/// These functions transform img itself: no allocation involved.
+/// They never fail.  Use them instead of the copying versions when the
+/// original image is no longer needed.
+
+/// Mirror an image in-place = flip left-right.
+void ImageMirrorInPlace(Image img) ;
+
+/// Flip an image in-place = flip top-bottom.
+void ImageFlipInPlace(Image img) ;
+
+/// Rotate an image in-place by 180 degrees.
+void ImageRotate180InPlace(Image img) ;
+
+/// Rotate a square image in-place by 90 degrees anti-clockwise.
+/// Requires: img must be square (width == height).
+void ImageRotateInPlace(Image img) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -178,6 +435,49 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Resampling methods for ImageResize.
+typedef enum {
+  RESIZE_NEAREST,   // nearest neighbour (fastest, blocky)
+  RESIZE_BILINEAR,  // linear interpolation between the 2x2 nearest pixels
+  RESIZE_AREA,      // mean of the covered source area (best for shrinking)
+} ResizeMethod;
+
+/// Resize an image.
+/// Returns a version of img scaled to width w and height h, resampled
+/// with the given method.
+/// Requires: w > 0, h > 0, and img must not be empty.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ResizeMethod method) ;
+
+/// Apply an affine transformation to an image.
+/// Pixel (x, y) of img is moved to position
+///   (m[0]*x + m[1]*y + m[2], m[3]*x + m[4]*y + m[5])
+/// of a new image with width w and height h.
+/// Pixels of the new image that do not come from inside img are black (0).
+/// method selects the sampling: RESIZE_NEAREST or RESIZE_BILINEAR.
+/// Requires: w >= 0, h >= 0, and matrix m must be invertible.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageWarpAffine(Image img, int w, int h, const double m[6], ResizeMethod method) ;
+
+/// Rotate an image by an arbitrary angle.
+/// Returns a version of the image rotated by degrees anti-clockwise around
+/// its center, with the same size.  Corners that come from outside img are
+/// black.  method is as in ImageWarpAffine.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, ResizeMethod method) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -186,6 +486,22 @@ Image ImageCrop(Image img, int x, int y, int w, int h) ;
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
+/// A placement of image img at position (x, y), for ImagePasteMany.
+typedef struct {
+  Image img;
+  int x, y;
+} ImagePlacement;
+
+/// Paste many images into a larger image.
+/// Paste each placements[k].img into position (placements[k].x,
+/// placements[k].y) of img1, for k = 0, 1, ..., n-1.
+/// The result is the same as calling ImagePaste for each placement in
+/// order: where placements overlap, later ones prevail.
+/// The work is split in bands of rows of img1 and run on several threads.
+/// This modifies img1 in-place: no allocation involved.
+/// Requires: every placed image must fit inside img1 at its position.
+void ImagePasteMany(Image img1, const ImagePlacement* placements, int n) ;
+
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
@@ -205,6 +521,52 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Search index
+
+/// A search index speeds up repeated searches in the same (large) image.
+/// It hashes the k x k blocks of the image on a grid of step k, so
+/// templates at least 2k-1 pixels wide and high are found by lookup
+/// instead of a scan.  The index refers to its image, which must not
+/// be destroyed while the index is used.  When the image changes, only
+/// the blocks that overlap the changes are hashed again.
+typedef struct imageindex *ImageIndex;
+
+/// Build a search index over img, with k x k blocks.
+/// Requires: k >= 1.
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexCreate(Image img, int k) ;
+
+/// Destroy the index pointed to by (*idxp) (but not its image).
+/// If (*idxp)==NULL, no operation is performed.
+/// Ensures: (*idxp)==NULL.
+void ImageIndexDestroy(ImageIndex* idxp) ;
+
+/// Bring an index up to date with the changes of its image, if any.
+/// (ImageIndexLocate and ImageIndexSave do it first.)
+/// On success, returns nonzero.
+/// On failure (out of memory), returns 0 and errno/errCause are set.
+int ImageIndexUpdate(ImageIndex idx) ;
+
+/// Locate a subimage inside the image of an index.
+/// Same result as ImageLocateSubImage on the indexed image.
+/// On failure (out of memory), returns -1 and errno/errCause are set.
+int ImageIndexLocate(ImageIndex idx, int* px, int* py, Image img2) ;
+
+/// Save an index to a file.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageIndexSave(ImageIndex idx, const char* filename) ;
+
+/// Load an index of img, with k x k blocks, from a file saved by
+/// ImageIndexSave.  Fails if the file was saved from an index with other
+/// blocks, or of an image with other pixels (so it should be built again).
+/// On success, a new index is returned.
+/// (The caller is responsible for destroying it!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIndex ImageIndexLoad(const char* filename, Image img, int k) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
@@ -213,4 +575,112 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 /// The image is changed in-place.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Bring a blurred copy up to date: blurred must be a copy of img blurred
+/// with ImageBlur(blurred, dx, dy) when img had version since.  Only the
+/// pixels within (dx, dy) of the pixels changed since then are computed
+/// again.
+/// On success, returns the version of img that blurred now reflects (for
+/// the next call).
+/// On failure (out of memory), returns since and errno/errCause are set
+/// (blurred may then be partly updated).
+unsigned long ImageBlurUpdate(Image blurred, Image img, int dx, int dy, unsigned long since) ;
+
+/// Binary images
+
+/// A binary image has one bit per pixel (set or clear), packed into
+/// 64-bit words, so it takes 8 times less memory than an Image.
+/// Counting, combining and matching work on whole words.
+typedef struct bitimage *BitImage;
+
+/// Operations of BitImageCombine
+typedef enum { BIT_COPY, BIT_AND, BIT_OR, BIT_XOR } BitOp;
+
+/// Create a new binary image with all pixels clear.
+/// Requires: width and height must be non-negative.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageCreate(int width, int height) ;
+
+/// Destroy the binary image pointed to by (*bp).
+/// If (*bp)==NULL, no operation is performed.
+/// Ensures: (*bp)==NULL.
+void BitImageDestroy(BitImage* bp) ;
+
+/// Binary image properties
+int BitImageWidth(BitImage b) ;
+int BitImageHeight(BitImage b) ;
+
+/// Get the bit of pixel (x, y).
+int BitImageGet(BitImage b, int x, int y) ;
+
+/// Set (bit != 0) or clear the bit of pixel (x, y).
+void BitImageSet(BitImage b, int x, int y, int bit) ;
+
+/// Threshold an image into a new binary image.
+/// Pixels with level>=thr are set, all others are clear
+/// (like ImageThreshold, but one bit per pixel).
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage ImageThresholdBits(Image img, uint8 thr) ;
+
+/// Convert a binary image into a new image, with set pixels at maxval
+/// and clear pixels at 0.
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image BitImageToImage(BitImage b, uint8 maxval) ;
+
+/// Count the set pixels of a binary image.
+unsigned long BitImageCount(BitImage b) ;
+
+/// Combine binary image src into dst, at position (x, y):
+/// each pixel of dst in that rectangle becomes (dst op src).
+/// With BIT_COPY, src is simply pasted.
+/// Requires: src must fit inside dst at position (x, y).
+void BitImageCombine(BitImage dst, int x, int y, BitImage src, BitOp op) ;
+
+/// Compare a binary image to a subimage of a larger binary image.
+/// Returns 1 (true) if b2 matches the subimage of b1 at pos (x, y).
+/// Returns 0, otherwise.
+/// Requires: b2 must fit inside b1 at position (x, y).
+int BitImageMatchSubImage(BitImage b1, int x, int y, BitImage b2) ;
+
+/// Locate a binary subimage inside another binary image.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitImageLocateSubImage(BitImage b1, int* px, int* py, BitImage b2) ;
+
+/// Load a raw PBM (P4) file.
+/// Black pixels are clear and white pixels are set.
+/// On success, a new binary image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+BitImage BitImageLoad(const char* filename) ;
+
+/// Save binary image to PBM (P4) file.
+/// Set pixels are saved white, and clear pixels black.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitImageSave(BitImage b, const char* filename) ;
+
+/// Connected components
+
+/// Statistics of a connected component
+typedef struct {
+  unsigned long area;  // number of pixels
+  int x, y, w, h;      // bounding box
+} ImageComponent;
+
+/// Label the connected components of the set pixels of a binary image.
+///   conn : connectivity, 4 (edge neighbours) or 8 (also diagonals).
+/// Large images are labeled in parallel bands, which are then merged.
+/// On success, returns the number of components n, and sets *comps to a
+/// new array of n component statistics, in raster order of their first
+/// pixel.  (The caller is responsible for freeing it!)
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLabel(BitImage b, int conn, ImageComponent** comps) ;
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
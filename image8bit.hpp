@@ -0,0 +1,336 @@
+/// image8bit.hpp - C++ interface to the image8bit module.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// You may freely use and modify this code, at your own risk,
+/// as long as you give proper credit to the original and subsequent authors.
+///
+/// Header only (C++17).  img8::Image owns a C Image: it is move-only and
+/// destroys its image when it goes out of scope.  img8::View refers to a
+/// rectangle of an image.  Failures throw img8::Error.
+///
+/// Point operations may be written as expressions of images and numbers:
+///
+///   img = (img.maxval() - img) * 1.3;
+///
+/// Expressions are not evaluated when built: assigning one to an image
+/// runs a single loop over the pixel array, with no temporary images.
+/// Each pixel is computed in double precision, then rounded and clamped to
+/// [0, maxval] like ImageBrighten does, so the example gives the same
+/// result as ImageNegative followed by ImageBrighten(img, 1.3).
+/// (Rounding happens only once, on assignment, so an expression may differ
+/// from a sequence of C calls that round intermediate results.)
+/// All images in an expression must have the same size and layout as the
+/// image assigned to.
+
+#ifndef IMAGE8BIT_HPP
+#define IMAGE8BIT_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "image8bit.h"
+
+namespace img8 {
+
+/// Failure of an image8bit function: the message includes ImageErrMsg()
+/// and errno, if set.
+class Error : public std::runtime_error {
+ public:
+  explicit Error(const std::string& what)
+      : std::runtime_error(what + ": " + ImageErrMsg() +
+                           (errno != 0 ? std::string(": ") + std::strerror(errno) : "")) {}
+};
+
+template <class E> struct Expr;
+class View;
+
+/// An image, owned.
+class Image {
+ public:
+  /// An empty image (no C image).
+  Image() noexcept = default;
+
+  /// A new black image (ImageCreate).
+  Image(int width, int height, uint8 maxval = PixMax)
+      : img_(ImageCreate(width, height, maxval)) {
+    if (img_ == nullptr) throw Error("ImageCreate");
+  }
+
+  /// Take ownership of a C image (which may be NULL).
+  explicit Image(::Image img) noexcept : img_(img) {}
+
+  Image(const Image&) = delete;
+  Image& operator=(const Image&) = delete;
+  Image(Image&& other) noexcept : img_(other.release()) {}
+  Image& operator=(Image&& other) noexcept {
+    if (this != &other) {
+      ImageDestroy(&img_);
+      img_ = other.release();
+    }
+    return *this;
+  }
+  ~Image() { ImageDestroy(&img_); }
+
+  /// Evaluate expression e into this image, pixel by pixel.
+  template <class E>
+  Image& operator=(const Expr<E>& e);
+
+  /// Load a PGM file (ImageLoad).
+  static Image load(const std::string& filename) {
+    return checked(ImageLoad(filename.c_str()), "ImageLoad");
+  }
+
+  /// Save to a PGM file (ImageSave).
+  void save(const std::string& filename) const {
+    if (!ImageSave(img_, filename.c_str())) throw Error("ImageSave");
+  }
+
+  /// The C image (still owned by this object).
+  ::Image get() const noexcept { return img_; }
+
+  /// Give up ownership of the C image, which is returned.
+  ::Image release() noexcept { return std::exchange(img_, nullptr); }
+
+  explicit operator bool() const noexcept { return img_ != nullptr; }
+
+  int width() const { return ImageWidth(img_); }
+  int height() const { return ImageHeight(img_); }
+  int maxval() const { return ImageMaxval(img_); }
+  PixelLayout layout() const { return ImageLayout(img_); }
+
+  uint8 operator()(int x, int y) const { return ImageGetPixel(img_, x, y); }
+  /// Set one pixel (ImageSetPixel).  Not safe to call from several threads
+  /// on one image, even for different pixels.
+  void set(int x, int y, uint8 level) { ImageSetPixel(img_, x, y, level); }
+
+  /// Minimum and maximum gray levels.
+  std::pair<uint8, uint8> stats() const {
+    uint8 min, max;
+    ImageStats(img_, &min, &max);
+    return { min, max };
+  }
+
+  /// A view of the rectangle (x, y, w, h), which must be inside the image.
+  View view(int x, int y, int w, int h);
+  /// A view of the whole image.
+  View view();
+
+  // Operations in place
+
+  void negative() { ImageNegative(img_); }
+  void threshold(uint8 thr) { ImageThreshold(img_, thr); }
+  void brighten(double factor) { ImageBrighten(img_, factor); }
+  void blur(int dx, int dy) { ImageBlur(img_, dx, dy); }
+
+  // Operations that create a new image
+
+  Image copy() const;
+  Image rotate() const { return checked(ImageRotate(img_), "ImageRotate"); }
+  Image mirror() const { return checked(ImageMirror(img_), "ImageMirror"); }
+  Image crop(int x, int y, int w, int h) const {
+    if (!ImageValidRect(img_, x, y, w, h)) throw std::out_of_range("crop rectangle");
+    return checked(ImageCrop(img_, x, y, w, h), "ImageCrop");
+  }
+  Image resize(int w, int h, ResizeMethod method = RESIZE_BILINEAR) const {
+    return checked(ImageResize(img_, w, h, method), "ImageResize");
+  }
+  Image rotateBy(double degrees, ResizeMethod method = RESIZE_BILINEAR) const {
+    return checked(ImageRotateAngle(img_, degrees, method), "ImageRotateAngle");
+  }
+
+  /// Position of the first match of sub in this image, if any.
+  std::optional<std::pair<int, int>> locate(const Image& sub) const {
+    int x, y;
+    if (!ImageLocateSubImage(img_, &x, &y, sub.get())) return std::nullopt;
+    return std::make_pair(x, y);
+  }
+
+ private:
+  static Image checked(::Image img, const char* what) {
+    if (img == nullptr) throw Error(what);
+    return Image(img);
+  }
+
+  ::Image img_ = nullptr;
+};
+
+/// A rectangle of an image (not owned: the image must outlive the view).
+class View {
+ public:
+  View(::Image img, int x, int y, int w, int h) : img_(img), x_(x), y_(y), w_(w), h_(h) {
+    if (!ImageValidRect(img, x, y, w, h)) throw std::out_of_range("view rectangle");
+  }
+
+  int x() const noexcept { return x_; }
+  int y() const noexcept { return y_; }
+  int width() const noexcept { return w_; }
+  int height() const noexcept { return h_; }
+
+  uint8 operator()(int x, int y) const { return ImageGetPixel(img_, x_ + x, y_ + y); }
+  /// Set one pixel (ImageSetPixel).  Writes to views of one image must be
+  /// serialized, even when the views do not overlap.
+  void set(int x, int y, uint8 level) { ImageSetPixel(img_, x_ + x, y_ + y, level); }
+
+  /// A new image with the pixels of the view (ImageCrop).
+  Image copy() const {
+    ::Image img = ImageCrop(img_, x_, y_, w_, h_);
+    if (img == nullptr) throw Error("ImageCrop");
+    return Image(img);
+  }
+
+  /// Paste src (of the same size) into the view.
+  View& operator=(const Image& src) {
+    fits(src);
+    ImagePaste(img_, x_, y_, src.get());
+    return *this;
+  }
+
+  /// Blend src (of the same size) into the view (ImageBlend).
+  void blend(const Image& src, double alpha) {
+    fits(src);
+    ImageBlend(img_, x_, y_, src.get(), alpha);
+  }
+
+  /// Does the view have the same pixels as img?
+  bool operator==(const Image& img) const {
+    return img.width() == w_ && img.height() == h_ && ImageMatchSubImage(img_, x_, y_, img.get());
+  }
+
+ private:
+  void fits(const Image& src) const {
+    if (src.width() != w_ || src.height() != h_) throw std::invalid_argument("image size differs from view");
+  }
+
+  ::Image img_;
+  int x_, y_, w_, h_;
+};
+
+inline View Image::view(int x, int y, int w, int h) { return View(img_, x, y, w, h); }
+inline View Image::view() { return View(img_, 0, 0, width(), height()); }
+
+inline Image Image::copy() const {
+  return crop(0, 0, width(), height());
+}
+
+// Expression templates
+//
+// An expression is a tree of nodes; at(i) computes its value at pixel
+// array index i, and fits(img) checks that every image in it has the
+// size and layout of img.  Nodes hold operands by value (images by
+// pointer to their pixels), so expressions may be built from temporaries
+// but must be evaluated before their images are changed or destroyed.
+
+/// Base of expression nodes (CRTP).
+template <class E>
+struct Expr {
+  const E& self() const noexcept { return static_cast<const E&>(*this); }
+};
+
+/// The pixels of an image
+struct Pixels : Expr<Pixels> {
+  ::Image img;
+  const uint8* p;
+  explicit Pixels(const Image& image) : img(image.get()), p(ImagePixels(image.get())) {}
+  double at(size_t i) const noexcept { return p[i]; }
+  bool fits(::Image dst) const {
+    return ImageWidth(img) == ImageWidth(dst) && ImageHeight(img) == ImageHeight(dst) &&
+           ImageLayout(img) == ImageLayout(dst);
+  }
+};
+
+/// A number
+struct Constant : Expr<Constant> {
+  double v;
+  explicit Constant(double value) noexcept : v(value) {}
+  double at(size_t) const noexcept { return v; }
+  bool fits(::Image) const noexcept { return true; }
+};
+
+template <class Op, class L, class R>
+struct Binary : Expr<Binary<Op, L, R>> {
+  L l;
+  R r;
+  Binary(const L& left, const R& right) : l(left), r(right) {}
+  double at(size_t i) const noexcept { return Op::apply(l.at(i), r.at(i)); }
+  bool fits(::Image dst) const { return l.fits(dst) && r.fits(dst); }
+};
+
+template <class E>
+struct Negate : Expr<Negate<E>> {
+  E e;
+  explicit Negate(const E& operand) : e(operand) {}
+  double at(size_t i) const noexcept { return -e.at(i); }
+  bool fits(::Image dst) const { return e.fits(dst); }
+};
+
+struct Add { static double apply(double a, double b) noexcept { return a + b; } };
+struct Sub { static double apply(double a, double b) noexcept { return a - b; } };
+struct Mul { static double apply(double a, double b) noexcept { return a * b; } };
+struct Div { static double apply(double a, double b) noexcept { return a / b; } };
+
+// Operands of expressions: images, numbers and expressions
+template <class T> struct Operand { using type = void; };
+template <> struct Operand<Image> { using type = Pixels; };
+template <class T>
+using OperandOf = typename std::conditional_t<
+    std::is_arithmetic_v<T>, std::common_type<Constant>,
+    std::conditional_t<std::is_base_of_v<Expr<T>, T>, std::common_type<T>, Operand<T>>>::type;
+
+inline Pixels operand(const Image& img) { return Pixels(img); }
+inline Constant operand(double v) noexcept { return Constant(v); }
+template <class E> const E& operand(const Expr<E>& e) noexcept { return e.self(); }
+
+// An expression can be built from two operands when neither is void and
+// at least one is not a number.
+template <class A, class B>
+constexpr bool exprOperands =
+    !std::is_void_v<OperandOf<std::decay_t<A>>> && !std::is_void_v<OperandOf<std::decay_t<B>>> &&
+    !(std::is_arithmetic_v<std::decay_t<A>> && std::is_arithmetic_v<std::decay_t<B>>);
+
+template <class Op, class A, class B>
+using BinaryOf = Binary<Op, OperandOf<std::decay_t<A>>, OperandOf<std::decay_t<B>>>;
+
+template <class A, class B, class = std::enable_if_t<exprOperands<A, B>>>
+BinaryOf<Add, A, B> operator+(const A& a, const B& b) { return { operand(a), operand(b) }; }
+
+template <class A, class B, class = std::enable_if_t<exprOperands<A, B>>>
+BinaryOf<Sub, A, B> operator-(const A& a, const B& b) { return { operand(a), operand(b) }; }
+
+template <class A, class B, class = std::enable_if_t<exprOperands<A, B>>>
+BinaryOf<Mul, A, B> operator*(const A& a, const B& b) { return { operand(a), operand(b) }; }
+
+template <class A, class B, class = std::enable_if_t<exprOperands<A, B>>>
+BinaryOf<Div, A, B> operator/(const A& a, const B& b) { return { operand(a), operand(b) }; }
+
+inline Negate<Pixels> operator-(const Image& img) { return Negate<Pixels>(Pixels(img)); }
+template <class E>
+Negate<E> operator-(const Expr<E>& e) { return Negate<E>(e.self()); }
+
+template <class E>
+Image& Image::operator=(const Expr<E>& expr) {
+  const E& e = expr.self();
+  if (!e.fits(img_)) throw std::invalid_argument("images in expression differ in size or layout");
+  uint8* p = ImagePixels(img_);
+  size_t n = ImagePixelBytes(img_);
+  const double top = ImageMaxval(img_);
+  // Round like ImageBrighten, then clamp to [0, maxval]
+  for (size_t i = 0; i < n; i++) {
+    double v = e.at(i) + 0.5;
+    v = (v < top) ? v : top;
+    v = (v > 0.0) ? v : 0.0;
+    p[i] = (uint8)v;
+  }
+  ImageMarkChanged(img_, 0, 0, width(), height());
+  return *this;
+}
+
+}  // namespace img8
+
+#endif
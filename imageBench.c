@@ -0,0 +1,171 @@
+// imageBench - Measure the effect of huge pages on large images.
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// A large image is created with each way of allocating pixel memory
+// (see ImageSetHugePages), and operations that do not traverse it row by
+// row are timed: these miss the TLB on almost every access with ordinary
+// 4 KiB pages, but rarely with 2 MiB pages.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "error.h"
+#include <assert.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [-size N] [-reps R]\n"
+    "Time operations on an NxN image (default 8192) with ordinary pages,\n"
+    "transparent huge pages and reserved huge pages, R times each (default 3),\n"
+    "and report the best times and the speedup over ordinary pages.\n";
+
+// Wall-clock time in seconds
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Anonymous memory of this process backed by huge pages, in kB
+// (or -1 if unknown).
+static long hugeKB(void) {
+  FILE* f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == NULL) return -1;
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) break;
+  }
+  fclose(f);
+  return kb;
+}
+
+// Timed operations
+
+static void runRotate(Image img) {
+  Image r = ImageRotate(img);
+  if (r == NULL) error(2, errno, "Rotating: %s", ImageErrMsg());
+  ImageDestroy(&r);
+}
+
+static void runWarp(Image img) {
+  Image r = ImageRotateAngle(img, 30.0, RESIZE_NEAREST);
+  if (r == NULL) error(2, errno, "Rotating: %s", ImageErrMsg());
+  ImageDestroy(&r);
+}
+
+// Sum of pixels at pseudo-random positions (a fixed sequence)
+static volatile unsigned long sink;
+static void runRandom(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  unsigned long sum = 0;
+  uint64_t s = 88172645463325252ull;
+  for (int i = 0; i < (1 << 22); i++) {
+    s ^= s << 13; s ^= s >> 7; s ^= s << 17;  // xorshift
+    sum += ImageGetPixel(img, (int)(s % w), (int)((s >> 32) % h));
+  }
+  sink = sum;
+}
+
+typedef struct {
+  const char* name;
+  void (*run)(Image img);
+} Op;
+
+static const Op ops[] = {
+  { "rotate", runRotate },
+  { "rotateby", runWarp },
+  { "random", runRandom },
+};
+
+#define NOPS (int)(sizeof(ops)/sizeof(ops[0]))
+
+static const struct {
+  const char* name;
+  HugePages mode;
+} modes[] = {
+  { "off", HUGEPAGES_OFF },
+  { "thp", HUGEPAGES_TRANSPARENT },
+  { "explicit", HUGEPAGES_EXPLICIT },
+};
+
+#define NMODES (int)(sizeof(modes)/sizeof(modes[0]))
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+
+  int n = 8192;
+  int reps = 3;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-size") == 0 && i + 1 < argc) {
+      n = atoi(argv[++i]);
+      if (n < 64) error(1, 0, "Size must be at least 64");
+    } else if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+      if (reps < 1) error(1, 0, "Repetitions must be at least 1");
+    } else {
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+
+  printf("# %dx%d image, %d thread(s), best of %d\n", n, n, ImageThreads(), reps);
+  printf("#%-9s %12s %12s", "pages", "huge kB", "create");
+  for (int k = 0; k < NOPS; k++) printf(" %12s", ops[k].name);
+  printf("\n");
+
+  double base[NOPS + 1];
+  for (int m = 0; m < NMODES; m++) {
+    ImageSetHugePages(modes[m].mode);
+    double best[NOPS + 1];
+    long kb = -1;
+    Image img = NULL;
+    for (int r = 0; r < reps; r++) {
+      ImageDestroy(&img);
+      long before = hugeKB();
+      double t0 = now();
+      img = ImageCreate(n, n, 255);
+      // (a created image gets memory lazily: give it all now, as results get)
+      if (img != NULL && !ImageMaterialize(img)) ImageDestroy(&img);
+      double t = now() - t0;
+      if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+      kb = (before >= 0) ? hugeKB() - before : -1;
+      if (r == 0 || t < best[0]) best[0] = t;
+    }
+    // Write every pixel: pages never written would all read the shared
+    // zero page, which stays in cache and hides the TLB costs
+    ImageNegative(img);
+    for (int y = 0; y < n; y += 7)
+      for (int x = 0; x < n; x += 5) ImageSetPixel(img, x, y, (uint8)(x ^ y));
+    for (int k = 0; k < NOPS; k++) {
+      for (int r = 0; r < reps; r++) {
+        double t0 = now();
+        ops[k].run(img);
+        double t = now() - t0;
+        if (r == 0 || t < best[k + 1]) best[k + 1] = t;
+      }
+    }
+    ImageDestroy(&img);
+
+    if (m == 0) memcpy(base, best, sizeof(base));
+    printf("%-10s %12ld", modes[m].name, kb);
+    for (int k = 0; k <= NOPS; k++) printf(" %10.4fs", best[k]);
+    printf("\n");
+    if (m > 0) {
+      printf("%-10s %12s", "  speedup", "");
+      for (int k = 0; k <= NOPS; k++) printf(" %10.2fx ", base[k] / best[k]);
+      printf("\n");
+    }
+    fflush(stdout);
+  }
+  return 0;
+}
@@ -0,0 +1,540 @@
+// imageCheck - Check properties of image8bit operations.
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// Each case computes the same results in two ways (in-place and copying,
+// incrementally and afresh, fast and naively, ...), on random images of
+// several sizes and in every pixel layout, and counts the results that
+// differ.  It is run by make check.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "error.h"
+#include <assert.h>
+#include <unistd.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageCheck [CASE...]\n"
+    "Run each CASE (default: all), and report the results that differ.\n"
+    "Exits with status 1 if some case fails.\n";
+
+static const PixelLayout layouts[] = { LAYOUT_RASTER, LAYOUT_TILED, LAYOUT_MORTON };
+static const char* layoutName[] = { "raster", "tiled", "morton" };
+#define NLAYOUTS (int)(sizeof(layouts)/sizeof(layouts[0]))
+
+// Sizes of the images checked: tiny, odd, one tile, a few tiles
+static const int sizes[][2] = {
+  { 1, 1 }, { 7, 5 }, { 64, 64 }, { 65, 130 }, { 200, 131 }, { 131, 131 }
+};
+#define NSIZES (int)(sizeof(sizes)/sizeof(sizes[0]))
+
+// A random image (in the default layout)
+static Image randomImage(int w, int h) {
+  Image img = ImageCreate(w, h, 255);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(img, x, y, (uint8)(rand() & 255));
+  return img;
+}
+
+// A copy of img (in the default layout)
+static Image copyImage(Image img) {
+  Image copy = ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  if (copy == NULL) error(2, errno, "Copying image: %s", ImageErrMsg());
+  return copy;
+}
+
+// Compare the results a and b of what: print and return 1 if they differ.
+static int differ(Image a, Image b, const char* what) {
+  int same = ImageWidth(a) == ImageWidth(b) && ImageHeight(a) == ImageHeight(b);
+  for (int y = 0; same && y < ImageHeight(a); y++)
+    for (int x = 0; same && x < ImageWidth(a); x++)
+      same = ImageGetPixel(a, x, y) == ImageGetPixel(b, x, y);
+  if (same) return 0;
+  printf("# %s differs (%dx%d, %s layout)\n", what, ImageWidth(a),
+         ImageHeight(a), layoutName[ImageLayout(a)]);
+  return 1;
+}
+
+// A random binary image, with about one in (1 << sparse) pixels set
+static BitImage randomBits(int w, int h, int sparse) {
+  BitImage b = BitImageCreate(w, h);
+  if (b == NULL) error(2, errno, "Creating binary image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      BitImageSet(b, x, y, (rand() & ((1 << sparse) - 1)) == 0);
+  return b;
+}
+
+// Compare the binary results a and b of what: print and return 1 if they
+// differ.
+static int differBits(BitImage a, BitImage b, const char* what) {
+  int same = BitImageWidth(a) == BitImageWidth(b) && BitImageHeight(a) == BitImageHeight(b);
+  for (int y = 0; same && y < BitImageHeight(a); y++)
+    for (int x = 0; same && x < BitImageWidth(a); x++)
+      same = BitImageGet(a, x, y) == BitImageGet(b, x, y);
+  if (same) return 0;
+  printf("# %s differs (%dx%d binary)\n", what, BitImageWidth(a), BitImageHeight(a));
+  return 1;
+}
+
+// Cases: each returns the number of results that differ.
+
+// In-place geometric transformations give the same images as the copying
+// ones, and as moving each pixel where it belongs.
+static int checkInPlace(void) {
+  int bad = 0;
+  for (int l = 0; l < NLAYOUTS; l++) {
+    ImageSetLayout(layouts[l]);
+    for (int s = 0; s < NSIZES; s++) {
+      int w = sizes[s][0], h = sizes[s][1];
+      Image img = randomImage(w, h);
+      Image ref[3];  // mirrored, flipped, rotated by 180 degrees
+      for (int r = 0; r < 3; r++) ref[r] = copyImage(img);
+      for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++) {
+          ImageSetPixel(ref[0], w-1-x, y, ImageGetPixel(img, x, y));
+          ImageSetPixel(ref[1], x, h-1-y, ImageGetPixel(img, x, y));
+          ImageSetPixel(ref[2], w-1-x, h-1-y, ImageGetPixel(img, x, y));
+        }
+      Image mirrored = ImageMirror(img);
+      if (mirrored == NULL) error(2, errno, "Mirroring image: %s", ImageErrMsg());
+      bad += differ(mirrored, ref[0], "ImageMirror");
+      Image inplace = copyImage(img);
+      ImageMirrorInPlace(inplace);
+      bad += differ(inplace, ref[0], "ImageMirrorInPlace");
+      ImageDestroy(&inplace);
+      inplace = copyImage(img);
+      ImageFlipInPlace(inplace);
+      bad += differ(inplace, ref[1], "ImageFlipInPlace");
+      ImageDestroy(&inplace);
+      inplace = copyImage(img);
+      ImageRotate180InPlace(inplace);
+      bad += differ(inplace, ref[2], "ImageRotate180InPlace");
+      ImageDestroy(&inplace);
+      if (w == h) {
+        Image rotated = ImageRotate(img);
+        if (rotated == NULL) error(2, errno, "Rotating image: %s", ImageErrMsg());
+        inplace = copyImage(img);
+        ImageRotateInPlace(inplace);
+        bad += differ(inplace, rotated, "ImageRotateInPlace");
+        ImageDestroy(&inplace);
+        ImageDestroy(&rotated);
+      }
+      ImageDestroy(&mirrored);
+      for (int r = 0; r < 3; r++) ImageDestroy(&ref[r]);
+      ImageDestroy(&img);
+    }
+  }
+  ImageSetLayout(LAYOUT_RASTER);
+  return bad;
+}
+
+// Widths of binary images checked: around the 64-bit words
+static const int bitWidths[] = { 1, 5, 63, 64, 65, 130, 200 };
+#define NBITWIDTHS (int)(sizeof(bitWidths)/sizeof(bitWidths[0]))
+
+// Binary images (thresholding, counting, combining, matching and PBM
+// files) give the same results as working pixel by pixel on images.
+static int checkBits(void) {
+  int bad = 0;
+  const char* tmpdir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/imageCheck.XXXXXX", tmpdir != NULL ? tmpdir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd < 0) error(2, errno, "Creating %s", path);
+  close(fd);
+  for (int l = 0; l < NLAYOUTS; l++) {
+    ImageSetLayout(layouts[l]);
+    for (int s = 0; s < NSIZES; s++) {
+      int w = sizes[s][0], h = sizes[s][1];
+      Image img = randomImage(w, h);
+      uint8 thr = (uint8)(rand() & 255);
+      BitImage b = ImageThresholdBits(img, thr);
+      if (b == NULL) error(2, errno, "Thresholding image: %s", ImageErrMsg());
+      BitImage ref = BitImageCreate(w, h);
+      if (ref == NULL) error(2, errno, "Creating binary image: %s", ImageErrMsg());
+      unsigned long count = 0;
+      for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++) {
+          int bit = ImageGetPixel(img, x, y) >= thr;
+          BitImageSet(ref, x, y, bit);
+          count += bit;
+        }
+      bad += differBits(b, ref, "ImageThresholdBits");
+      if (BitImageCount(b) != count) {
+        printf("# BitImageCount differs (%dx%d binary)\n", w, h);
+        bad++;
+      }
+      Image back = BitImageToImage(b, 255);
+      if (back == NULL) error(2, errno, "Converting binary image: %s", ImageErrMsg());
+      ImageThreshold(img, thr);
+      bad += differ(back, img, "BitImageToImage");
+      ImageDestroy(&back);
+      BitImageDestroy(&ref);
+      BitImageDestroy(&b);
+      ImageDestroy(&img);
+    }
+  }
+  ImageSetLayout(LAYOUT_RASTER);
+  for (int i = 0; i < NBITWIDTHS; i++) {
+    int w = bitWidths[i], h = 1 + rand() % 40;
+    BitImage b = randomBits(w, h, 1);
+    if (!BitImageSave(b, path)) error(2, errno, "Saving %s: %s", path, ImageErrMsg());
+    BitImage loaded = BitImageLoad(path);
+    if (loaded == NULL) error(2, errno, "Loading %s: %s", path, ImageErrMsg());
+    bad += differBits(loaded, b, "PBM round trip");
+    BitImageDestroy(&loaded);
+    for (int j = 0; j < NBITWIDTHS && bitWidths[j] <= w; j++) {
+      int sw = bitWidths[j], sh = 1 + rand() % h;
+      int x = rand() % (w - sw + 1), y = rand() % (h - sh + 1);
+      BitImage src = randomBits(sw, sh, 1);
+      for (BitOp op = BIT_COPY; op <= BIT_XOR; op++) {
+        BitImage dst = randomBits(w, h, 1);
+        BitImage ref = BitImageCreate(w, h);
+        if (ref == NULL) error(2, errno, "Creating binary image: %s", ImageErrMsg());
+        BitImageCombine(ref, 0, 0, dst, BIT_COPY);
+        for (int v = 0; v < sh; v++)
+          for (int u = 0; u < sw; u++) {
+            int d = BitImageGet(dst, x+u, y+v), s = BitImageGet(src, u, v);
+            int r = (op == BIT_COPY) ? s : (op == BIT_AND) ? (d & s) :
+                    (op == BIT_OR) ? (d | s) : (d ^ s);
+            BitImageSet(ref, x+u, y+v, r);
+          }
+        BitImageCombine(dst, x, y, src, op);
+        bad += differBits(dst, ref, "BitImageCombine");
+        BitImageDestroy(&ref);
+        BitImageDestroy(&dst);
+      }
+      BitImageDestroy(&src);
+    }
+    // Look for a piece of a sparse image (found, maybe elsewhere first),
+    // and for a random image (mostly not found)
+    BitImage sparse = randomBits(w, h, 3);
+    Image simg = BitImageToImage(sparse, 255);
+    if (simg == NULL) error(2, errno, "Converting binary image: %s", ImageErrMsg());
+    for (int j = 0; j < 2; j++) {
+      int sw = 1 + rand() % (w < 8 ? w : 8), sh = 1 + rand() % (h < 4 ? h : 4);
+      int x = rand() % (w - sw + 1), y = rand() % (h - sh + 1);
+      BitImage sub = randomBits(sw, sh, 1);
+      if (j == 0) {
+        for (int v = 0; v < sh; v++)
+          for (int u = 0; u < sw; u++) BitImageSet(sub, u, v, BitImageGet(sparse, x+u, y+v));
+      }
+      Image subimg = BitImageToImage(sub, 255);
+      if (subimg == NULL) error(2, errno, "Converting binary image: %s", ImageErrMsg());
+      int bx = -1, by = -1, ix = -1, iy = -1;
+      int bfound = BitImageLocateSubImage(sparse, &bx, &by, sub);
+      int ifound = ImageLocateSubImage(simg, &ix, &iy, subimg);
+      if (bfound != ifound || bx != ix || by != iy) {
+        printf("# BitImageLocateSubImage differs (%dx%d in %dx%d binary)\n", sw, sh, w, h);
+        bad++;
+      }
+      ImageDestroy(&subimg);
+      BitImageDestroy(&sub);
+    }
+    ImageDestroy(&simg);
+    BitImageDestroy(&sparse);
+    BitImageDestroy(&b);
+  }
+  unlink(path);
+  return bad;
+}
+
+// Blur windows checked (dx, dy): none, thin, square, wider than the images
+static const int windows[][2] = {
+  { 0, 0 }, { 1, 0 }, { 0, 2 }, { 1, 1 }, { 3, 7 }, { 20, 2 }, { 300, 700 }
+};
+#define NWINDOWS (int)(sizeof(windows)/sizeof(windows[0]))
+
+// The mean of the pixels of img in the window (dx, dy) around (x, y),
+// rounded as ImageBlur does, from the sums of the pixels above and left of
+// each position, sat[y*(w+1) + x].
+static uint8 windowMean(const unsigned long* sat, int w, int h, int x, int y, int dx, int dy) {
+  int x0 = (x - dx > 0) ? x - dx : 0, x1 = (x + dx < w) ? x + dx + 1 : w;
+  int y0 = (y - dy > 0) ? y - dy : 0, y1 = (y + dy < h) ? y + dy + 1 : h;
+  unsigned long sum = sat[y1*(w+1) + x1] - sat[y0*(w+1) + x1] -
+                      sat[y1*(w+1) + x0] + sat[y0*(w+1) + x0];
+  return (uint8)((double)sum / ((x1 - x0)*(double)(y1 - y0)) + 0.5);
+}
+
+// ImageBlur gives the mean of each window, computed from a summed-area
+// table, with every set of kernels the cpu supports, in every layout, on
+// images tall enough to be blurred in several bands.
+static int checkBlur(void) {
+  static const char* kernelNames[] = { "scalar", "sse2", "avx2", "avx512" };
+  static const int blurSizes[][2] = { { 1, 1 }, { 7, 5 }, { 65, 130 }, { 131, 300 } };
+  int bad = 0;
+  for (int k = 0; k < 4; k++) {
+    if (!ImageSetKernels(kernelNames[k])) continue;
+    for (int l = 0; l < NLAYOUTS; l++) {
+      ImageSetLayout(layouts[l]);
+      for (int s = 0; s < 4; s++) {
+        int w = blurSizes[s][0], h = blurSizes[s][1];
+        Image img = randomImage(w, h);
+        unsigned long* sat = calloc((size_t)(w+1)*(h+1), sizeof(unsigned long));
+        if (sat == NULL) error(2, errno, "Allocating sums");
+        for (int y = 0; y < h; y++)
+          for (int x = 0; x < w; x++)
+            sat[(y+1)*(w+1) + x+1] = ImageGetPixel(img, x, y) + sat[y*(w+1) + x+1] +
+                                     sat[(y+1)*(w+1) + x] - sat[y*(w+1) + x];
+        for (int i = 0; i < NWINDOWS; i++) {
+          int dx = windows[i][0], dy = windows[i][1];
+          Image blurred = copyImage(img);
+          ImageBlur(blurred, dx, dy);
+          Image ref = copyImage(img);
+          for (int y = 0; y < h; y++)
+            for (int x = 0; x < w; x++)
+              ImageSetPixel(ref, x, y, windowMean(sat, w, h, x, y, dx, dy));
+          char what[64];
+          snprintf(what, sizeof(what), "ImageBlur %d,%d (%s kernels)", dx, dy, kernelNames[k]);
+          bad += differ(blurred, ref, what);
+          ImageDestroy(&ref);
+          ImageDestroy(&blurred);
+        }
+        free(sat);
+        ImageDestroy(&img);
+      }
+    }
+  }
+  ImageSetKernels("auto");
+  ImageSetLayout(LAYOUT_RASTER);
+  return bad;
+}
+
+// A random patch: random levels, or one random level
+static Image randomPatch(int w, int h) {
+  if (rand() & 1) return randomImage(w, h);
+  Image img = ImageCreate(w, h, 255);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  uint8 level = (uint8)(rand() & 255);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) ImageSetPixel(img, x, y, level);
+  return img;
+}
+
+// Change img at random, by one of the functions that change pixels (each
+// of which records the change).  Most changes are small.
+static void randomChange(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  int cw = 1 + rand() % (w < 24 ? w : 24), ch = 1 + rand() % (h < 24 ? h : 24);
+  int x = rand() % (w - cw + 1), y = rand() % (h - ch + 1);
+  Image patch;
+  switch (rand() % 8) {
+  case 0:
+  case 1:
+    ImageSetPixel(img, x, y, (uint8)(rand() & 255));
+    break;
+  case 2:
+  case 3:
+  case 4:
+    patch = randomPatch(cw, ch);
+    ImagePaste(img, x, y, patch);
+    ImageDestroy(&patch);
+    break;
+  case 5:
+    patch = randomPatch(cw, ch);
+    ImageBlend(img, x, y, patch, 0.3);
+    ImageDestroy(&patch);
+    break;
+  case 6:
+    ImagePixels(img)[0] ^= 0x55;
+    ImageMarkChanged(img, 0, 0, 1, 1);  // (pixel 0 is (0,0) in any layout)
+    break;
+  default:
+    if (rand() & 1) ImageNegative(img);
+    else ImageMirrorInPlace(img);
+    break;
+  }
+}
+
+// A blurred copy brought up to date by ImageBlurUpdate, after a few rounds
+// of random changes, is the image blurred afresh (300 cases per layout).
+static int checkBlurUpdate(void) {
+  int bad = 0;
+  for (int l = 0; l < NLAYOUTS; l++) {
+    ImageSetLayout(layouts[l]);
+    for (int c = 0; c < 300; c++) {
+      int w = 1 + rand() % 150, h = 1 + rand() % 150;
+      int dx = rand() % 12, dy = rand() % 12;
+      Image img = randomImage(w, h);
+      Image blurred = copyImage(img);
+      ImageBlur(blurred, dx, dy);
+      unsigned long since = ImageVersion(img);
+      for (int round = 0; round < 3; round++) {
+        for (int n = rand() % 13; n > 0; n--) randomChange(img);
+        since = ImageBlurUpdate(blurred, img, dx, dy, since);
+        if (since != ImageVersion(img)) error(2, errno, "Updating blur: %s", ImageErrMsg());
+        Image fresh = copyImage(img);
+        ImageBlur(fresh, dx, dy);
+        char what[64];
+        snprintf(what, sizeof(what), "ImageBlurUpdate %d,%d", dx, dy);
+        bad += differ(blurred, fresh, what);
+        ImageDestroy(&fresh);
+      }
+      ImageDestroy(&blurred);
+      ImageDestroy(&img);
+    }
+  }
+  ImageSetLayout(LAYOUT_RASTER);
+  return bad;
+}
+
+// After random changes, ImageStats (from its tile cache) gives the extremes
+// of the pixels, and ImageHash (kept until a change) that of a copy, also
+// on images created black and only partly written.
+static int checkStats(void) {
+  int bad = 0;
+  for (int l = 0; l < NLAYOUTS; l++) {
+    ImageSetLayout(layouts[l]);
+    for (int c = 0; c < 100; c++) {
+      int w = 1 + rand() % 300, h = 1 + rand() % 300;
+      Image img;
+      if (rand() & 1) {
+        img = randomImage(w, h);
+      } else {
+        img = ImageCreate(w, h, 255);
+        if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+      }
+      for (int round = 0; round < 5; round++) {
+        uint8 min, max;
+        ImageStats(img, &min, &max);
+        (void)ImageHash(img);  // (cached, until the next changes)
+        for (int n = rand() % 6; n > 0; n--) randomChange(img);
+        ImageStats(img, &min, &max);
+        uint8 rmin = 255, rmax = 0;
+        for (int y = 0; y < h; y++)
+          for (int x = 0; x < w; x++) {
+            uint8 v = ImageGetPixel(img, x, y);
+            if (v < rmin) rmin = v;
+            if (v > rmax) rmax = v;
+          }
+        if (min != rmin || max != rmax) {
+          printf("# ImageStats differs (%dx%d, %s layout)\n", w, h, layoutName[l]);
+          bad++;
+        }
+        Image copy = copyImage(img);
+        if (ImageHash(img) != ImageHash(copy)) {
+          printf("# ImageHash differs (%dx%d, %s layout)\n", w, h, layoutName[l]);
+          bad++;
+        }
+        ImageDestroy(&copy);
+      }
+      ImageDestroy(&img);
+    }
+  }
+  ImageSetLayout(LAYOUT_RASTER);
+  return bad;
+}
+
+// After pastes (some of pieces of the image itself, so that templates match
+// in several places), ImageIndexLocate finds what ImageLocateSubImage finds
+// (240 queries per layout, of templates cut from the image or random).
+static int checkIndex(void) {
+  int bad = 0;
+  for (int l = 0; l < NLAYOUTS; l++) {
+    ImageSetLayout(layouts[l]);
+    int k = 4 << (l % 2);
+    Image img = ImageCreate(256, 192, 255);
+    if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+    ImageIndex idx = ImageIndexCreate(img, k);
+    if (idx == NULL) error(2, errno, "Creating index: %s", ImageErrMsg());
+    for (int round = 0; round < 12; round++) {
+      for (int n = 1 + rand() % 4; n > 0; n--) {
+        int pw = 8 + rand() % 40, ph = 8 + rand() % 40;
+        Image patch;
+        if (rand() & 1) {
+          patch = randomPatch(pw, ph);
+        } else {
+          patch = ImageCrop(img, rand() % (256 - pw + 1), rand() % (192 - ph + 1), pw, ph);
+          if (patch == NULL) error(2, errno, "Cropping image: %s", ImageErrMsg());
+        }
+        ImagePaste(img, rand() % (256 - pw + 1), rand() % (192 - ph + 1), patch);
+        ImageDestroy(&patch);
+      }
+      for (int q = 0; q < 20; q++) {
+        int tw = 1 + rand() % 40, th = 1 + rand() % 40;
+        Image tmpl;
+        if (q % 5 == 4) {
+          tmpl = randomImage(tw, th);
+        } else {
+          tmpl = ImageCrop(img, rand() % (256 - tw + 1), rand() % (192 - th + 1), tw, th);
+          if (tmpl == NULL) error(2, errno, "Cropping image: %s", ImageErrMsg());
+        }
+        int ix = -1, iy = -1, px = -1, py = -1;
+        int ifound = ImageIndexLocate(idx, &ix, &iy, tmpl);
+        if (ifound < 0) error(2, errno, "Searching index: %s", ImageErrMsg());
+        int pfound = ImageLocateSubImage(img, &px, &py, tmpl);
+        if (ifound != pfound || ix != px || iy != py) {
+          printf("# ImageIndexLocate differs (%dx%d template, k %d, %s layout)\n",
+                 tw, th, k, layoutName[l]);
+          bad++;
+        }
+        ImageDestroy(&tmpl);
+      }
+    }
+    ImageIndexDestroy(&idx);
+    ImageDestroy(&img);
+  }
+  ImageSetLayout(LAYOUT_RASTER);
+  return bad;
+}
+
+typedef struct {
+  const char* name;
+  int (*run)(void);
+} Case;
+
+static const Case cases[] = {
+  { "inplace", checkInPlace },
+  { "bits", checkBits },
+  { "blur", checkBlur },
+  { "blurupdate", checkBlurUpdate },
+  { "stats", checkStats },
+  { "index", checkIndex },
+};
+
+#define NCASES (int)(sizeof(cases)/sizeof(cases[0]))
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+
+  for (int j = 1; j < argc; j++) {
+    int known = 0;
+    for (int k = 0; k < NCASES; k++) known |= strcmp(argv[j], cases[k].name) == 0;
+    if (!known) error(1, 0, "Unknown case: %s\n%s", argv[j], USAGE);
+  }
+
+  srand(1);
+  int nfailed = 0;
+  for (int k = 0; k < NCASES; k++) {
+    int wanted = (argc == 1);
+    for (int j = 1; j < argc; j++) wanted |= strcmp(argv[j], cases[k].name) == 0;
+    if (!wanted) continue;
+    int bad = cases[k].run();
+    if (bad > 0) {
+      printf("%-16s FAILED (%d results differ)\n", cases[k].name, bad);
+      nfailed++;
+    } else {
+      printf("%-16s ok\n", cases[k].name);
+    }
+    fflush(stdout);
+  }
+
+  if (nfailed > 0) {
+    printf("# %d case(s) failed\n", nfailed);
+    return 1;
+  }
+  return 0;
+}
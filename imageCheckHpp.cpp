@@ -0,0 +1,184 @@
+// imageCheckHpp - Check the C++ interface of image8bit (image8bit.hpp).
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// Like imageCheck, each case computes the same results in two ways (with
+// the C++ interface and with the C functions), in every pixel layout, and
+// counts the results that differ.  It is compiled as C++17 with -Wall, so
+// that make check also checks that image8bit.hpp compiles cleanly.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+#include <utility>
+
+#include "image8bit.hpp"
+
+static const PixelLayout layouts[] = { LAYOUT_RASTER, LAYOUT_TILED, LAYOUT_MORTON };
+static const char* layoutName[] = { "raster", "tiled", "morton" };
+
+// Sizes of the images checked: tiny, odd, one tile, a few tiles
+static const int sizes[][2] = { { 1, 1 }, { 7, 5 }, { 64, 64 }, { 65, 130 }, { 200, 131 } };
+
+// A random image (in the default layout), with levels up to maxval
+static img8::Image randomImage(int w, int h, uint8 maxval = PixMax) {
+  img8::Image img(w, h, maxval);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) img.set(x, y, (uint8)(std::rand() % (maxval + 1)));
+  return img;
+}
+
+// Compare the results a and b of what: print and return 1 if they differ.
+static int differ(const img8::Image& a, const img8::Image& b, const char* what) {
+  bool same = a.width() == b.width() && a.height() == b.height();
+  for (int y = 0; same && y < a.height(); y++)
+    for (int x = 0; same && x < a.width(); x++) same = a(x, y) == b(x, y);
+  if (same) return 0;
+  std::printf("# %s differs (%dx%d, %s layout)\n", what, a.width(), a.height(),
+              layoutName[a.layout()]);
+  return 1;
+}
+
+// Report a failed expectation what, and count it.
+static int failed(const char* what) {
+  std::printf("# %s\n", what);
+  return 1;
+}
+
+// Cases: each returns the number of results that differ.
+
+// Expressions give what the C point operations give.
+static int checkExpr() {
+  int bad = 0;
+  for (PixelLayout layout : layouts) {
+    ImageSetLayout(layout);
+    for (const auto& s : sizes) {
+      for (uint8 maxval : { (uint8)255, (uint8)200 }) {
+        img8::Image img = randomImage(s[0], s[1], maxval);
+        img8::Image ref = img.copy();
+        ImageNegative(ref.get());
+        ImageBrighten(ref.get(), 1.3);
+        img = (img.maxval() - img) * 1.3;
+        bad += differ(img, ref, "(maxval - img) * 1.3");
+
+        img8::Image a = randomImage(s[0], s[1], maxval);
+        img8::Image b = randomImage(s[0], s[1], maxval);
+        ref = b.copy();
+        ImageBlend(ref.get(), 0, 0, a.get(), 0.25);
+        img8::Image sum(s[0], s[1], maxval);
+        sum = a * 0.25 + b * 0.75;
+        bad += differ(sum, ref, "a * 0.25 + b * 0.75");
+
+        img = a.copy();
+        img = -(-img);
+        bad += differ(img, a, "-(-img)");
+        img = a / 2.0 - a * 0.5 + a;
+        bad += differ(img, a, "a / 2 - a * 0.5 + a");
+      }
+    }
+  }
+  ImageSetLayout(LAYOUT_RASTER);
+
+  img8::Image small(3, 3), other(4, 3);
+  try {
+    small = small + other;
+    bad += failed("expression of images of different sizes did not throw");
+  } catch (const std::invalid_argument&) {
+  }
+  return bad;
+}
+
+// Images and views give what the C functions they wrap give, own their C
+// images, and report failures by exceptions.
+static int checkImage() {
+  int bad = 0;
+  for (PixelLayout layout : layouts) {
+    ImageSetLayout(layout);
+    img8::Image img = randomImage(200, 131);
+    img8::Image piece = img.crop(70, 40, 33, 21);
+
+    img8::View view = img.view(70, 40, 33, 21);
+    if (!(view == piece)) bad += failed("view == crop is false");
+    bad += differ(view.copy(), piece, "View::copy");
+    auto found = img.locate(piece);
+    if (!found) {
+      bad += failed("locate did not find a crop");
+    } else if (!ImageMatchSubImage(img.get(), found->first, found->second, piece.get())) {
+      bad += failed("locate found a position that does not match");
+    }
+
+    img8::Image ref = img.copy();
+    img8::Image src = randomImage(33, 21);
+    ImagePaste(ref.get(), 70, 40, src.get());
+    view = src;
+    bad += differ(img, ref, "View = image (paste)");
+    ImageBlend(ref.get(), 70, 40, piece.get(), 0.6);
+    view.blend(piece, 0.6);
+    bad += differ(img, ref, "View::blend");
+
+    img8::Image rotated(ImageRotate(img.get()));
+    bad += differ(img.rotate(), rotated, "Image::rotate");
+    img8::Image mirrored(ImageMirror(img.get()));
+    bad += differ(img.mirror(), mirrored, "Image::mirror");
+    img8::Image resized(ImageResize(img.get(), 57, 300, RESIZE_AREA));
+    bad += differ(img.resize(57, 300, RESIZE_AREA), resized, "Image::resize");
+
+    // Moving hands the C image over, and leaves the source empty
+    ::Image c = img.get();
+    img8::Image moved(std::move(img));
+    if (moved.get() != c || img) bad += failed("move construction did not move");
+    img = std::move(moved);
+    if (img.get() != c || moved) bad += failed("move assignment did not move");
+  }
+  ImageSetLayout(LAYOUT_RASTER);
+
+  img8::Image img(10, 10);
+  try {
+    img.crop(5, 5, 6, 1);
+    bad += failed("crop outside the image did not throw");
+  } catch (const std::out_of_range&) {
+  }
+  try {
+    img8::Image::load("/nonexistent/imageCheckHpp.pgm");
+    bad += failed("loading a missing file did not throw");
+  } catch (const img8::Error& e) {
+    if (std::strstr(e.what(), "ImageLoad") == nullptr) bad += failed("Error does not name ImageLoad");
+  }
+  return bad;
+}
+
+struct Case {
+  const char* name;
+  int (*run)();
+};
+
+static const Case cases[] = {
+  { "expr", checkExpr },
+  { "image", checkImage },
+};
+
+int main() {
+  ImageInit();
+  std::srand(1);
+  int nfailed = 0;
+  for (const Case& c : cases) {
+    int bad = c.run();
+    if (bad > 0) {
+      std::printf("%-16s FAILED (%d results differ)\n", c.name, bad);
+      nfailed++;
+    } else {
+      std::printf("%-16s ok\n", c.name);
+    }
+  }
+  if (nfailed > 0) {
+    std::printf("# %d case(s) failed\n", nfailed);
+    return 1;
+  }
+  return 0;
+}
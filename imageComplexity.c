@@ -0,0 +1,321 @@
+// imageComplexity - Check how image8bit operations scale.
+//
+// This program is an example use of the image8bit module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// Each case runs one operation over a geometric series of sizes (of the
+// image, the filter window, the template, ...), measuring time and the
+// instrumentation counters.  The growth of each is then fitted to a few
+// complexity classes, and cases that grow faster than expected are flagged.
+// This should catch accidental quadratic (or worse) regressions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include "error.h"
+#include <assert.h>
+
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageComplexity [-steps N] [-v] [CASE...]\n"
+    "Run each CASE (default: all) over a series of N sizes (default 5),\n"
+    "and report how its time and pixel accesses grow.\n"
+    "  -v    Also print the measurements of each step.\n"
+    "Exits with status 1 if some case grows faster than expected.\n";
+
+// Complexity classes, as functions of the series parameter n
+typedef enum { C_1, C_LOG, C_N, C_NLOG, C_N2, C_N3, NCLASSES } Class;
+
+static const char* className[NCLASSES] = {
+  "1", "log n", "n", "n log n", "n^2", "n^3"
+};
+
+// Log-log slope of each class (roughly, for n log n)
+static const double classSlope[NCLASSES] = { 0.0, 0.0, 1.0, 1.1, 2.0, 3.0 };
+
+static double classValue(Class c, double n) {
+  switch (c) {
+  case C_1: return 1.0;
+  case C_LOG: return log2(n + 1.0);
+  case C_N: return n;
+  case C_NLOG: return n * log2(n + 1.0);
+  case C_N2: return n * n;
+  default: return n * n * n;
+  }
+}
+
+// Allowed excess of the measured slope over the expected one
+#define COUNT_TOLERANCE 0.25
+#define TIME_TOLERANCE 0.5
+
+// Minimum time to measure at each step (operations are repeated)
+#define MIN_TIME 0.02
+
+// Operands of one step of a case
+typedef struct {
+  Image a, b;
+  int p, q;
+} Args;
+
+// A random image
+static Image randomImage(int w, int h) {
+  Image img = ImageCreate(w, h, 255);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(img, x, y, (uint8)(rand() & 255));
+  return img;
+}
+
+// A constant image
+static Image flatImage(int w, int h, uint8 level) {
+  Image img = ImageCreate(w, h, 255);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(img, x, y, level);
+  return img;
+}
+
+// Side of square images at step i
+static int side(int i) { return 32 << i; }
+
+// Setup functions: make the operands for step i, return the parameter n.
+
+static double setupSquare(int i, Args* args) {
+  args->a = randomImage(side(i), side(i));
+  return (double)side(i) * side(i);
+}
+
+static double setupPair(int i, Args* args) {  // b is pasted into a
+  args->a = randomImage(side(i), side(i));
+  args->b = randomImage(side(i)/2, side(i)/2);
+  return (double)(side(i)/2) * (side(i)/2);
+}
+
+static double setupBlurSize(int i, Args* args) {
+  args->a = randomImage(side(i), side(i));
+  args->p = 1;
+  return (double)side(i) * side(i);
+}
+
+static double setupBlurWindow(int i, Args* args) {
+  args->a = randomImage(128, 128);
+  args->p = 1 << i;
+  return (double)(2*args->p + 1) * (2*args->p + 1);
+}
+
+// Worst case for locate: flat images, with a template that never matches
+// (its last pixel differs), so every position is compared in full.
+static double setupLocateHaystack(int i, Args* args) {
+  args->a = flatImage(side(i), side(i), 0);
+  args->b = flatImage(8, 8, 0);
+  ImageSetPixel(args->b, 7, 7, 1);
+  return (double)side(i) * side(i);
+}
+
+static double setupLocateTemplate(int i, Args* args) {
+  int t = 2 << i;
+  args->a = flatImage(256, 256, 0);
+  args->b = flatImage(t, t, 0);
+  ImageSetPixel(args->b, t-1, t-1, 1);
+  return (double)t * t;
+}
+
+// Run functions: the timed operation.
+
+static void runNegative(Args* args) { ImageNegative(args->a); }
+static void runThreshold(Args* args) { ImageThreshold(args->a, 128); }
+static void runBrighten(Args* args) { ImageBrighten(args->a, 1.0); }
+
+static void runStats(Args* args) {  // (a full scan, not the cached stats)
+  uint8 min, max;
+  ImageMarkChanged(args->a, 0, 0, ImageWidth(args->a), ImageHeight(args->a));
+  ImageStats(args->a, &min, &max);
+}
+
+static void runResult(Image img) {
+  if (img == NULL) error(2, errno, "Operation failed: %s", ImageErrMsg());
+  ImageDestroy(&img);
+}
+
+static void runRotate(Args* args) { runResult(ImageRotate(args->a)); }
+static void runMirror(Args* args) { runResult(ImageMirror(args->a)); }
+
+static void runCrop(Args* args) {
+  int w = ImageWidth(args->a);
+  runResult(ImageCrop(args->a, w/4, w/4, w/2, w/2));
+}
+
+static void runResize(Args* args) {
+  int w = ImageWidth(args->a);
+  runResult(ImageResize(args->a, w/2, w/2, RESIZE_BILINEAR));
+}
+
+static void runRotateAngle(Args* args) {
+  runResult(ImageRotateAngle(args->a, 30.0, RESIZE_BILINEAR));
+}
+
+static void runPaste(Args* args) { ImagePaste(args->a, 0, 0, args->b); }
+static void runBlend(Args* args) { ImageBlend(args->a, 0, 0, args->b, 0.5); }
+static void runBlur(Args* args) { ImageBlur(args->a, args->p, args->p); }
+
+static void runLocate(Args* args) {
+  int x, y;
+  ImageLocateSubImage(args->a, &x, &y, args->b);
+}
+
+typedef struct {
+  const char* name;
+  const char* param;  // what n is
+  Class expected;
+  double (*setup)(int i, Args* args);
+  void (*run)(Args* args);
+} Case;
+
+static const Case cases[] = {
+  { "neg", "pixels", C_N, setupSquare, runNegative },
+  { "thr", "pixels", C_N, setupSquare, runThreshold },
+  { "bri", "pixels", C_N, setupSquare, runBrighten },
+  { "stats", "pixels", C_N, setupSquare, runStats },
+  { "rotate", "pixels", C_N, setupSquare, runRotate },
+  { "mirror", "pixels", C_N, setupSquare, runMirror },
+  { "crop", "pixels", C_N, setupSquare, runCrop },
+  { "resize", "pixels", C_N, setupSquare, runResize },
+  { "rotateby", "pixels", C_N, setupSquare, runRotateAngle },
+  { "paste", "pasted pixels", C_N, setupPair, runPaste },
+  { "blend", "pasted pixels", C_N, setupPair, runBlend },
+  { "blur-size", "pixels", C_N, setupBlurSize, runBlur },
+  { "blur-window", "window pixels", C_1, setupBlurWindow, runBlur },
+  { "locate-haystack", "haystack pixels", C_N, setupLocateHaystack, runLocate },
+  { "locate-template", "template pixels", C_N, setupLocateTemplate, runLocate },
+};
+
+#define NCASES (int)(sizeof(cases)/sizeof(cases[0]))
+
+// Wall-clock time in seconds
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Least squares slope of log y against log x.
+static double logSlope(const double* x, const double* y, int n) {
+  double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+  for (int i = 0; i < n; i++) {
+    double lx = log(x[i]), ly = log(y[i] > 0.0 ? y[i] : 1e-300);
+    sx += lx; sy += ly; sxx += lx*lx; sxy += lx*ly;
+  }
+  double d = n*sxx - sx*sx;
+  return (d != 0.0) ? (n*sxy - sx*sy) / d : 0.0;
+}
+
+// Class that best fits y = c*f(x): the one with least variance of
+// log y - log f(x).
+static Class bestClass(const double* x, const double* y, int n) {
+  Class best = C_1;
+  double bestVar = HUGE_VAL;
+  for (Class c = C_1; c < NCLASSES; c++) {
+    double s = 0.0, ss = 0.0;
+    for (int i = 0; i < n; i++) {
+      double r = log(y[i] > 0.0 ? y[i] : 1e-300) - log(classValue(c, x[i]));
+      s += r; ss += r*r;
+    }
+    double var = ss/n - (s/n)*(s/n);
+    if (var < bestVar - 1e-12) { best = c; bestVar = var; }
+  }
+  return best;
+}
+
+// Run case c over steps sizes.  Returns 1 if it grows faster than expected.
+static int runCase(const Case* c, int steps, int verbose) {
+  double x[steps], count[steps], time[steps];
+  for (int i = 0; i < steps; i++) {
+    Args args = { NULL, NULL, 0, 0 };
+    x[i] = c->setup(i, &args);
+    int reps = 0;
+    double t0 = now(), t;
+    InstrReset();
+    do {
+      c->run(&args);
+      reps++;
+    } while ((t = now() - t0) < MIN_TIME);
+    time[i] = t / reps;
+    count[i] = (double)InstrCount[0] / reps;
+    if (verbose) {
+      printf("#   %-15s n=%-10.0f %12.3e s %14.0f %s\n",
+             c->name, x[i], time[i], count[i], InstrName[0]);
+    }
+    ImageDestroy(&args.a);
+    ImageDestroy(&args.b);
+  }
+  int counted = count[steps-1] > 0.0;  // some operations count nothing
+  double cslope = counted ? logSlope(x, count, steps) : 0.0;
+  double tslope = logSlope(x, time, steps);
+  double expected = classSlope[c->expected];
+  int worse = cslope > expected + COUNT_TOLERANCE ||
+              tslope > expected + TIME_TOLERANCE;
+  printf("%-16s %-16s %-8s ", c->name, c->param, className[c->expected]);
+  if (counted) {
+    printf("%6.2f %-8s ", cslope, className[bestClass(x, count, steps)]);
+  } else {
+    printf("%6s %-8s ", "-", "");
+  }
+  printf("%6.2f %-8s %s\n", tslope, className[bestClass(x, time, steps)],
+         worse ? "WORSE" : "ok");
+  fflush(stdout);
+  return worse;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+  // One thread, unless asked otherwise: thread overheads blur the scaling
+  if (getenv("IMAGE_THREADS") == NULL) ImageSetThreads(1);
+
+  int steps = 5;
+  int verbose = 0;
+  int first = 1;
+  while (first < argc && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-steps") == 0 && first + 1 < argc) {
+      steps = atoi(argv[++first]);
+      if (steps < 3 || steps > 8) error(1, 0, "Number of steps must be in [3, 8]");
+    } else if (strcmp(argv[first], "-v") == 0) {
+      verbose = 1;
+    } else {
+      error(1, 0, "\n%s", USAGE);
+    }
+    first++;
+  }
+
+  for (int j = first; j < argc; j++) {
+    int known = 0;
+    for (int k = 0; k < NCASES; k++) known |= strcmp(argv[j], cases[k].name) == 0;
+    if (!known) error(1, 0, "Unknown case: %s", argv[j]);
+  }
+
+  srand(1);
+  printf("#%-15s %-16s %-8s %15s %15s\n", "case", "n", "expected",
+         InstrName[0], "time");
+  int nworse = 0;
+  for (int k = 0; k < NCASES; k++) {
+    int wanted = (first == argc);
+    for (int j = first; j < argc; j++) wanted |= strcmp(argv[j], cases[k].name) == 0;
+    if (wanted) nworse += runCase(&cases[k], steps, verbose);
+  }
+
+  if (nworse > 0) {
+    printf("# %d case(s) grow faster than expected\n", nworse);
+    return 1;
+  }
+  return 0;
+}
@@ -15,12 +15,23 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool serve [SOCKET]\n"
+    "       imageTool stream [OPERATION [OPERAND...]]\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -29,31 +40,119 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  The buffer has no fixed capacity.  If its images exceed the memory\n"
+    "  budget, the least recently used ones are spilled to temporary files\n"
+    "  (in $TMPDIR or /tmp) and mapped back into memory when used again.\n"
+    "  When an operation creates a new image from CURR, and that image is\n"
+    "  never used again, the operation may be done in-place, without copy.\n"
+    "  Operations that use different images and files may run at the same\n"
+    "  time, on $IMAGETOOL_JOBS threads (default: $IMAGE_THREADS, or the\n"
+    "  number of cpus), which also share the work of each operation.  Their\n"
+    "  output is printed in order all the same.  Operations on settings,\n"
+    "  instrumentation or kept images run alone, and with a memory budget\n"
+    "  all operations run one at a time.\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  With serve, pipelines are read one per line, with the same arguments\n"
+    "  as above, from stdin or from connections to Unix socket SOCKET.\n"
+    "  Their output is followed by a line \"# OK\" or \"# ERROR message\".\n"
+    "  The line quit ends the input (or connection); shutdown stops the server.\n"
+    "  Images kept by name stay in memory between pipelines, but settings\n"
+    "  (budget, layout, kernels) apply only to the pipeline that sets them.\n"
+    "\n"
+    "STREAM MODE:\n"
+    "  With stream, PGM images (frames) are read one after another from stdin\n"
+    "  (a pipe or FIFO, say), the pipeline is run on each frame, which starts\n"
+    "  as I0, and CURR is written to stdout, as a stream of PGM images.\n"
+    "  Reading, processing and writing frames run concurrently, with up to\n"
+    "  $IMAGETOOL_PREFETCH frames (default 2) queued between them.\n"
+    "  Text output of operations goes to stderr.\n"
+    "\n"
+    "RESULT CACHE:\n"
+    "  With $IMAGETOOL_CACHE set to a directory, the images computed by\n"
+    "  operations from CURR (and PRED) are kept there, named by a hash of\n"
+    "  the operation, its operand and the pixels of its inputs, and are\n"
+    "  loaded instead of computed when the same operation is applied to the\n"
+    "  same pixels again, in this run or a later one.  The least recently\n"
+    "  used ones are removed when they exceed $IMAGETOOL_CACHE_SIZE bytes\n"
+    "  (suffix k, M or G; default 1G).  Hits and misses are counted by the\n"
+    "  instrumentation (see toc and profile).\n"
     "\n"
     "FILES:\n"
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
+    "  @NAME stands for a copy of the image kept as NAME.\n"
+    "  shm:NAME stands for the shared image NAME (see export), which is\n"
+    "  mapped, not copied.\n"
+    "  Input files are read in the background, a few files ahead of the\n"
+    "  operation being run ($IMAGETOOL_PREFETCH files, default 2).\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
     "  save FILE       Save CURR to PGM file\n"
+    "                  (Saving is done in the background: write errors may\n"
+    "                  only be reported at the end.)\n"
+    "  savepbm FILE    Save CURR to PBM (bitmap) file: nonzero pixels white\n"
+    "  export NAME     Export CURR as shared image NAME (in POSIX shared\n"
+    "                  memory), for other processes to use as shm:NAME, and\n"
+    "                  print its generation (which grows with each export)\n"
+    "  unexport NAME   Remove shared image NAME\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  kernels NAME    Use pixel kernels NAME (scalar, sse2, avx2, avx512, auto).\n"
+    "  selftest        Check all pixel kernels against the scalar ones.\n"
+    "  recalibrate     Measure the calibrated time unit again (and cache it).\n"
+    "  profile         Time each step and library call from now on, and print\n"
+    "                  a tree of times at exit (or set IMAGETOOL_PROFILE).\n"
+    "  trace FILE      Record when each step and library call ran, on which\n"
+    "                  thread, and write it to FILE at exit as Chrome trace\n"
+    "                  JSON (or set IMAGE_TRACE=FILE).  Only one trace per run.\n"
+    "  budget BYTES    Set image buffer memory budget (suffix k, M or G)\n"
+    "                  (default: $IMAGETOOL_BUDGET, or unlimited)\n"
+    "  memstat         Print image buffer memory usage and peak\n"
+    "  keep NAME       Keep a copy of CURR as NAME (until dropped or exit)\n"
+    "  drop NAME       Forget the image kept as NAME\n"
+    "  layout L        Set pixel layout of images created from now on: raster,\n"
+    "                  tiled or morton (default: $IMAGE_LAYOUT, or raster)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
+    "  count LEVEL     Print number of pixels of CURR with level>=LEVEL\n"
+    "  label LEVEL     Print the connected components (8-connected) of the\n"
+    "                  pixels of CURR with level>=LEVEL: area and bounding box\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
     "\n"              
-    "  create W,H      Create new black image with WxH pixels\n"
+    "  create W,H      Create new black image with WxH pixels (which use\n"
+    "                  memory only where written, by paste, say)\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotateby DEG[,M]  Rotate CURR DEG degrees counter-clockwise around its\n"
+    "                  center, with method M, creating new image of same size\n"
+    "  warp A,B,C,D,E,F[,M]  Move each pixel (x,y) of CURR to (Ax+By+C,Dx+Ey+F),\n"
+    "                  with method M, creating new image of same size\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
+    "  flip            Flip CURR top-to-bottom, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,M]  Resize CURR to WxH pixels with method M, creating new image\n"
+    "                  M may be nearest, bilinear (default) or area\n"
+    "                  (area is not available for rotateby and warp)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
+    "  pastemany PLACEMENTS  Paste many PGM files into CURR, as listed in\n"
+    "                  text file PLACEMENTS, one \"FILE X,Y\" per line\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  index NAME,K[,FILE]  Build a search index of the image kept as NAME,\n"
+    "                  hashing its KxK blocks (for templates at least 2K-1\n"
+    "                  wide and high).  With FILE, load the index from FILE\n"
+    "                  if it was saved for the same pixels and K, or else\n"
+    "                  save it there.\n"
+    "  locatein NAME   Search CURR in the image kept as NAME (using its index,\n"
+    "                  if any), print matching position, or NOTFOUND\n"
+    "  pasteinto NAME,X,Y  Paste CURR into the image kept as NAME at (X,Y)\n"
+    "                  (its index, if any, is updated where it changed)\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
     "\n"              
@@ -62,6 +161,8 @@ static const char* USAGE =
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  BYTES           Size in bytes, e.g. 512M\n"
+    "  M               Resampling method\n"
     "\n"
     ;
 
@@ -69,13 +170,782 @@ static char* errors[] = {
   "Success",
   "Insufficient operands",
   "Insufficient images",
-  "Image buffer is full",
+  "Image buffer is full (out of memory)",
   "Image8bit failure: %s",
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Invalid placements file",
+  "Unknown kept image",
+  "Kernel self-test failed: %s",
+  "Cannot trace to %s",
+};
+
+
+// Parse resampling method name mname into *method.
+// Returns 1 on success, 0 if the name is unknown.
+static int parseMethod(const char* mname, ResizeMethod* method) {
+  if (strcmp(mname, "nearest") == 0) *method = RESIZE_NEAREST;
+  else if (strcmp(mname, "bilinear") == 0) *method = RESIZE_BILINEAR;
+  else if (strcmp(mname, "area") == 0) *method = RESIZE_AREA;
+  else return 0;
+  return 1;
+}
+
+// Paste the tiles listed in placements file fname into canvas.
+// Each non-empty line that does not start with # has the form "FILE X,Y".
+// Each distinct FILE is loaded only once, and all tiles are then pasted
+// with a single ImagePasteMany call.
+// Returns 0 on success, or an index into errors[] on failure.
+static int pasteMany(Image canvas, const char* fname) {
+  FILE* f = fopen(fname, "r");
+  if (f == NULL) return 8;
+
+  int err = 0;
+  int n = 0, cap = 0;           // placements
+  ImagePlacement* pl = NULL;
+  int nt = 0, tcap = 0;         // distinct tiles loaded
+  char** names = NULL;
+  Image* tiles = NULL;
+
+  char line[4096];
+  char name[4096];
+  int x, y;
+  while (err == 0 && fgets(line, sizeof(line), f) != NULL) {
+    if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) continue;
+    if (sscanf(line, "%4095s %d,%d", name, &x, &y) != 3) { err = 8; break; }
+    int t = 0;
+    while (t < nt && strcmp(names[t], name) != 0) t++;
+    if (t == nt) {  // new tile
+      if (nt == tcap) {
+        int c = (tcap == 0) ? 16 : 2*tcap;
+        char** nn = (char**)realloc(names, c*sizeof(char*));
+        if (nn != NULL) names = nn;
+        Image* nt2 = (Image*)realloc(tiles, c*sizeof(Image));
+        if (nt2 != NULL) tiles = nt2;
+        if (nn == NULL || nt2 == NULL) { err = 4; break; }
+        tcap = c;
+      }
+      tiles[nt] = ImageLoad(name);
+      if (tiles[nt] == NULL) { err = 4; break; }
+      names[nt++] = strdup(name);
+    }
+    if (!ImageValidRect(canvas, x, y, ImageWidth(tiles[t]), ImageHeight(tiles[t]))) { err = 6; break; }
+    if (n == cap) {
+      int c = (cap == 0) ? 64 : 2*cap;
+      ImagePlacement* np = (ImagePlacement*)realloc(pl, c*sizeof(ImagePlacement));
+      if (np == NULL) { err = 4; break; }
+      pl = np;
+      cap = c;
+    }
+    pl[n++] = (ImagePlacement){ tiles[t], x, y };
+  }
+  fclose(f);
+
+  if (err == 0) ImagePasteMany(canvas, pl, n);
+
+  for (int t = 0; t < nt; t++) {
+    ImageDestroy(&tiles[t]);
+    free(names[t]);
+  }
+  free(tiles);
+  free(names);
+  free(pl);
+  return err;
+}
+
+
+// Flags describing how operations use their arguments and the buffer.
+enum {
+  OPERAND = 1,       // takes one operand
+  READS_PRED = 2,    // reads PRED
+  APPENDS = 4,       // appends a new image to the buffer
+  LOADS = 8,         // loads a FILE (not an operation)
+  READS_CURR = 16,   // reads CURR
+  WRITES_CURR = 32,  // changes CURR (or, if APPENDS, may take it in-place)
+  SAVES = 64,        // writes the file given as operand
+  GLOBAL = 128,      // uses global state (settings, kept images, files, ...)
 };
 
+static const struct {
+  const char* name;
+  int flags;
+} operations[] = {
+  { "info", READS_CURR }, { "tic", GLOBAL }, { "toc", GLOBAL },
+  { "recalibrate", GLOBAL }, { "profile", GLOBAL }, { "trace", OPERAND | GLOBAL },
+  { "kernels", OPERAND | GLOBAL }, { "selftest", GLOBAL },
+  { "budget", OPERAND | GLOBAL }, { "memstat", GLOBAL },
+  { "layout", OPERAND | GLOBAL },
+  { "keep", OPERAND | READS_CURR | GLOBAL }, { "drop", OPERAND | GLOBAL },
+  { "neg", READS_CURR | WRITES_CURR },
+  { "thr", OPERAND | READS_CURR | WRITES_CURR },
+  { "bri", OPERAND | READS_CURR | WRITES_CURR },
+  { "create", OPERAND | APPENDS },
+  { "rotate", READS_CURR | WRITES_CURR | APPENDS },
+  { "rotateby", OPERAND | READS_CURR | APPENDS },
+  { "warp", OPERAND | READS_CURR | APPENDS },
+  { "mirror", READS_CURR | WRITES_CURR | APPENDS },
+  { "flip", READS_CURR | WRITES_CURR | APPENDS },
+  { "rotate180", READS_CURR | WRITES_CURR | APPENDS },
+  { "crop", OPERAND | READS_CURR | APPENDS },
+  { "resize", OPERAND | READS_CURR | APPENDS },
+  { "paste", OPERAND | READS_PRED | READS_CURR | WRITES_CURR },
+  { "pastemany", OPERAND | READS_CURR | WRITES_CURR | GLOBAL },
+  { "blend", OPERAND | READS_PRED | READS_CURR | WRITES_CURR },
+  { "locate", READS_PRED | READS_CURR },
+  { "index", OPERAND | GLOBAL }, { "locatein", OPERAND | READS_CURR | GLOBAL },
+  { "pasteinto", OPERAND | READS_CURR | GLOBAL },
+  { "blur", OPERAND | READS_CURR | WRITES_CURR },
+  { "save", OPERAND | READS_CURR | SAVES },
+  { "count", OPERAND | READS_CURR },
+  { "savepbm", OPERAND | READS_CURR | SAVES },
+  { "export", OPERAND | READS_CURR | GLOBAL }, { "unexport", OPERAND | GLOBAL },
+  { "label", OPERAND | READS_CURR },
+};
+
+// Get the flags of operation name.  Anything else is a FILE to load.
+static int opFlags(const char* name) {
+  for (size_t i = 0; i < sizeof(operations)/sizeof(operations[0]); i++) {
+    if (strcmp(operations[i].name, name) == 0) return operations[i].flags;
+  }
+  return LOADS | APPENDS;
+}
+
+// Check if FILE argument a names a shared image (shm:NAME).
+static int sharedArg(const char* a) {
+  return strncmp(a, "shm:", 4) == 0;
+}
+
+// Check if the operation at av[k], which appends a new image made from
+// CURR, leaves CURR to be used by a later operation (as PRED).
+static int currUsedAfter(int k, int ac, char* av[]) {
+  for (int j = k + 1; j < ac; j++) {
+    int flags = opFlags(av[j]);
+    if (flags & READS_PRED) return 1;
+    if (flags & APPENDS) return 0;  // CURR is no longer reachable
+    if (flags & OPERAND) j++;
+  }
+  return 0;
+}
+
+// Result cache
+//
+// Results are PGM files named by their key (16 hex digits) in cacheDir.
+// Files are written under a temporary name and renamed, so several
+// processes may share the directory.  A hit touches its file, so file
+// modification times order the files by last use.  The total size is
+// counted when the first result is stored, then kept up to date; when it
+// exceeds cacheCap, the least recently used files are removed, down to
+// 7/8 of cacheCap (so that not every store has to scan the directory).
+
+static const char* cacheDir = NULL;  // NULL if there is no cache
+static size_t cacheCap = (size_t)1 << 30;
+static size_t cacheSize = 0;         // bytes of results in cacheDir
+static int cacheCounted = 0;         // has cacheSize been counted?
+static unsigned long cacheSeq = 0;   // for temporary file names
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+
+#define CACHEHITS InstrCount[1]
+#define CACHEMISSES InstrCount[2]
+
+typedef struct {
+  struct timespec used;  // last use (modification time)
+  off_t size;
+  char name[24];
+} CacheFile;
+
+static int compareCacheFiles(const void* p1, const void* p2) {
+  const CacheFile* a = (const CacheFile*)p1;
+  const CacheFile* b = (const CacheFile*)p2;
+  if (a->used.tv_sec != b->used.tv_sec) return (a->used.tv_sec < b->used.tv_sec) ? -1 : 1;
+  return (a->used.tv_nsec > b->used.tv_nsec) - (a->used.tv_nsec < b->used.tv_nsec);
+}
+
+// Count the bytes of the results in the cache, removing the least
+// recently used ones until they fit in limit bytes.  The cache is locked.
+static void cacheTrim(size_t limit) {
+  DIR* d = opendir(cacheDir);
+  if (d == NULL) return;
+  CacheFile* files = NULL;
+  size_t n = 0, cap = 0, total = 0;
+  char path[PATH_MAX];
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    if (strlen(e->d_name) != 20 || strcmp(e->d_name + 16, ".pgm") != 0) continue;
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", cacheDir, e->d_name);
+    if (stat(path, &st) != 0) continue;
+    if (n == cap) {
+      size_t c = (cap == 0) ? 256 : 2*cap;
+      CacheFile* nf = (CacheFile*)realloc(files, c*sizeof(CacheFile));
+      if (nf == NULL) break;
+      files = nf;
+      cap = c;
+    }
+    files[n] = (CacheFile){ st.st_mtim, st.st_size, "" };
+    strcpy(files[n++].name, e->d_name);
+    total += st.st_size;
+  }
+  closedir(d);
+  if (n > 0) qsort(files, n, sizeof(CacheFile), compareCacheFiles);
+  for (size_t i = 0; i < n && total > limit; i++) {
+    snprintf(path, sizeof(path), "%s/%s", cacheDir, files[i].name);
+    if (unlink(path) == 0) total -= files[i].size;
+  }
+  free(files);
+  cacheSize = total;
+  cacheCounted = 1;
+}
+
+// Set path (PATH_MAX bytes) to the file of the result with key.
+static void cachePath(uint64_t key, char* path) {
+  snprintf(path, PATH_MAX, "%s/%016" PRIx64 ".pgm", cacheDir, key);
+}
+
+// Get the result with key from the cache, or NULL if it is not there.
+static Image cacheLoad(uint64_t key) {
+  char path[PATH_MAX];
+  cachePath(key, path);
+  int errsave = errno;
+  Image img = ImageLoad(path);
+  if (img != NULL) utimensat(AT_FDCWD, path, NULL, 0);  // (used now)
+  errno = errsave;  // (a miss is no error)
+  return img;
+}
+
+// Store img in the cache file path (in the I/O thread).
+// Returns 0 on failure.
+static int cacheStore(Image img, const char* path) {
+  char tmp[PATH_MAX + 64];
+  snprintf(tmp, sizeof(tmp), "%s.%ld.%lu.tmp", path, (long)getpid(),
+           __atomic_fetch_add(&cacheSeq, 1, __ATOMIC_RELAXED));
+  struct stat st;
+  if (!ImageSave(img, tmp) || stat(tmp, &st) != 0) {
+    unlink(tmp);
+    return 0;
+  }
+  off_t added = st.st_size;   // the file, header included
+  off_t replaced = 0;         // a file with the same key, if there was one
+  pthread_mutex_lock(&cachelock);
+  int errsave = errno;
+  if (stat(path, &st) == 0) replaced = st.st_size;
+  errno = errsave;  // (no file to replace is no error)
+  if (rename(tmp, path) != 0) {
+    pthread_mutex_unlock(&cachelock);
+    unlink(tmp);
+    return 0;
+  }
+  if (cacheCounted) {
+    cacheSize += added;
+    cacheSize = (cacheSize > (size_t)replaced) ? cacheSize - replaced : 0;
+  } else {
+    cacheTrim(cacheCap);
+  }
+  if (cacheSize > cacheCap) cacheTrim(cacheCap - cacheCap/8);
+  pthread_mutex_unlock(&cachelock);
+  return 1;
+}
+
+// Asynchronous I/O
+//
+// Loading and saving run on a background I/O thread, so they overlap with
+// computation in the main thread.  Jobs run in the order they are queued.
+// Input FILEs are queued ahead of time (prefetched), up to a few files
+// ahead of the operation being run.  Saves are queued and the pipeline
+// goes on (write-behind); an image being saved must not be changed or
+// destroyed until its job is done (see ioWaitImage), and ioFinish waits for
+// all jobs before exit.
+// The instrumentation counts of each job are handed over to the main
+// thread when the job is collected.
+
+enum { IO_LOAD, IO_SAVE, IO_CACHE };
+
+typedef struct IOJob {
+  int kind;             // IO_LOAD, IO_SAVE or IO_CACHE (a save to the cache)
+  const char* name;     // file name
+  Image img;            // image loaded, or to be saved
+  int done;             // set by the I/O thread when finished
+  int ok;               // success?
+  int errnum;           // errno on failure
+  const char* errmsg;   // ImageErrMsg() on failure
+  unsigned long count[NUMCOUNTERS];  // instrumentation counts of the job
+  struct IOJob* next;   // next in the queue
+  struct IOJob* link;   // next in the list of saves
+} IOJob;
+
+static pthread_mutex_t iolock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t iocond = PTHREAD_COND_INITIALIZER;  // job queued or done
+static IOJob* ioqueue = NULL;     // pending jobs (first to run)
+static IOJob* ioqueueTail = NULL;
+static IOJob* iosaves = NULL;     // save jobs not yet collected
+static pthread_t iothread;
+static int iorunning = 0;         // is iothread running?
+static int ioquit = 0;            // ask iothread to finish
+
+// Lock of the save and prefetch lists below, and of the image buffer, for
+// steps run concurrently (see schedRun).  It is recursive.
+static pthread_mutex_t buflock;
+
+static void bufLockInit(void) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&buflock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+// Run a job (in the I/O thread).
+static void ioRun(IOJob* job) {
+  unsigned long before[NUMCOUNTERS];
+  memcpy(before, InstrCount, sizeof(before));
+  if (job->kind == IO_LOAD) {
+    job->img = ImageLoad(job->name);
+    job->ok = job->img != NULL;
+  } else if (job->kind == IO_SAVE) {
+    job->ok = ImageSave(job->img, job->name) != 0;
+  } else {
+    cacheStore(job->img, job->name);
+    job->ok = 1;  // (a result not cached is no error)
+  }
+  job->errnum = errno;
+  job->errmsg = ImageErrMsg();
+  for (int i = 0; i < NUMCOUNTERS; i++) job->count[i] = InstrCount[i] - before[i];
+}
+
+static void* ioWorker(void* arg) {
+  pthread_mutex_lock(&iolock);
+  for (;;) {
+    while (ioqueue == NULL && !ioquit) pthread_cond_wait(&iocond, &iolock);
+    if (ioqueue == NULL) break;
+    IOJob* job = ioqueue;
+    ioqueue = job->next;
+    if (ioqueue == NULL) ioqueueTail = NULL;
+    pthread_mutex_unlock(&iolock);
+    ioRun(job);
+    pthread_mutex_lock(&iolock);
+    job->done = 1;
+    pthread_cond_broadcast(&iocond);
+  }
+  pthread_mutex_unlock(&iolock);
+  return NULL;
+}
+
+// Queue a job.  If the I/O thread cannot be started, the job is run right
+// away, in this thread.  Returns NULL if the job cannot be allocated.
+static IOJob* ioSubmit(int kind, const char* name, Image img) {
+  IOJob* job = (IOJob*)calloc(1, sizeof(IOJob));
+  if (job == NULL) return NULL;
+  job->kind = kind;
+  job->name = name;
+  job->img = img;
+  pthread_mutex_lock(&iolock);
+  if (!iorunning) {
+    iorunning = pthread_create(&iothread, NULL, ioWorker, NULL) == 0;
+  }
+  if (iorunning) {
+    if (ioqueueTail != NULL) ioqueueTail->next = job; else ioqueue = job;
+    ioqueueTail = job;
+    pthread_cond_broadcast(&iocond);
+  }
+  pthread_mutex_unlock(&iolock);
+  if (!iorunning) {
+    ioRun(job);
+    job->done = 1;
+  }
+  return job;
+}
+
+// Wait for job to finish, and hand its counts over to this thread.
+// Returns the job success.
+static int ioWait(IOJob* job) {
+  pthread_mutex_lock(&iolock);
+  while (!job->done) pthread_cond_wait(&iocond, &iolock);
+  pthread_mutex_unlock(&iolock);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    InstrCount[i] += job->count[i];
+    job->count[i] = 0;
+  }
+  return job->ok;
+}
+
+// First save failure, reported at the end
+static IOJob failedSave;
+static int saveFailed = 0;
+
+// Collect save jobs that write img (all of them, if img == NULL).
+static void ioWaitImage(Image img) {
+  pthread_mutex_lock(&buflock);
+  IOJob** p = &iosaves;
+  while (*p != NULL) {
+    IOJob* job = *p;
+    if (img == NULL || job->img == img) {
+      if (!ioWait(job) && !saveFailed) {
+        failedSave = *job;
+        saveFailed = 1;
+      }
+      *p = job->link;
+      if (job->kind == IO_CACHE) free((char*)job->name);
+      free(job);
+    } else {
+      p = &job->link;
+    }
+  }
+  pthread_mutex_unlock(&buflock);
+}
+
+// Queue a save of img to file name (or to the cache file name, if kind is
+// IO_CACHE: name is then freed with the job).
+// Returns 0 on failure (nothing is queued).
+static int ioSave(Image img, const char* name, int kind) {
+  IOJob* job = ioSubmit(kind, name, img);
+  if (job == NULL) return 0;
+  pthread_mutex_lock(&buflock);
+  job->link = iosaves;
+  iosaves = job;
+  pthread_mutex_unlock(&buflock);
+  return 1;
+}
+
+// Prefetching of input FILEs
+static IOJob** prefetched = NULL;  // load jobs, by argument index
+static int prefetchDepth = 2;      // max number of files loaded ahead
+static int prefetchAhead = 0;      // files loaded ahead, not yet used
+static int prefetchScan = 1;       // next argument to look at
+static int prefetchLayout = 0;     // last layout step run (a prefetch barrier)
+
+// Check if av[k] is written by a save operation before argument k.
+static int savedBefore(int k, char* av[]) {
+  for (int j = 1; j < k; j++) {
+    int flags = opFlags(av[j]);
+    if ((flags & OPERAND) && j + 1 < k && strcmp(av[j], "save") == 0 &&
+        strcmp(av[j+1], av[k]) == 0) return 1;
+    if (flags & OPERAND) j++;
+  }
+  return 0;
+}
+
+// Queue loads of the next input FILEs, up to prefetchDepth ahead.
+// Files that an earlier save may write are not prefetched, and neither
+// are files after a layout step that has not run yet (they are loaded with
+// the layout in effect when the I/O thread gets to them).
+static void ioPrefetch(int ac, char* av[]) {
+  pthread_mutex_lock(&buflock);
+  while (prefetched != NULL && prefetchAhead < prefetchDepth && prefetchScan < ac) {
+    int k = prefetchScan;
+    if (strcmp(av[k], "layout") == 0 && k > prefetchLayout) break;
+    prefetchScan++;
+    int flags = opFlags(av[k]);
+    if (flags & OPERAND) prefetchScan++;
+    if ((flags & LOADS) && av[k][0] != '@' && !sharedArg(av[k]) && !savedBefore(k, av)) {
+      prefetched[k] = ioSubmit(IO_LOAD, av[k], NULL);
+      if (prefetched[k] != NULL) prefetchAhead++;
+    }
+  }
+  pthread_mutex_unlock(&buflock);
+}
+
+// Take the prefetched load job of av[k], or return NULL if there is none.
+static IOJob* prefetchTake(int k) {
+  pthread_mutex_lock(&buflock);
+  IOJob* job = prefetched[k];
+  if (job != NULL) {
+    prefetched[k] = NULL;
+    prefetchAhead--;
+  }
+  pthread_mutex_unlock(&buflock);
+  return job;
+}
+
+// Wait for all jobs and stop the I/O thread.
+static void ioFinish(void) {
+  ioWaitImage(NULL);
+  pthread_mutex_lock(&iolock);
+  ioquit = 1;
+  pthread_cond_broadcast(&iocond);
+  pthread_mutex_unlock(&iolock);
+  if (iorunning) pthread_join(iothread, NULL);
+  iorunning = 0;
+}
+
+
+// The image buffer
+//
+// Images are kept in a growable array of slots, indexed like I0, I1, ...
+// Resident pixel bytes are accounted against a memory budget.  When the
+// budget is exceeded, the least recently used images are spilled: saved to
+// a temporary PGM file (only if changed since last spilled) and destroyed.
+// A spilled image is brought back with ImageMap when next used, so only the
+// pages actually touched are read.
+// Images used by the current operation are never spilled, so the budget
+// may be exceeded by the working set of a single operation.
+
+typedef struct {
+  Image img;            // NULL while spilled
+  char* spill;          // spill file name, or NULL if never spilled
+  int dirty;            // img changed since it was last spilled
+  size_t bytes;         // pixel bytes
+  unsigned long used;   // tick of last use (for LRU)
+} Slot;
+
+static Slot* buf = NULL;
+static int nbuf = 0;            // number of images in buffer
+static int capbuf = 0;          // capacity of buf array
+static size_t budget = 0;       // memory budget (0 = unlimited)
+static size_t resident = 0;     // pixel bytes currently in memory
+static size_t peak = 0;         // maximum value of resident
+static unsigned long tick = 0;  // incremented for each operation
+static unsigned long nspills = 0, nreloads = 0;
+
+static size_t imageBytes(Image img) {
+  return (size_t)ImageWidth(img)*ImageHeight(img);
+}
+
+// Spill slot s to disk and release its image.  Returns 0 on failure.
+static int bufSpill(Slot* s) {
+  if (s->spill == NULL || s->dirty) {
+    // Always a new file: a reloaded image still maps the old one (see
+    // bufGet), and truncating that would fault on pages not yet read
+    const char* dir = getenv("TMPDIR");
+    if (dir == NULL) dir = "/tmp";
+    char* name = (char*)malloc(strlen(dir) + 32);
+    if (name == NULL) return 0;
+    sprintf(name, "%s/imageTool-XXXXXX", dir);
+    int fd = mkstemp(name);
+    if (fd < 0) { free(name); return 0; }
+    close(fd);
+    if (ImageSave(s->img, name) == 0) {
+      unlink(name);
+      free(name);
+      return 0;
+    }
+    if (s->spill != NULL) {
+      unlink(s->spill);  // (its mapping stays valid)
+      free(s->spill);
+    }
+    s->spill = name;
+    s->dirty = 0;
+    nspills++;
+  }
+  ioWaitImage(s->img);  // pending saves still read it
+  ImageDestroy(&s->img);
+  resident -= s->bytes;
+  return 1;
+}
+
+// Spill least recently used images until extra more bytes fit the budget.
+// Images used in the current tick are kept.
+static void bufFit(size_t extra) {
+  pthread_mutex_lock(&buflock);
+  while (budget > 0 && resident + extra > budget) {
+    Slot* lru = NULL;
+    for (int i = 0; i < nbuf; i++) {
+      Slot* s = &buf[i];
+      if (s->img != NULL && s->used != tick && (lru == NULL || s->used < lru->used))
+        lru = s;
+    }
+    if (lru == NULL || !bufSpill(lru)) break;  // over budget, but still works
+  }
+  pthread_mutex_unlock(&buflock);
+}
+
+// Get image i from the buffer, reloading it if it was spilled.
+// If write is nonzero, the image is about to be changed.
+// Returns NULL on failure.
+static Image bufGet(int i, int write) {
+  pthread_mutex_lock(&buflock);
+  assert (0 <= i && i < nbuf);
+  Slot* s = &buf[i];
+  s->used = tick;
+  if (s->img == NULL) {
+    bufFit(s->bytes);
+    s->img = ImageMap(s->spill);
+    if (s->img != NULL) {
+      resident += s->bytes;
+      if (resident > peak) peak = resident;
+      nreloads++;
+    }
+  }
+  if (write && s->img != NULL) {
+    ioWaitImage(s->img);  // pending saves must see the old pixels
+    s->dirty = 1;
+  }
+  Image img = s->img;
+  pthread_mutex_unlock(&buflock);
+  return img;
+}
+
+// Put img in slot i of the buffer: the next one (nbuf), unless steps run
+// concurrently, which fill their slots in any order.
+// Returns 0 on failure (img is destroyed).
+static int bufAppend(int i, Image img) {
+  pthread_mutex_lock(&buflock);
+  if (i >= capbuf) {
+    int c = (capbuf == 0) ? 16 : 2*capbuf;
+    while (c <= i) c *= 2;
+    Slot* nb = (Slot*)realloc(buf, c*sizeof(Slot));
+    if (nb == NULL) {
+      pthread_mutex_unlock(&buflock);
+      ImageDestroy(&img);
+      return 0;
+    }
+    buf = nb;
+    capbuf = c;
+  }
+  while (nbuf <= i) buf[nbuf++] = (Slot){ NULL, NULL, 0, 0, 0 };  // not yet filled
+  Slot* s = &buf[i];
+  *s = (Slot){ img, NULL, 1, imageBytes(img), tick };
+  resident += s->bytes;
+  if (resident > peak) peak = resident;
+  bufFit(0);
+  pthread_mutex_unlock(&buflock);
+  return 1;
+}
+
+// Destroy all images and remove spill files.
+static void bufClear(void) {
+  ioWaitImage(NULL);
+  while (nbuf > 0) {
+    Slot* s = &buf[--nbuf];
+    ImageDestroy(&s->img);
+    if (s->spill != NULL) {
+      unlink(s->spill);
+      free(s->spill);
+    }
+  }
+  free(buf);
+  buf = NULL;
+  capbuf = 0;
+  resident = 0;
+}
+
+// Take image i out of the buffer, to be changed and appended as a new image.
+// Slot i stays in the buffer, but must not be used again.
+// Returns NULL on failure.
+static Image bufTake(int i) {
+  pthread_mutex_lock(&buflock);
+  Image img = bufGet(i, 1);
+  if (img == NULL) {
+    pthread_mutex_unlock(&buflock);
+    return NULL;
+  }
+  Slot* s = &buf[i];
+  s->img = NULL;
+  resident -= s->bytes;
+  s->bytes = 0;
+  if (s->spill != NULL) {
+    unlink(s->spill);
+    free(s->spill);
+    s->spill = NULL;
+  }
+  pthread_mutex_unlock(&buflock);
+  return img;
+}
+
+// Replace image i of the buffer by img.
+static void bufReplace(int i, Image img) {
+  pthread_mutex_lock(&buflock);
+  Slot* s = &buf[i];
+  if (s->img != NULL) {
+    ioWaitImage(s->img);  // pending saves still read it
+    ImageDestroy(&s->img);
+    resident -= s->bytes;
+  }
+  s->img = img;
+  s->dirty = 1;
+  s->bytes = imageBytes(img);
+  s->used = tick;
+  resident += s->bytes;
+  if (resident > peak) peak = resident;
+  bufFit(0);
+  pthread_mutex_unlock(&buflock);
+}
+
+// Return a copy of img, or NULL on failure.
+static Image copyImage(Image img) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  Image copy = ImageCreate(w, h, ImageMaxval(img));
+  if (copy != NULL && w > 0 && h > 0) ImagePaste(copy, 0, 0, img);
+  return copy;
+}
+
+// Kept images
+//
+// Images kept by name (keep NAME) outlive the pipeline that created them,
+// which matters in server mode.  They are not part of the image buffer
+// and are never spilled.
+
+typedef struct {
+  char* name;
+  Image img;
+  ImageIndex idx;  // search index of img, or NULL
+} Kept;
+
+static Kept* kept = NULL;
+static int nkept = 0;
+
+// Find the entry kept as name, or return NULL.
+static Kept* keptEntry(const char* name) {
+  for (int i = 0; i < nkept; i++) {
+    if (strcmp(kept[i].name, name) == 0) return &kept[i];
+  }
+  return NULL;
+}
+
+// Find the image kept as name, or return NULL.
+static Image keptFind(const char* name) {
+  Kept* e = keptEntry(name);
+  return (e != NULL) ? e->img : NULL;
+}
+
+// Forget the image kept as name.  Returns 0 if there is none.
+static int keptDrop(const char* name) {
+  for (int i = 0; i < nkept; i++) {
+    if (strcmp(kept[i].name, name) == 0) {
+      ImageIndexDestroy(&kept[i].idx);
+      ImageDestroy(&kept[i].img);
+      free(kept[i].name);
+      kept[i] = kept[--nkept];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Keep img (not a copy) as name, replacing any image kept with that name.
+// Returns 0 on failure (img is destroyed).
+static int keptAdd(const char* name, Image img) {
+  keptDrop(name);
+  Kept* nk = (Kept*)realloc(kept, (nkept + 1)*sizeof(Kept));
+  char* nm = strdup(name);
+  if (nk != NULL) kept = nk;
+  if (nk == NULL || nm == NULL) {
+    free(nm);
+    ImageDestroy(&img);
+    return 0;
+  }
+  kept[nkept++] = (Kept){ nm, img, NULL };
+  return 1;
+}
+
+
+// Parse a size in bytes, with optional k, M or G suffix.
+// Returns 1 on success, 0 on failure.
+static int parseBytes(const char* str, size_t* bytes) {
+  double v;
+  char suffix = '\0';
+  if (sscanf(str, "%lf%c", &v, &suffix) < 1 || v < 0) return 0;
+  switch (suffix) {
+    case '\0': break;
+    case 'k': case 'K': v *= 1024.0; break;
+    case 'm': case 'M': v *= 1024.0*1024.0; break;
+    case 'g': case 'G': v *= 1024.0*1024.0*1024.0; break;
+    default: return 0;
+  }
+  *bytes = (size_t)v;
+  return 1;
+}
+
 
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
@@ -85,6 +955,1174 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
+// Run the operation at av[k] (and its operand, if any), with n images in
+// the buffer before it.  Text output goes to out and messages to msg.
+// Returns 0 on success, or an index into errors[] on failure (see
+// runPipeline).
+static int runStep(int k, int n, int ac, char* av[], FILE* out, FILE* msg,
+                   const char** errmsg) {
+  int x, y, w, h;
+  Image cur, pred;
+
+  if (strcmp(av[k], "info") == 0) {
+    if (n < 1) return 2;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Info on I%d\n", n-1);
+    uint8 min, max;
+    w = ImageWidth(cur);
+    h = ImageHeight(cur);
+    uint8 maxval = ImageMaxval(cur);
+    ImageStats(cur, &min, &max);
+    fprintf(out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+    fprintf(out, "# Gray level range: [%hhu, %hhu]\n", min, max);
+  } else if (strcmp(av[k], "tic") == 0) {
+    InstrGetCTU();  // calibrate now, if needed, not while timing
+    InstrReset();
+  } else if (strcmp(av[k], "profile") == 0) {
+    InstrEnableRegions(1);
+  } else if (strcmp(av[k], "kernels") == 0) {
+    if (++k >= ac) return 1;
+    if (!ImageSetKernels(av[k])) return 5;
+    fprintf(msg, "Using %s kernels\n", ImageKernels());
+  } else if (strcmp(av[k], "selftest") == 0) {
+    fprintf(msg, "Testing kernels\n");
+    if (!ImageKernelSelfTest(10000)) return 10;
+    fprintf(out, "# Kernels: %s (self-test passed)\n", ImageKernels());
+  } else if (strcmp(av[k], "trace") == 0) {
+    if (++k >= ac) return 1;
+    if (!InstrTraceStart(av[k])) { *errmsg = av[k]; return 11; }
+  } else if (strcmp(av[k], "recalibrate") == 0) {
+    InstrCalibrate();
+    fprintf(msg, "Calibrated time unit: %g s\n", InstrCTU);
+  } else if (strcmp(av[k], "toc") == 0) {
+    InstrPrint();
+  } else if (strcmp(av[k], "budget") == 0) {
+    if (++k >= ac) return 1;
+    if (!parseBytes(av[k], &budget)) return 5;
+    fprintf(msg, "Setting memory budget to %zu bytes\n", budget);
+    bufFit(0);
+  } else if (strcmp(av[k], "memstat") == 0) {
+    fprintf(out, "# Images: %d\n# Resident: %zu bytes\n# Peak resident: %zu bytes\n",
+            nbuf, resident, peak);
+    fprintf(out, "# Budget: %zu bytes\n# Spills: %lu\n# Reloads: %lu\n",
+            budget, nspills, nreloads);
+  } else if (strcmp(av[k], "keep") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Keeping I%d as %s\n", n-1, av[k]);
+    Image img = copyImage(cur);
+    if (img == NULL || !keptAdd(av[k], img)) return 4;
+  } else if (strcmp(av[k], "drop") == 0) {
+    if (++k >= ac) return 1;
+    fprintf(msg, "Dropping %s\n", av[k]);
+    if (!keptDrop(av[k])) return 9;
+  } else if (strcmp(av[k], "layout") == 0) {
+    if (++k >= ac) return 1;
+    if (strcmp(av[k], "raster") == 0) ImageSetLayout(LAYOUT_RASTER);
+    else if (strcmp(av[k], "tiled") == 0) ImageSetLayout(LAYOUT_TILED);
+    else if (strcmp(av[k], "morton") == 0) ImageSetLayout(LAYOUT_MORTON);
+    else return 5;
+    fprintf(msg, "Setting pixel layout to %s\n", av[k]);
+    pthread_mutex_lock(&buflock);
+    prefetchLayout = k - 1;
+    pthread_mutex_unlock(&buflock);
+    ioPrefetch(ac, av);  // (files after it were held back)
+  } else if (strcmp(av[k], "neg") == 0) {
+    if (n < 1) return 2;
+    if ((cur = bufGet(n-1, 1)) == NULL) return 4;
+    fprintf(msg, "Negating I%d\n", n-1);
+    ImageNegative(cur);
+  } else if (strcmp(av[k], "thr") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    uint8 thr;
+    if (sscanf(av[k], "%hhu", &thr) != 1) return 5;
+    if ((cur = bufGet(n-1, 1)) == NULL) return 4;
+    fprintf(msg, "Thresholding I%d at %d\n", n-1, thr);
+    ImageThreshold(cur, (uint8)thr);
+  } else if (strcmp(av[k], "bri") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    double factor;
+    if (sscanf(av[k], "%lf", &factor) != 1) return 5;
+    if ((cur = bufGet(n-1, 1)) == NULL) return 4;
+    fprintf(msg, "Brightening I%d by %lf\n", n-1, factor);
+    ImageBrighten(cur, factor);
+  } else if (strcmp(av[k], "create") == 0) {
+    if (++k >= ac) return 1;
+    if (sscanf(av[k], "%d,%d", &w, &h) != 2) return 5;
+    if (w < 0 || h < 0) return 5;   // precondition check!
+    fprintf(msg, "Creating black image (%d,%d) -> I%d\n", w, h, n);
+    bufFit((size_t)w*h);
+    Image img = ImageCreate(w, h, PixMax);
+    if (img == NULL) return 4;
+    if (!bufAppend(n, img)) return 3;
+  } else if (strcmp(av[k], "rotate") == 0) {
+    if (n < 1) return 2;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    Image img;
+    if (ImageWidth(cur) == ImageHeight(cur) && !currUsedAfter(k, ac, av)) {
+      fprintf(msg, "Rotating I%d -> I%d (in-place)\n", n-1, n);
+      if ((img = bufTake(n-1)) == NULL) return 4;
+      ImageRotateInPlace(img);
+    } else {
+      fprintf(msg, "Rotating I%d -> I%d\n", n-1, n);
+      bufFit(imageBytes(cur));
+      img = ImageRotate(cur);
+      if (img == NULL) return 4;
+    }
+    if (!bufAppend(n, img)) return 3;
+  } else if (strcmp(av[k], "rotateby") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    double deg;
+    char mname[16] = "bilinear";
+    ResizeMethod method;
+    if (sscanf(av[k], "%lf,%15s", &deg, mname) < 1) return 5;
+    if (!parseMethod(mname, &method) || method == RESIZE_AREA) return 5;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Rotating I%d by %g degrees %s -> I%d\n", n-1, deg, mname, n);
+    bufFit(imageBytes(cur));
+    Image img = ImageRotateAngle(cur, deg, method);
+    if (img == NULL) return 4;
+    if (!bufAppend(n, img)) return 3;
+  } else if (strcmp(av[k], "warp") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    double m[6];
+    char mname[16] = "bilinear";
+    ResizeMethod method;
+    if (sscanf(av[k], "%lf,%lf,%lf,%lf,%lf,%lf,%15s", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], mname) < 6) return 5;
+    if (!parseMethod(mname, &method) || method == RESIZE_AREA) return 5;
+    if (m[0]*m[4] - m[1]*m[3] == 0.0) return 5;   // precondition check!
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Warping I%d %s -> I%d\n", n-1, mname, n);
+    bufFit(imageBytes(cur));
+    Image img = ImageWarpAffine(cur, ImageWidth(cur), ImageHeight(cur), m, method);
+    if (img == NULL) return 4;
+    if (!bufAppend(n, img)) return 3;
+  } else if (strcmp(av[k], "mirror") == 0 || strcmp(av[k], "flip") == 0 ||
+             strcmp(av[k], "rotate180") == 0) {
+    if (n < 1) return 2;
+    const char* what = (av[k][0] == 'm') ? "Mirroring" : (av[k][0] == 'f') ? "Flipping" : "Rotating 180º";
+    Image img;
+    if (!currUsedAfter(k, ac, av)) {
+      fprintf(msg, "%s I%d -> I%d (in-place)\n", what, n-1, n);
+      if ((img = bufTake(n-1)) == NULL) return 4;
+    } else {
+      if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+      fprintf(msg, "%s I%d -> I%d\n", what, n-1, n);
+      bufFit(imageBytes(cur));
+      img = copyImage(cur);
+      if (img == NULL) return 4;
+    }
+    if (av[k][0] == 'm') ImageMirrorInPlace(img);
+    else if (av[k][0] == 'f') ImageFlipInPlace(img);
+    else ImageRotate180InPlace(img);
+    if (!bufAppend(n, img)) return 3;
+  } else if (strcmp(av[k], "crop") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) return 5;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    if (!ImageValidRect(cur, x, y, w, h)) return 5;   // precondition check!
+    fprintf(msg, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+    bufFit((size_t)w*h);
+    Image img = ImageCrop(cur, x, y, w, h);
+    if (img == NULL) return 4;
+    if (!bufAppend(n, img)) return 3;
+  } else if (strcmp(av[k], "resize") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    char mname[16] = "bilinear";
+    if (sscanf(av[k], "%d,%d,%15s", &w, &h, mname) < 2) return 5;
+    ResizeMethod method;
+    if (!parseMethod(mname, &method)) return 5;
+    if (w <= 0 || h <= 0) return 5;   // precondition check!
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    if (ImageWidth(cur) == 0 || ImageHeight(cur) == 0) return 5;
+    fprintf(msg, "Resizing I%d to (%d,%d) %s -> I%d\n", n-1, w, h, mname, n);
+    bufFit((size_t)w*h);
+    Image img = ImageResize(cur, w, h, method);
+    if (img == NULL) return 4;
+    if (!bufAppend(n, img)) return 3;
+  } else if (strcmp(av[k], "paste") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 2) return 2;
+    if (sscanf(av[k], "%d,%d", &x, &y) != 2) return 5;
+    if ((cur = bufGet(n-1, 1)) == NULL || (pred = bufGet(n-2, 0)) == NULL) return 4;
+    w = ImageWidth(pred);
+    h = ImageHeight(pred);
+    if (!ImageValidRect(cur, x, y, w, h)) return 6;
+    fprintf(msg, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+    ImagePaste(cur, x, y, pred);
+  } else if (strcmp(av[k], "pastemany") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    if ((cur = bufGet(n-1, 1)) == NULL) return 4;
+    ioWaitImage(NULL);  // tiles may be written by pending saves
+    fprintf(msg, "Pasting placements in %s at I%d\n", av[k], n-1);
+    return pasteMany(cur, av[k]);
+  } else if (strcmp(av[k], "blend") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 2) return 2;
+    double alpha;
+    if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) return 5;
+    if ((cur = bufGet(n-1, 1)) == NULL || (pred = bufGet(n-2, 0)) == NULL) return 4;
+    w = ImageWidth(pred);
+    h = ImageHeight(pred);
+    if (!ImageValidRect(cur, x, y, w, h)) return 6;
+    fprintf(msg, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+    ImageBlend(cur, x, y, pred, alpha);
+  } else if (strcmp(av[k], "locate") == 0) {
+    if (n < 2) return 2;
+    if ((cur = bufGet(n-1, 0)) == NULL || (pred = bufGet(n-2, 0)) == NULL) return 4;
+    fprintf(msg, "Locating I%d in I%d\n", n-2, n-1);
+    if (ImageLocateSubImage(cur, &x, &y, pred)) {
+      fprintf(out, "# FOUND (%d,%d)\n", x, y);
+    } else {
+      fprintf(out, "# NOTFOUND\n");
+    }
+  } else if (strcmp(av[k], "index") == 0) {
+    if (++k >= ac) return 1;
+    // NAME,K[,FILE]
+    char name[256];
+    int bk, len = 0;
+    if (sscanf(av[k], "%255[^,],%d%n", name, &bk, &len) != 2 || bk < 1 ||
+        (av[k][len] != '\0' && av[k][len] != ',')) return 5;
+    const char* file = (av[k][len] == ',') ? av[k] + len + 1 : NULL;
+    Kept* e = keptEntry(name);
+    if (e == NULL) return 9;
+    ImageIndexDestroy(&e->idx);
+    if (file != NULL && (e->idx = ImageIndexLoad(file, e->img, bk)) != NULL) {
+      fprintf(msg, "Loaded index of %s from %s\n", name, file);
+    } else {
+      errno = 0;  // (a missing or stale index file is no error)
+      fprintf(msg, "Indexing %s with %dx%d blocks\n", name, bk, bk);
+      if ((e->idx = ImageIndexCreate(e->img, bk)) == NULL) return 4;
+      if (file != NULL && !ImageIndexSave(e->idx, file)) return 4;
+    }
+  } else if (strcmp(av[k], "locatein") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    Kept* e = keptEntry(av[k]);
+    if (e == NULL) return 9;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Locating I%d in %s%s\n", n-1, av[k],
+            (e->idx != NULL) ? " (indexed)" : "");
+    int found = (e->idx != NULL) ? ImageIndexLocate(e->idx, &x, &y, cur)
+                                 : ImageLocateSubImage(e->img, &x, &y, cur);
+    if (found < 0) return 4;
+    if (found) {
+      fprintf(out, "# FOUND (%d,%d)\n", x, y);
+    } else {
+      fprintf(out, "# NOTFOUND\n");
+    }
+  } else if (strcmp(av[k], "pasteinto") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    // NAME,X,Y
+    char name[256];
+    if (sscanf(av[k], "%255[^,],%d,%d", name, &x, &y) != 3) return 5;
+    Kept* e = keptEntry(name);
+    if (e == NULL) return 9;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    if (!ImageValidRect(e->img, x, y, ImageWidth(cur), ImageHeight(cur))) return 6;
+    fprintf(msg, "Pasting I%d into %s at (%d,%d)\n", n-1, name, x, y);
+    ImagePaste(e->img, x, y, cur);
+  } else if (strcmp(av[k], "blur") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    int dx; int dy;
+    if (sscanf(av[k], "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) return 5;
+    if ((cur = bufGet(n-1, 1)) == NULL) return 4;
+    fprintf(msg, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+    ImageBlur(cur, dx, dy);
+  } else if (strcmp(av[k], "count") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    uint8 thr;
+    if (sscanf(av[k], "%hhu", &thr) != 1) return 5;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Counting I%d at %d\n", n-1, thr);
+    BitImage b = ImageThresholdBits(cur, thr);
+    if (b == NULL) return 4;
+    fprintf(out, "# Count: %lu of %lu pixels\n", BitImageCount(b),
+            (unsigned long)ImageWidth(cur)*ImageHeight(cur));
+    BitImageDestroy(&b);
+  } else if (strcmp(av[k], "label") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    uint8 thr;
+    if (sscanf(av[k], "%hhu", &thr) != 1) return 5;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Labeling I%d at %d\n", n-1, thr);
+    BitImage b = ImageThresholdBits(cur, thr);
+    ImageComponent* comps;
+    int nc = (b != NULL) ? ImageLabel(b, 8, &comps) : -1;
+    BitImageDestroy(&b);
+    if (nc < 0) return 4;
+    fprintf(out, "# Components: %d\n", nc);
+    for (int i = 0; i < nc; i++) {
+      fprintf(out, "# %d: area %lu, box %d,%d,%d,%d\n", i, comps[i].area,
+              comps[i].x, comps[i].y, comps[i].w, comps[i].h);
+    }
+    free(comps);
+  } else if (strcmp(av[k], "savepbm") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Saving %s <- I%d as bitmap\n", av[k], n-1);
+    ioWaitImage(NULL);  // the file may be written by pending saves
+    BitImage b = ImageThresholdBits(cur, 1);
+    int ok = b != NULL && BitImageSave(b, av[k]);
+    BitImageDestroy(&b);
+    if (!ok) return 4;
+  } else if (strcmp(av[k], "save") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Saving %s <- I%d\n", av[k], n-1);
+    if (!ioSave(cur, av[k], IO_SAVE)) return 4;
+  } else if (strcmp(av[k], "export") == 0) {
+    if (++k >= ac) return 1;
+    if (n < 1) return 2;
+    if ((cur = bufGet(n-1, 0)) == NULL) return 4;
+    fprintf(msg, "Exporting I%d as shm:%s\n", n-1, av[k]);
+    unsigned long gen = ImageExportShared(cur, av[k]);
+    if (gen == 0) return 4;
+    fprintf(out, "# Generation: %lu\n", gen);
+  } else if (strcmp(av[k], "unexport") == 0) {
+    if (++k >= ac) return 1;
+    fprintf(msg, "Removing shm:%s\n", av[k]);
+    if (!ImageRemoveShared(av[k])) return 4;
+  } else {  // image file
+    fprintf(msg, "Loading %s -> I%d\n", av[k], n);
+    Image img;
+    IOJob* job = prefetchTake(k);
+    if (av[k][0] == '@') {  // kept image
+      Image kimg = keptFind(av[k] + 1);
+      if (kimg == NULL) return 9;
+      bufFit(imageBytes(kimg));
+      img = copyImage(kimg);
+    } else if (sharedArg(av[k])) {
+      img = ImageAttachShared(av[k] + 4, NULL);
+    } else if (job != NULL) {  // collect prefetched image
+      img = ioWait(job) ? job->img : NULL;
+      if (img == NULL) { errno = job->errnum; *errmsg = job->errmsg; }
+      free(job);
+      ioPrefetch(ac, av);
+    } else {
+      ioWaitImage(NULL);  // the file may be written by pending saves
+      img = ImageLoad(av[k]);
+    }
+    if (img == NULL) return 4;
+    if (!bufAppend(n, img)) return 3;
+  }
+  return 0;
+}
+
+// Mix hash value b into a.
+static uint64_t hashMix(uint64_t a, uint64_t b) {
+  a = (a ^ b) * 0x9E3779B97F4A7C15ull;
+  return a ^ (a >> 29);
+}
+
+static uint64_t hashString(const char* str) {  // (FNV-1a)
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (; *str != '\0'; str++) h = (h ^ (uint8)*str) * 0x100000001B3ull;
+  return h;
+}
+
+// Run the operation at av[k] like runStep, but get its result from the
+// result cache if it is there, and put it there if it is not.
+// Only operations that compute an image from CURR (and PRED) are cached.
+static int runCached(int k, int n, int ac, char* av[], FILE* out, FILE* msg,
+                     const char** errmsg) {
+  int flags = opFlags(av[k]);
+  int cacheable = cacheDir != NULL && (flags & READS_CURR) &&
+                  (flags & (WRITES_CURR | APPENDS)) &&
+                  !(flags & (GLOBAL | LOADS | SAVES)) &&
+                  n >= ((flags & READS_PRED) ? 2 : 1) &&
+                  (!(flags & OPERAND) || k + 1 < ac);
+  if (!cacheable) return runStep(k, n, ac, av, out, msg, errmsg);
+
+  Image cur = bufGet(n-1, 0);
+  if (cur == NULL) return 4;
+  uint64_t key = hashMix(hashString(av[k]), ImageHash(cur));
+  if (flags & READS_PRED) {
+    Image pred = bufGet(n-2, 0);
+    if (pred == NULL) return 4;
+    key = hashMix(key, ImageHash(pred));
+  }
+  if (flags & OPERAND) key = hashMix(key, hashString(av[k+1]));
+
+  int r = (flags & APPENDS) ? n : n-1;  // slot of the result
+  Image img = cacheLoad(key);
+  if (img != NULL) {
+    CACHEHITS++;
+    fprintf(msg, "Using cached result of %s -> I%d\n", av[k], r);
+    if (flags & APPENDS) {
+      if (!bufAppend(r, img)) return 3;
+    } else {
+      bufReplace(r, img);
+    }
+    return 0;
+  }
+  CACHEMISSES++;
+  int err = runStep(k, n, ac, av, out, msg, errmsg);
+  if (err == 0 && (img = bufGet(r, 0)) != NULL) {
+    char* path = (char*)malloc(PATH_MAX);
+    if (path != NULL) {
+      cachePath(key, path);
+      if (!ioSave(img, path, IO_CACHE)) free(path);
+    }
+  }
+  return err;
+}
+
+// Concurrent steps
+//
+// Steps of a pipeline that use different images are independent, and may
+// run at the same time.  The pipeline is planned from the arguments alone:
+// the buffer slots and files each step reads and writes are known, and each
+// step waits for the earlier steps it conflicts with.  Steps that use global
+// state (settings, instrumentation, kept images, ...) are barriers: they
+// wait for all earlier steps, and all later steps wait for them.
+//
+// Ready steps run on a pool of workers (the main thread, and jobs-1 more).
+// Each worker has deques of tasks: it pushes and pops its own at the
+// bottom, and steals from the top of the others' deques when it has none.
+// A finished step pushes the steps it releases to its own deque, so they
+// tend to run where their images are still in cache.  The chunks of
+// parallel operations (see ImageSetExecutor) are tasks too, and a worker
+// waiting for the chunks of its step runs or steals chunks (never whole
+// steps) meanwhile.  Tasks are coarse (whole steps, and a few chunks each),
+// so a single lock protects the pool.
+//
+// The text output and messages of each step are buffered, and printed in
+// order of the arguments as soon as all earlier steps are done, so output is
+// the same as if steps ran one after another.  After a step fails, later
+// steps are not started and their output is dropped.  Barriers run in the
+// main thread, after the instrumentation counts of all earlier steps are
+// handed over to it.
+
+typedef struct {
+  int k;             // argument index of the operation
+  int n;             // number of images in the buffer before it
+  int barrier;       // uses global state?
+  int read[2];       // slots it reads (or -1)
+  int write;         // slot it changes, or may take in-place (or -1)
+  int append;        // slot it appends (or -1)
+  const char* file;  // file it loads or saves (or NULL)
+  int saves;         // does it write file?
+  int waiting;       // earlier conflicting steps not yet done
+  int done;
+  int err;           // result of runStep
+  int errnum;        // errno on failure
+  const char* errmsg;  // error cause on failure
+  char* out;         // buffered text output
+  size_t outlen;
+  char* msg;         // buffered messages
+  size_t msglen;
+  unsigned long count[NUMCOUNTERS];  // instrumentation counts, if not in main
+} Step;
+
+// Check if steps a and b (in any order) must not run at the same time.
+static int stepsConflict(const Step* a, const Step* b) {
+  if (a->barrier || b->barrier) return 1;
+  if (a->file != NULL && b->file != NULL && (a->saves || b->saves) &&
+      strcmp(a->file, b->file) == 0) return 1;
+  int wa[2] = { a->write, a->append };
+  int wb[2] = { b->write, b->append };
+  for (int i = 0; i < 2; i++) {
+    if (wa[i] >= 0 && (wa[i] == b->read[0] || wa[i] == b->read[1] ||
+                       wa[i] == wb[0] || wa[i] == wb[1])) return 1;
+    if (wb[i] >= 0 && (wb[i] == a->read[0] || wb[i] == a->read[1])) return 1;
+  }
+  return 0;
+}
+
+// Plan the steps of the pipeline in av[1..ac-1], with n images in the
+// buffer before it.  Returns an array of *nsteps steps, or NULL on failure,
+// or if the pipeline sets a memory budget (steps run concurrently could
+// spill each other's images).
+static Step* planSteps(int ac, char* av[], int n, int* nsteps) {
+  Step* steps = (Step*)calloc(ac, sizeof(Step));
+  if (steps == NULL) return NULL;
+  int ns = 0;
+  for (int k = 1; k < ac; k += (opFlags(av[k]) & OPERAND) ? 2 : 1) {
+    int flags = opFlags(av[k]);
+    if (strcmp(av[k], "budget") == 0) { free(steps); return NULL; }
+    Step* s = &steps[ns++];
+    *s = (Step){ .k = k, .n = n, .read = { -1, -1 }, .write = -1, .append = -1 };
+    s->barrier = (flags & GLOBAL) || ((flags & LOADS) && (av[k][0] == '@' || sharedArg(av[k])));
+    if ((flags & READS_CURR) && n >= 1) s->read[0] = n-1;
+    if ((flags & READS_PRED) && n >= 2) s->read[1] = n-2;
+    if ((flags & WRITES_CURR) && n >= 1 &&
+        !((flags & APPENDS) && currUsedAfter(k, ac, av))) s->write = n-1;
+    if (flags & APPENDS) s->append = n++;
+    if (flags & LOADS) s->file = av[k];
+    if ((flags & SAVES) && k + 1 < ac) {
+      s->file = av[k+1];
+      s->saves = 1;
+    }
+    for (int i = 0; i < ns - 1; i++) s->waiting += stepsConflict(&steps[i], s);
+  }
+  *nsteps = ns;
+  return steps;
+}
+
+// A task: chunk i of a parallel operation, or step i if fn is NULL
+typedef struct {
+  void (*fn)(void* arg, int i);
+  void* arg;
+  int i;
+  int* left;    // chunks of the operation not yet done
+} Task;
+
+typedef struct {
+  Task* t;
+  int top, bottom, cap;   // tasks are t[top..bottom-1]
+} Deque;
+
+// Push t at the bottom of d.  Returns 0 on failure.
+static int dqPush(Deque* d, Task t) {
+  if (d->bottom == d->cap) {
+    if (d->top > 0) {
+      memmove(d->t, d->t + d->top, (d->bottom - d->top)*sizeof(Task));
+      d->bottom -= d->top;
+      d->top = 0;
+    } else {
+      int c = (d->cap == 0) ? 16 : 2*d->cap;
+      Task* nt = (Task*)realloc(d->t, c*sizeof(Task));
+      if (nt == NULL) return 0;
+      d->t = nt;
+      d->cap = c;
+    }
+  }
+  d->t[d->bottom++] = t;
+  return 1;
+}
+
+// Pop *t from the bottom (the owner's end) or the top (thieves' end) of d.
+// Returns 0 if d is empty.
+static int dqTake(Deque* d, Task* t, int top) {
+  if (d->top == d->bottom) return 0;
+  *t = top ? d->t[d->top++] : d->t[--d->bottom];
+  if (d->top == d->bottom) d->top = d->bottom = 0;
+  return 1;
+}
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;   // tasks pushed, or done
+  int nworkers;
+  Deque* steps;          // ready steps of each worker
+  Deque* chunks;         // chunks of each worker
+  Step* s;               // the steps of the pipeline
+  int ns;
+  int ac;
+  char** av;
+  int running;           // steps being run
+  int barrier;           // ready barrier step, or -1
+  int failed;            // first failed step, or ns
+  int emitted;           // steps whose output was printed
+  unsigned long count[NUMCOUNTERS];  // counts of steps, for the main thread
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int jobs = 1;                     // number of workers
+static _Thread_local int workerId = -1;  // in the pool (the main thread is 0)
+
+// Take a task from worker id's deque in dq, or steal one from another's.
+// Returns 0 if there is none.  The pool is locked.
+static int poolTake(Deque* dq, int id, Task* t) {
+  if (dqTake(&dq[id], t, 0)) return 1;
+  for (int j = 1; j < pool.nworkers; j++) {
+    if (dqTake(&dq[(id + j) % pool.nworkers], t, 1)) return 1;
+  }
+  return 0;
+}
+
+// Take a step that may still run (not after a failed one).
+// Returns its index, or -1 if there is none.  The pool is locked.
+static int poolTakeStep(int id) {
+  Task t;
+  while (poolTake(pool.steps, id, &t)) {
+    if (t.i < pool.failed) return t.i;
+  }
+  return -1;
+}
+
+// Run chunk task t.  The pool is locked (and unlocked meanwhile).
+static void poolChunk(Task* t) {
+  pthread_mutex_unlock(&pool.lock);
+  t->fn(t->arg, t->i);
+  pthread_mutex_lock(&pool.lock);
+  if (--*t->left == 0) pthread_cond_broadcast(&pool.cond);
+}
+
+// Executor of the chunks of parallel operations run by workers (see
+// ImageSetExecutor).  Other threads (the I/O thread, say) are left to the
+// library.
+static int poolExec(void* ctx, int n, void (*task)(void* arg, int i), void* arg) {
+  (void)ctx;
+  int id = workerId;
+  if (id < 0) return 0;
+  int left = n;
+  pthread_mutex_lock(&pool.lock);
+  for (int i = n - 1; i > 0; i--) {
+    Task t = { task, arg, i, &left };
+    if (!dqPush(&pool.chunks[id], t)) poolChunk(&t);
+  }
+  pthread_cond_broadcast(&pool.cond);
+  pthread_mutex_unlock(&pool.lock);
+  task(arg, 0);
+  pthread_mutex_lock(&pool.lock);
+  left--;
+  Task t;
+  while (left > 0) {
+    if (poolTake(pool.chunks, id, &t)) poolChunk(&t);
+    else pthread_cond_wait(&pool.cond, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return 1;
+}
+
+// Run step i.  Barriers write their output directly, other steps buffer it.
+static void stepRun(int i) {
+  Step* s = &pool.s[i];
+  FILE* out = stdout;
+  FILE* msg = stderr;
+  if (!s->barrier) {
+    out = open_memstream(&s->out, &s->outlen);
+    msg = open_memstream(&s->msg, &s->msglen);
+  }
+  unsigned long before[NUMCOUNTERS];
+  memcpy(before, InstrCount, sizeof(before));
+  errno = 0;
+  if (out == NULL || msg == NULL) {
+    s->err = 3;
+  } else {
+    InstrBegin((opFlags(pool.av[s->k]) & LOADS) ? "load" : pool.av[s->k]);
+    s->err = runCached(s->k, s->n, pool.ac, pool.av, out, msg, &s->errmsg);
+    InstrEnd();
+  }
+  s->errnum = errno;
+  if (s->err != 0 && s->errmsg == NULL) s->errmsg = ImageErrMsg();
+  if (!s->barrier) {
+    if (out != NULL) fclose(out);
+    if (msg != NULL) fclose(msg);
+  }
+  if (workerId != 0) {
+    for (int c = 0; c < NUMCOUNTERS; c++) s->count[c] = InstrCount[c] - before[c];
+  }
+}
+
+static void stepDone(int i, int id);
+
+// Make step i ready to run, by worker id.  The pool is locked.
+static void stepReady(int i, int id) {
+  Step* s = &pool.s[i];
+  if (s->barrier) {
+    pool.barrier = i;
+  } else if (!dqPush(&pool.steps[id], (Task){ NULL, NULL, i, NULL })) {
+    s->err = 3;
+    s->errnum = errno;
+    pool.running++;
+    stepDone(i, id);
+  }
+  pthread_cond_broadcast(&pool.cond);
+}
+
+// Step i was run by worker id: print the output of steps done in order,
+// and release the steps waiting for it.  The pool is locked.
+static void stepDone(int i, int id) {
+  Step* s = &pool.s[i];
+  s->done = 1;
+  pool.running--;
+  if (s->err != 0 && i < pool.failed) pool.failed = i;
+  while (pool.emitted < pool.ns && pool.emitted <= pool.failed &&
+         pool.s[pool.emitted].done) {
+    Step* e = &pool.s[pool.emitted++];
+    if (e->msg != NULL) fwrite(e->msg, 1, e->msglen, stderr);
+    if (e->out != NULL) fwrite(e->out, 1, e->outlen, stdout);
+    free(e->msg);
+    free(e->out);
+    e->msg = e->out = NULL;
+    for (int c = 0; c < NUMCOUNTERS; c++) pool.count[c] += e->count[c];
+  }
+  for (int j = i + 1; j < pool.failed; j++) {
+    Step* t = &pool.s[j];
+    if (!t->done && stepsConflict(s, t) && --t->waiting == 0) stepReady(j, id);
+  }
+  pthread_cond_broadcast(&pool.cond);
+}
+
+// Work as worker id until no step is running or ready.  The pool is locked.
+static void poolWork(int id) {
+  Task t;
+  int i;
+  for (;;) {
+    if (poolTake(pool.chunks, id, &t)) {
+      poolChunk(&t);
+      continue;
+    }
+    if (id == 0 && pool.barrier >= 0) {
+      i = pool.barrier;
+      pool.barrier = -1;
+      for (int c = 0; c < NUMCOUNTERS; c++) {
+        InstrCount[c] += pool.count[c];
+        pool.count[c] = 0;
+      }
+    } else if ((i = poolTakeStep(id)) < 0) {
+      if (pool.running == 0 && pool.barrier < 0) break;
+      pthread_cond_wait(&pool.cond, &pool.lock);
+      continue;
+    }
+    pool.running++;
+    pthread_mutex_unlock(&pool.lock);
+    stepRun(i);
+    pthread_mutex_lock(&pool.lock);
+    stepDone(i, id);
+  }
+}
+
+static void* poolWorker(void* arg) {
+  workerId = (int)(intptr_t)arg;
+  pthread_mutex_lock(&pool.lock);
+  poolWork(workerId);
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+// Run the pipeline in av[1..ac-1] on a pool of jobs workers.
+// Returns like runPipeline, or -1 if it cannot be planned (nothing is run).
+static int schedRun(int ac, char* av[], const char** errmsg) {
+  int ns;
+  Step* steps = planSteps(ac, av, nbuf, &ns);
+  pool.steps = (Deque*)calloc(jobs, sizeof(Deque));
+  pool.chunks = (Deque*)calloc(jobs, sizeof(Deque));
+  pthread_t* tid = (pthread_t*)malloc(jobs*sizeof(pthread_t));
+  if (steps == NULL || pool.steps == NULL || pool.chunks == NULL || tid == NULL) {
+    free(steps);
+    free(pool.steps);
+    free(pool.chunks);
+    free(tid);
+    return -1;
+  }
+  pool.s = steps;
+  pool.ns = ns;
+  pool.ac = ac;
+  pool.av = av;
+  pool.running = 0;
+  pool.barrier = -1;
+  pool.failed = ns;
+  pool.emitted = 0;
+  memset(pool.count, 0, sizeof(pool.count));
+
+  pthread_mutex_lock(&pool.lock);
+  workerId = 0;
+  pool.nworkers = 1;
+  while (pool.nworkers < jobs &&
+         pthread_create(&tid[pool.nworkers], NULL, poolWorker,
+                        (void*)(intptr_t)pool.nworkers) == 0) {
+    pool.nworkers++;
+  }
+  ImageSetExecutor(poolExec, NULL);
+  for (int i = ns - 1; i >= 0; i--) {  // the first step is popped first
+    if (steps[i].waiting == 0) stepReady(i, 0);
+  }
+  poolWork(0);
+  pthread_mutex_unlock(&pool.lock);
+  for (int w = 1; w < pool.nworkers; w++) pthread_join(tid[w], NULL);
+  ImageSetExecutor(NULL, NULL);
+  workerId = -1;
+  for (int c = 0; c < NUMCOUNTERS; c++) InstrCount[c] += pool.count[c];
+
+  int err = 0;
+  if (pool.failed < ns) {
+    Step* f = &steps[pool.failed];
+    err = f->err;
+    errno = f->errnum;
+    *errmsg = f->errmsg;
+  }
+  for (int i = 0; i < ns; i++) {  // output of steps after a failure
+    free(steps[i].out);
+    free(steps[i].msg);
+  }
+  for (int w = 0; w < jobs; w++) {
+    free(pool.steps[w].t);
+    free(pool.chunks[w].t);
+  }
+  free(pool.steps);
+  free(pool.chunks);
+  free(tid);
+  free(steps);
+  pool.s = NULL;
+  return err;
+}
+
+// Run the pipeline of operations in av[1..ac-1].
+// Returns 0 on success, or an index into errors[] on failure.  On failure,
+// *errmsg may be set to the error cause (otherwise see ImageErrMsg()).
+// If result is not NULL, CURR is taken out of the buffer into *result (and
+// I0 into *input, if it is still in memory and is not CURR) before the
+// buffer is cleared.  Both are set to NULL if there is no such image.
+static int runPipeline(int ac, char* av[], const char** errmsg,
+                       Image* result, Image* input) {
+  *errmsg = NULL;
+  prefetched = (IOJob**)calloc(ac, sizeof(IOJob*));
+  prefetchAhead = 0;
+  prefetchScan = 1;
+  prefetchLayout = 0;
+  saveFailed = 0;
+  ioPrefetch(ac, av);
+
+  InstrBegin("pipeline");
+  int err = (jobs > 1 && budget == 0) ? schedRun(ac, av, errmsg) : -1;
+  if (err < 0) {  // one step after another
+    err = 0;
+    for (int k = 1; err == 0 && k < ac; k += (opFlags(av[k]) & OPERAND) ? 2 : 1) {
+      tick++;
+      InstrBegin((opFlags(av[k]) & LOADS) ? "load" : av[k]);
+      err = runCached(k, nbuf, ac, av, stdout, stderr, errmsg);
+      InstrEnd();
+    }
+  }
+  
+  // Wait for background I/O, and destroy remaining images
+  int errsave = errno;
+  ioWaitImage(NULL);
+  errno = errsave;
+  if (err == 0 && saveFailed) {
+    err = 4;
+    errno = failedSave.errnum;
+    *errmsg = failedSave.errmsg;
+  }
+  for (int i = 0; i < ac; i++) {
+    if (prefetched[i] != NULL) {  // loaded, but not used
+      ioWait(prefetched[i]);
+      ImageDestroy(&prefetched[i]->img);
+      free(prefetched[i]);
+    }
+  }
+  free(prefetched);
+  prefetched = NULL;
+  if (result != NULL) {
+    *result = *input = NULL;
+    if (err == 0 && nbuf > 0 && (*result = bufTake(nbuf-1)) == NULL) err = 4;
+    if (nbuf > 1 && buf[0].img != NULL) *input = bufTake(0);
+  }
+  bufClear();
+  InstrEnd();
+  return err;
+}
+
+// Server mode
+
+// Run the pipelines read, one per line, from in.
+// Output goes to stdout, followed by a status line for each pipeline.
+// Returns 1 if a shutdown was requested.
+static int serveStream(FILE* in) {
+  char* line = NULL;
+  size_t len = 0;
+  int shutdown = 0;
+  while (!shutdown && getline(&line, &len, in) != -1) {
+    // Split line into arguments (av[0] is the program name)
+    int ac = 1;
+    char* av[strlen(line)/2 + 2];
+    av[0] = program_name;
+    for (char* t = strtok(line, " \t\r\n"); t != NULL; t = strtok(NULL, " \t\r\n")) {
+      av[ac++] = t;
+    }
+    if (ac == 1) continue;
+    if (strcmp(av[1], "quit") == 0) break;
+    shutdown = (strcmp(av[1], "shutdown") == 0);
+    if (shutdown) break;
+
+    // Settings changed by the pipeline apply to it only, not to later ones
+    size_t budgetSave = budget;
+    PixelLayout layoutSave = ImageDefaultLayout();
+    const char* kernelsSave = ImageKernels();
+    const char* errmsg;
+    errno = 0;
+    int err = runPipeline(ac, av, &errmsg, NULL, NULL);
+    budget = budgetSave;
+    ImageSetLayout(layoutSave);
+    ImageSetKernels(kernelsSave);
+    if (err == 0) {
+      printf("# OK\n");
+    } else {
+      printf("# ERROR ");
+      printf(errors[err], (errmsg != NULL) ? errmsg : ImageErrMsg());
+      if (errno != 0) printf(": %s", strerror(errno));
+      printf("\n");
+    }
+    fflush(stdout);
+  }
+  free(line);
+  return shutdown;
+}
+
+// Serve pipelines from stdin (if path is NULL) or from connections to a
+// Unix socket at path, one connection at a time.
+// Returns an index into errors[].
+static int serve(const char* path) {
+  if (path == NULL) {
+    serveStream(stdin);
+    return 0;
+  }
+  signal(SIGPIPE, SIG_IGN);  // clients may leave early
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) { errno = ENAMETOOLONG; return 5; }
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) return 5;
+  unlink(path);
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 8) != 0) {
+    close(sock);
+    return 5;
+  }
+  fprintf(stderr, "Serving on %s\n", path);
+  int shutdown = 0;
+  int err = 0;
+  int out = dup(STDOUT_FILENO);
+  while (!shutdown) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM) {
+        err = 5;
+        break;
+      }
+      sleep(1);  // out of resources: wait for some to be released
+      continue;
+    }
+    FILE* in = fdopen(conn, "r");
+    if (in == NULL) { close(conn); continue; }
+    fflush(stdout);
+    dup2(conn, STDOUT_FILENO);  // pipeline output goes to the client
+    shutdown = serveStream(in);
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    fclose(in);
+  }
+  int errsave = (err != 0) ? errno : 0;
+  close(out);
+  close(sock);
+  unlink(path);
+  errno = errsave;
+  return err;
+}
+
+// Stream mode
+//
+// Frames are read from stdin, processed and written to stdout by three
+// threads, so that reading the next frame and writing the previous one
+// overlap with processing.  The stages are joined by bounded queues, so a
+// slow stage stalls the others instead of piling up frames in memory.
+// Written frames go back to the reader through another queue, and their
+// pixel memory is reused for the frames read next (if of the same size).
+
+typedef struct {
+  Image* frame;           // ring of queued frames
+  int cap;                // capacity
+  int head, count;        // first frame, number of frames
+  int closed;             // no more frames will be put (or got)
+  pthread_mutex_t lock;
+  pthread_cond_t cond;    // frame put or got, or queue closed
+} FrameQueue;
+
+static FrameQueue inq, outq, freeq;  // read, processed, and free frames
+
+static int fqInit(FrameQueue* q, int cap) {
+  *q = (FrameQueue){ .cap = cap };
+  q->frame = (Image*)calloc(cap, sizeof(Image));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  return q->frame != NULL;
+}
+
+// Put img at the end of q, waiting while q is full.  If q is closed,
+// img is destroyed instead and 0 is returned.
+static int fqPut(FrameQueue* q, Image img) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->cap && !q->closed) pthread_cond_wait(&q->cond, &q->lock);
+  int ok = !q->closed;
+  if (ok) {
+    q->frame[(q->head + q->count++) % q->cap] = img;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  if (!ok) ImageDestroy(&img);
+  return ok;
+}
+
+// Put img in q if there is room, or else destroy it.
+static void fqOffer(FrameQueue* q, Image img) {
+  pthread_mutex_lock(&q->lock);
+  if (q->count < q->cap && !q->closed) {
+    q->frame[(q->head + q->count++) % q->cap] = img;
+    img = NULL;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  ImageDestroy(&img);
+}
+
+// Get the first frame of q into *imgp.  If wait is nonzero, wait while q
+// is empty and not closed.  Returns 0 if there is no frame.
+static int fqGet(FrameQueue* q, Image* imgp, int wait) {
+  pthread_mutex_lock(&q->lock);
+  while (wait && q->count == 0 && !q->closed) pthread_cond_wait(&q->cond, &q->lock);
+  int ok = q->count > 0;
+  if (ok) {
+    *imgp = q->frame[q->head];
+    q->head = (q->head + 1) % q->cap;
+    q->count--;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+// Close q: frames queued can still be got, but no more can be put.
+static void fqClose(FrameQueue* q) {
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Destroy q and the frames left in it.
+static void fqDestroy(FrameQueue* q) {
+  Image img;
+  while (fqGet(q, &img, 0)) ImageDestroy(&img);
+  free(q->frame);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->cond);
+}
+
+// File and failure of the reader or writer thread
+typedef struct {
+  FILE* f;
+  int failed;
+  int errnum;
+  const char* errmsg;
+  int done;             // thread finished (reader only, under inq lock)
+} StreamEnd;
+
+static StreamEnd rend, wend;  // reader and writer
+
+// Reader thread: read frames from stdin into inq.
+static void* streamReader(void* arg) {
+  StreamEnd* end = (StreamEnd*)arg;
+  for (;;) {
+    Image img = NULL;
+    fqGet(&freeq, &img, 0);  // reuse a written frame, if any
+    int r = ImageRead(end->f, &img);
+    if (r < 0) {
+      end->errnum = errno;
+      end->errmsg = ImageErrMsg();
+      end->failed = 1;
+    }
+    if (r <= 0 || !fqPut(&inq, img)) break;
+  }
+  fqClose(&inq);
+  pthread_mutex_lock(&inq.lock);
+  end->done = 1;
+  pthread_mutex_unlock(&inq.lock);
+  return NULL;
+}
+
+// Writer thread: write the frames in outq to stdout, and hand them over
+// to the reader for reuse.  After a failure, frames are just dropped.
+static void* streamWriter(void* arg) {
+  StreamEnd* end = (StreamEnd*)arg;
+  Image img;
+  while (fqGet(&outq, &img, 1)) {
+    if (!end->failed) {
+      int ok = ImageWrite(img, end->f);
+      end->errmsg = ok ? "Writing frame failed" : ImageErrMsg();
+      if (!ok || fflush(end->f) != 0) {
+        end->errnum = errno;
+        end->failed = 1;
+        fqClose(&inq);  // stop reading
+      }
+    }
+    fqOffer(&freeq, img);
+  }
+  return NULL;
+}
+
+// Run the pipeline in av[1..ac-1] on each frame of the PGM stream on
+// stdin, and write the resulting frames (CURR) to stdout.  Up to depth
+// frames are queued between stages.  Text output of operations goes to
+// stderr.  Returns an index into errors[].
+static int streamRun(int ac, char* av[], int depth, const char** errmsg) {
+  if (depth < 1) depth = 1;
+  signal(SIGPIPE, SIG_IGN);  // the consumer may leave early
+  fflush(stdout);
+  int fd = dup(STDOUT_FILENO);
+  FILE* out = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+  if (out == NULL) return 5;
+  dup2(STDERR_FILENO, STDOUT_FILENO);  // operations' output
+
+  rend = (StreamEnd){ .f = stdin };
+  wend = (StreamEnd){ .f = out };
+  pthread_t reader, writer;
+  int err = 0;
+  int detached = 0;
+  if (!fqInit(&inq, depth) || !fqInit(&outq, depth) || !fqInit(&freeq, depth + 1)) {
+    err = 3;
+  } else if (pthread_create(&reader, NULL, streamReader, &rend) != 0) {
+    err = 4;
+    *errmsg = "Starting reader thread failed";
+  } else if (pthread_create(&writer, NULL, streamWriter, &wend) != 0) {
+    fqClose(&inq);
+    pthread_join(reader, NULL);
+    err = 4;
+    *errmsg = "Starting writer thread failed";
+  } else {
+    Image frame, input;
+    unsigned long n = 0;
+    while (err == 0 && fqGet(&inq, &frame, 1)) {
+      fprintf(stderr, "Frame %lu -> I0\n", n++);
+      if (!bufAppend(nbuf, frame)) { err = 3; break; }
+      err = runPipeline(ac, av, errmsg, &frame, &input);
+      if (input != NULL) fqOffer(&freeq, input);
+      if (err == 0 && frame == NULL) err = 2;  // nothing to write
+      if (err == 0) fqPut(&outq, frame);
+    }
+    fqClose(&inq);  // stop reading after a failure
+    fqClose(&outq);
+    pthread_join(writer, NULL);
+    // After a failure, the reader may be waiting for input that never
+    // comes: do not wait for it (nor destroy the queues it uses).
+    pthread_mutex_lock(&inq.lock);
+    detached = !rend.done;
+    pthread_mutex_unlock(&inq.lock);
+    if (detached) pthread_detach(reader); else pthread_join(reader, NULL);
+    StreamEnd* end = (wend.failed || detached) ? &wend : &rend;
+    if (err == 0 && end->failed) {
+      err = 4;
+      errno = end->errnum;
+      *errmsg = end->errmsg;
+    }
+  }
+  int errsave = errno;
+  fqDestroy(&outq);
+  if (!detached) {
+    fqDestroy(&inq);
+    fqDestroy(&freeq);
+  }
+  fclose(out);
+  errno = errsave;
+  return err;
+}
+
 int main(int ac, char* av[]) {
   program_name = av[0];
   if (ac <= 1) {
@@ -92,137 +2130,48 @@ int main(int ac, char* av[]) {
   }
 
   ImageInit();
+  bufLockInit();
 
-  int err = 0;
-  int x, y, w, h;
-
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
-
-  int k = 1;
-  while (k < ac) {
-    if (strcmp(av[k], "info") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
-      uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
-    } else if (strcmp(av[k], "tic") == 0) {
-      InstrReset();
-    } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      uint8 thr;
-      if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      double factor;
-      if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
-    } else if (strcmp(av[k], "create") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
-      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "rotate") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "mirror") == 0) {
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "crop") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    } else if (strcmp(av[k], "paste") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
-    } else if (strcmp(av[k], "blend") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 2) { err = 2; break; }
-      double alpha;
-      if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
-    } else if (strcmp(av[k], "locate") == 0) {
-      if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
-      } else {
-        printf("# NOTFOUND\n");
-      }
-    } else if (strcmp(av[k], "blur") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      int dx; int dy;
-      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
-    } else if (strcmp(av[k], "save") == 0) {
-      if (++k >= ac) { err = 1; break; }
-      if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
-    } else {  // image file
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
-    }
-    k++;
+  char* env = getenv("IMAGETOOL_BUDGET");
+  if (env != NULL && !parseBytes(env, &budget)) {
+    error(5, 0, "Invalid IMAGETOOL_BUDGET: %s", env);
   }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  env = getenv("IMAGETOOL_PREFETCH");
+  if (env != NULL) prefetchDepth = atoi(env);
+  env = getenv("IMAGETOOL_JOBS");
+  jobs = (env != NULL) ? atoi(env) : ImageThreads();
+  if (getenv("IMAGETOOL_PROFILE") != NULL) InstrEnableRegions(1);
+  env = getenv("IMAGETOOL_CACHE_SIZE");
+  if (env != NULL && !parseBytes(env, &cacheCap)) {
+    error(5, 0, "Invalid IMAGETOOL_CACHE_SIZE: %s", env);
+  }
+  env = getenv("IMAGETOOL_CACHE");
+  if (env != NULL && env[0] != '\0') {
+    if (mkdir(env, 0777) != 0 && errno != EEXIST) {
+      error(5, errno, "Cannot create cache directory %s", env);
+    }
+    errno = 0;
+    cacheDir = env;
+    InstrName[1] = "cachehits";
+    InstrName[2] = "cachemisses";
   }
 
-  error(err, errno, errors[err], ImageErrMsg());
+  int err;
+  const char* errmsg = NULL;
+  if (strcmp(av[1], "serve") == 0) {
+    if (ac > 3) error(5, 0, "\n%s", USAGE);
+    err = serve((ac == 3) ? av[2] : NULL);
+  } else if (strcmp(av[1], "stream") == 0) {
+    av[1] = av[0];
+    err = streamRun(ac - 1, av + 1, prefetchDepth, &errmsg);
+  } else {
+    err = runPipeline(ac, av, &errmsg, NULL, NULL);
+  }
+  ioFinish();
+  while (nkept > 0) keptDrop(kept[0].name);
+  free(kept);
+  if (InstrRegionsEnabled()) InstrReport();
+
+  error(err, errno, errors[err], (errmsg != NULL) ? errmsg : ImageErrMsg());
   return 0;
 }
-
@@ -9,7 +9,8 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// // Calibration (measuring the CTU) is done lazily, the first time
+/// // InstrPrint or InstrGetCTU needs it, and cached per machine.
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -22,6 +23,9 @@
 #include "instrumentation.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -32,8 +36,23 @@ double cpu_time(void) ; ///
 // GNU/Linux and MacOS code to measure elapsed time
 //
 
+#include <sys/stat.h>
 #include <time.h>
 
+// Wall-clock time in seconds
+static double wall_time(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+// Cpu time of this thread in seconds
+static double thread_time(void) {
+  struct timespec t;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) != 0) return -1.0;
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
 double cpu_time(void) {
   struct timespec current_time;
 
@@ -66,10 +85,15 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+// No separate wall-clock or thread time here
+static double wall_time(void) { return cpu_time(); }
+static double thread_time(void) { return cpu_time(); }
+
 #endif
 
 /// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Each thread has its own counters.
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -79,8 +103,103 @@ char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
 /// Cpu_time read on previous reset (~seconds)
 double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
-double InstrCTU = 1.0;  ///extern
+/// Calibrated Time Unit (in seconds, 0 until known: use InstrGetCTU)
+double InstrCTU = 0.0;  ///extern
+
+// Calibration cache
+//
+// The cache file holds three lines: host name, cpu model and CTU.
+// A cache written on another host or cpu model is ignored.
+
+// Put the name of the calibration cache file in path (empty if unknown).
+static void cachePath(char* path, size_t size) {
+  const char* env = getenv("INSTR_CTU_CACHE");
+  const char* dir;
+  path[0] = '\0';
+  if (env != NULL) {
+    snprintf(path, size, "%s", env);
+  } else if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0') {
+    snprintf(path, size, "%s/instr-ctu", dir);
+  } else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+    snprintf(path, size, "%s/.cache/instr-ctu", dir);
+  }
+}
+
+// Put a "host\ncpu model" line pair identifying this machine in id.
+static void machineId(char* id, size_t size) {
+  char host[256] = "unknown";
+  char model[256] = "unknown";
+  int errsave = errno;
+#if defined(__linux__) || defined(__APPLE__)
+  FILE* f = fopen("/proc/sys/kernel/hostname", "r");
+  if (f != NULL) {
+    if (fgets(host, sizeof(host), f) == NULL) strcpy(host, "unknown");
+    fclose(f);
+  }
+  f = fopen("/proc/cpuinfo", "r");
+  if (f != NULL) {
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      char* colon = strchr(line, ':');
+      if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+        snprintf(model, sizeof(model), "%s", colon + 1 + (colon[1] == ' '));
+        break;
+      }
+    }
+    fclose(f);
+  }
+#endif
+  host[strcspn(host, "\n")] = '\0';
+  model[strcspn(model, "\n")] = '\0';
+  snprintf(id, size, "%s\n%s", host, model);
+  errno = errsave;
+}
+
+// Read the CTU from the cache, if valid for this machine.
+// Returns 0 if there is no valid cache.  Preserves errno.
+static int cacheRead(double* ctu) {
+  char path[1024], id[600], host[256] = "", model[256] = "", buf[600];
+  cachePath(path, sizeof(path));
+  if (path[0] == '\0') return 0;
+  int errsave = errno;
+  FILE* f = fopen(path, "r");
+  errno = errsave;
+  if (f == NULL) return 0;
+  machineId(id, sizeof(id));
+  // first two lines must match id
+  int ok = fgets(host, sizeof(host), f) != NULL && fgets(model, sizeof(model), f) != NULL;
+  host[strcspn(host, "\n")] = '\0';
+  model[strcspn(model, "\n")] = '\0';
+  snprintf(buf, sizeof(buf), "%s\n%s", host, model);
+  ok = ok && strcmp(buf, id) == 0 && fscanf(f, "%lf", ctu) == 1 && *ctu > 0.0;
+  fclose(f);
+  return ok;
+}
+
+// Write ctu to the cache (failures are ignored: the cache is optional).
+// Preserves errno.
+static void cacheWrite(double ctu) {
+  char path[1024], id[600];
+  cachePath(path, sizeof(path));
+  if (path[0] == '\0') return;
+  machineId(id, sizeof(id));
+  int errsave = errno;
+  FILE* f = fopen(path, "w");
+#if defined(__linux__) || defined(__APPLE__)
+  char* slash = strrchr(path, '/');
+  if (f == NULL && slash != NULL && slash != path) {  // make its directory
+    *slash = '\0';
+    mkdir(path, 0755);
+    *slash = '/';
+    f = fopen(path, "w");
+  }
+#endif
+  if (f != NULL) {
+    fprintf(f, "%s\n%.9g\n", id, ctu);
+    fclose(f);
+  }
+  errno = errsave;
+}
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
@@ -99,6 +218,15 @@ void InstrCalibrate(void) { ///
     //printf("%d %d %d\n", i, j, k);  // debug
   }
   InstrCTU = cpu_time() - time;
+  cacheWrite(InstrCTU);
+}
+
+/// Get the CTU, calibrating only if needed.
+double InstrGetCTU(void) { ///
+  if (InstrCTU <= 0.0 && !cacheRead(&InstrCTU)) {
+    InstrCalibrate();
+  }
+  return InstrCTU;
 }
 
 /// Reset counters to zero and store cpu_time.
@@ -113,7 +241,7 @@ void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
@@ -127,3 +255,262 @@ void InstrPrint(void) { ///
   puts("");
 }
 
+
+
+// Timing regions
+//
+// Regions form a tree, shared by all threads, where each node aggregates
+// the calls of a region with a given name and parent.  Each thread keeps a
+// stack of its open regions, with the times and counters at their start.
+// An entry with a NULL name stands for a region opened while neither
+// regions nor trace events were being recorded.
+
+typedef struct Region Region;
+struct Region {
+  char* name;
+  Region* parent;
+  Region* child;  // first child
+  Region* next;   // next sibling
+  unsigned long calls;
+  double wall, cpu;
+  unsigned long count[NUMCOUNTERS];
+};
+
+static Region rootRegion = { .name = "" };
+static pthread_mutex_t regionLock = PTHREAD_MUTEX_INITIALIZER;
+static int regionsOn = 0;
+
+#define MAXDEPTH 64
+static _Thread_local struct {
+  const char* name;
+  Region* region;  // NULL if regions are not recorded
+  double wall, cpu;
+  unsigned long count[NUMCOUNTERS];
+} regionStack[MAXDEPTH];
+static _Thread_local int regionDepth = 0;
+
+static void traceEvent(const char* name, double start, double dur,
+                       const unsigned long* count);
+static int traceOn = 0;
+
+/// Enable (on != 0) or disable recording of timing regions.
+void InstrEnableRegions(int on) { ///
+  regionsOn = on;
+}
+
+/// Are timing regions being recorded?
+int InstrRegionsEnabled(void) { ///
+  return regionsOn;
+}
+
+// Last child of r (NULL if none)
+static Region* lastChild(Region* r) {
+  Region* c = r->child;
+  while (c != NULL && c->next != NULL) c = c->next;
+  return c;
+}
+
+// Find child name of parent, adding it if needed.  Returns NULL if out of
+// memory.  Must be called with regionLock held.
+static Region* regionChild(Region* parent, const char* name) {
+  for (Region* r = parent->child; r != NULL; r = r->next) {
+    if (strcmp(r->name, name) == 0) return r;
+  }
+  Region* r = (Region*)calloc(1, sizeof(Region));
+  if (r == NULL) return NULL;
+  r->name = strdup(name);
+  if (r->name == NULL) { free(r); return NULL; }
+  r->parent = parent;
+  // append, so the report keeps the order of first calls
+  Region* last = lastChild(parent);
+  if (last == NULL) parent->child = r; else last->next = r;
+  return r;
+}
+
+/// Open a region named name, nested in the innermost open region.
+void InstrBegin(const char* name) { ///
+  int d = regionDepth++;
+  if (d >= MAXDEPTH) return;  // too deep: not recorded
+  regionStack[d].name = NULL;
+  if (!regionsOn && !traceOn) return;
+  Region* r = NULL;
+  if (regionsOn) {
+    // parent is the innermost recorded region
+    Region* parent = &rootRegion;
+    for (int i = d - 1; i >= 0; i--) {
+      if (regionStack[i].region != NULL) { parent = regionStack[i].region; break; }
+    }
+    pthread_mutex_lock(&regionLock);
+    r = regionChild(parent, name);
+    pthread_mutex_unlock(&regionLock);
+  }
+  regionStack[d].name = name;
+  regionStack[d].region = r;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    regionStack[d].count[i] = InstrCount[i];
+  regionStack[d].cpu = thread_time();
+  regionStack[d].wall = wall_time();
+}
+
+/// Close the innermost open region.
+void InstrEnd(void) { ///
+  if (regionDepth == 0) return;  // unbalanced
+  int d = --regionDepth;
+  if (d >= MAXDEPTH || regionStack[d].name == NULL) return;
+  double wall = wall_time() - regionStack[d].wall;
+  double cpu = thread_time() - regionStack[d].cpu;
+  unsigned long count[NUMCOUNTERS];
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    count[i] = InstrCount[i] - regionStack[d].count[i];
+  if (traceOn) traceEvent(regionStack[d].name, regionStack[d].wall, wall, count);
+  Region* r = regionStack[d].region;
+  if (r == NULL) return;
+  pthread_mutex_lock(&regionLock);
+  r->calls++;
+  r->wall += wall;
+  r->cpu += cpu;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    r->count[i] += count[i];
+  pthread_mutex_unlock(&regionLock);
+}
+
+// Print region r and its descendants, indented by depth.
+static void reportRegion(Region* r, int depth) {
+  fprintf(stderr, "%*s%-*.*s%10lu%12.6f%12.6f", 2*depth, "",
+          32 - 2*depth, 32 - 2*depth, r->name, r->calls, r->wall, r->cpu);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      fprintf(stderr, "%15lu", r->count[i]);
+  fprintf(stderr, "\n");
+  if (depth < 15) {
+    for (Region* c = r->child; c != NULL; c = c->next) reportRegion(c, depth + 1);
+  }
+}
+
+/// Print the tree of regions (to stderr).
+void InstrReport(void) { ///
+  pthread_mutex_lock(&regionLock);
+  fprintf(stderr, "#%-31s%10s%12s%12s", "region", "calls", "wall", "cpu");
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    if (InstrName[i] != NULL)
+      fprintf(stderr, "%15.15s", InstrName[i]);
+  fprintf(stderr, "\n");
+  for (Region* c = rootRegion.child; c != NULL; c = c->next) reportRegion(c, 0);
+  pthread_mutex_unlock(&regionLock);
+}
+
+
+// Trace events
+//
+// Each closed region becomes a complete ("X") event in a ring buffer of
+// the thread that ran it, so recording needs no locks.  Buffers are
+// registered in a global list on the first event of each thread, and
+// outlive it.  At exit, the most recent TRACECAP events of each thread
+// are written as Chrome trace-event JSON (chrome://tracing, Perfetto).
+
+#define TRACECAP (1 << 14)  // events per thread
+
+typedef struct {
+  char name[40];
+  double start, dur;  // seconds
+  unsigned long count[NUMCOUNTERS];
+} TraceEvent;
+
+typedef struct TraceBuf TraceBuf;
+struct TraceBuf {
+  int tid;
+  unsigned long n;  // events recorded (the last TRACECAP are kept)
+  TraceBuf* next;
+  TraceEvent ev[TRACECAP];
+};
+
+static TraceBuf* traceBufs = NULL;
+static int traceThreads = 0;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local TraceBuf* traceBuf = NULL;
+static char* traceFile = NULL;
+static FILE* traceOut = NULL;  // traceFile, opened when tracing starts
+static double traceStart;
+
+// Record an event in this thread's buffer.
+static void traceEvent(const char* name, double start, double dur,
+                       const unsigned long* count) {
+  TraceBuf* b = traceBuf;
+  if (b == NULL) {  // first event of this thread
+    b = (TraceBuf*)malloc(sizeof(TraceBuf));
+    if (b == NULL) return;
+    b->n = 0;
+    pthread_mutex_lock(&traceLock);
+    b->tid = ++traceThreads;
+    b->next = traceBufs;
+    traceBufs = b;
+    pthread_mutex_unlock(&traceLock);
+    traceBuf = b;
+  }
+  TraceEvent* e = &b->ev[b->n % TRACECAP];
+  snprintf(e->name, sizeof(e->name), "%s", name);
+  e->start = start;
+  e->dur = dur;
+  memcpy(e->count, count, sizeof(e->count));
+  b->n++;
+}
+
+// Write recorded events to traceFile (called at exit).
+static void traceWrite(void) {
+  traceOn = 0;
+  FILE* f = traceOut;
+  pthread_mutex_lock(&traceLock);
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  const char* sep = "";
+  for (TraceBuf* b = traceBufs; b != NULL; b = b->next) {
+    fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+            sep, b->tid, b->tid);
+    sep = ",\n";
+    unsigned long first = (b->n > TRACECAP) ? b->n - TRACECAP : 0;
+    for (unsigned long k = first; k < b->n; k++) {
+      TraceEvent* e = &b->ev[k % TRACECAP];
+      fprintf(f, "%s{\"name\": \"", sep);
+      for (const char* c = e->name; *c != '\0'; c++) {  // escape JSON string
+        if (*c == '"' || *c == '\\') fputc('\\', f);
+        if ((unsigned char)*c >= ' ') fputc(*c, f);
+      }
+      fprintf(f, "\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+              "\"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+              b->tid, 1e6*(e->start - traceStart), 1e6*e->dur);
+      const char* asep = "";
+      for (int i = 0; i < NUMCOUNTERS; i++) {
+        if (InstrName[i] != NULL) {
+          fprintf(f, "%s\"%s\": %lu", asep, InstrName[i], e->count[i]);
+          asep = ", ";
+        }
+      }
+      fprintf(f, "}}");
+    }
+  }
+  fprintf(f, "\n]}\n");
+  pthread_mutex_unlock(&traceLock);
+  if (fclose(f) != 0) perror(traceFile);
+}
+
+/// Start recording trace events, to be written to filename at exit.
+int InstrTraceStart(const char* filename) { ///
+  if (traceFile != NULL) {  // only one trace per run
+    errno = EALREADY;
+    return 0;
+  }
+  // Open the file now, so that failures are reported now, not at exit
+  traceOut = fopen(filename, "w");
+  if (traceOut == NULL) return 0;
+  traceFile = strdup(filename);
+  if (traceFile == NULL || atexit(traceWrite) != 0) {
+    fclose(traceOut);
+    traceOut = NULL;
+    free(traceFile);
+    traceFile = NULL;
+    return 0;
+  }
+  traceStart = wall_time();
+  traceOn = 1;
+  return 1;
+}
@@ -9,7 +9,8 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// // Calibration (measuring the CTU) is done lazily, the first time
+/// // InstrPrint or InstrGetCTU needs it, and cached per machine.
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -18,6 +19,16 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// // To see where time goes, enable timing regions, and name them:
+/// InstrEnableRegions(1);
+/// InstrBegin("sort");  // regions may nest, and are kept per thread
+/// ...
+/// InstrEnd();
+/// InstrReport();  // to show the tree of regions, aggregated by name
+///
+/// // Or record each region as a trace event, written at exit:
+/// InstrTraceStart("trace.json");
 
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
@@ -29,7 +40,9 @@ double cpu_time(void) ; ///
 #define NUMCOUNTERS 10
 
 /// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Each thread has its own counters.  Threads that do counted work on
+/// behalf of another should hand their counts over to it.
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -37,18 +50,66 @@ extern char* InstrName[NUMCOUNTERS];  ///extern
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
-/// Calibrated Time Unit (in seconds, initially 1s)
+/// Calibrated Time Unit (in seconds, 0 until known: use InstrGetCTU)
 extern double InstrCTU;  ///extern
 
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
+/// The result is saved in the calibration cache file (see InstrGetCTU).
 void InstrCalibrate(void) ;
 
+/// Get the CTU, calibrating only if needed.
+/// The CTU is read from a cache file if it was measured before on a cpu
+/// of the same model on this host.  The file is $INSTR_CTU_CACHE, or
+/// else $XDG_CACHE_HOME/instr-ctu, or else $HOME/.cache/instr-ctu.
+/// If the cache is missing or stale, InstrCalibrate is called.
+double InstrGetCTU(void) ;
+
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
 void InstrPrint(void) ;
 
+/// Timing regions
+
+/// Enable (on != 0) or disable recording of timing regions.
+/// When disabled (the default), InstrBegin and InstrEnd do almost nothing.
+void InstrEnableRegions(int on) ;
+
+/// Are timing regions being recorded?
+int InstrRegionsEnabled(void) ;
+
+/// Open a region named name, nested in the innermost open region of this
+/// thread.  Regions with the same name and parent are aggregated: the
+/// report shows their number of calls, and total wall time, cpu time of
+/// the thread and counter increments.
+void InstrBegin(const char* name) ;
+
+/// Close the innermost open region of this thread.
+void InstrEnd(void) ;
+
+/// Print the tree of regions (to stderr).
+void InstrReport(void) ;
+
+/// Start recording trace events, to be written to file filename at exit.
+/// Each closed region (enabled or not) becomes an event, with its thread,
+/// start time, duration and counter increments, in Chrome trace-event
+/// JSON format (open in chrome://tracing or ui.perfetto.dev).
+/// Only the most recent events of each thread are kept.
+/// The file is created right away.  There is only one trace per run.
+/// Returns 0 on failure (errno is EALREADY if already tracing).
+int InstrTraceStart(const char* filename) ;
+
+/// Open a region that closes at the end of the enclosing block.
+/// (Needs gcc or clang.  Elsewhere, it does nothing.)
+#if defined(__GNUC__)
+static inline void InstrEndScope(int* scope) { (void)scope; InstrEnd(); }
+#define InstrScope(name) \
+  __attribute__((cleanup(InstrEndScope))) int InstrScope_ = (InstrBegin(name), 0)
+#else
+#define InstrScope(name)
+#endif
+
 #endif
 